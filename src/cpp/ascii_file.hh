@@ -1,48 +1,312 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cstdint>
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 #include <string>
-#include <sstream>
 
 #include <vec.hh>
+#include <line_reader.hh>
+#include <loader.hh>
+#include <util.hh>
 
 struct ascii_file {
 
 /**
- * Currently loads in dense vector format
+ * Scans a decimal floating point number starting at p (no leading
+ * whitespace), returning the end of it, or p if there is none.
+ *
+ * Numbers with at most 19 significant digits whose mantissa fits in a
+ * double exactly and whose decimal exponent is within 10^22 are converted
+ * with a single multiply or divide, which is correctly rounded; everything
+ * else (long mantissas, large exponents, inf, nan, hex) goes to strtod.
+ */
+static inline const char *
+scan_double(const char *p, const char *end, double &out)
+{
+  static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+  const char *q = p;
+  bool neg = false;
+  if (q < end && (*q == '-' || *q == '+'))
+    neg = (*q++ == '-');
+  uint64_t mant = 0;
+  int ndigits = 0, exp10 = 0;
+  bool any = false;
+  for (; q < end && unsigned(*q - '0') < 10; q++, any = true) {
+    if (ndigits < 19) {
+      mant = mant * 10 + (*q - '0');
+      ndigits += (mant != 0);
+    } else {
+      exp10++;
+      ndigits++;
+    }
+  }
+  if (q < end && *q == '.') {
+    for (q++; q < end && unsigned(*q - '0') < 10; q++, any = true) {
+      if (ndigits < 19) {
+        mant = mant * 10 + (*q - '0');
+        ndigits += (mant != 0);
+        exp10--;
+      } else {
+        ndigits++;
+      }
+    }
+  }
+  if (!any || (q < end && (*q == 'x' || *q == 'X')))
+    return slow_scan_double(p, end, out);
+  if (q < end && (*q == 'e' || *q == 'E')) {
+    const char *r = q + 1;
+    bool eneg = false;
+    if (r < end && (*r == '-' || *r == '+'))
+      eneg = (*r++ == '-');
+    if (r < end && unsigned(*r - '0') < 10) {
+      int e = 0;
+      for (; r < end && unsigned(*r - '0') < 10; r++)
+        if (e < 100000)
+          e = e * 10 + (*r - '0');
+      exp10 += eneg ? -e : e;
+      q = r;
+    }
+  }
+  if (ndigits > 19 || mant > (uint64_t(1) << 53) ||
+      exp10 < -22 || exp10 > 22)
+    return slow_scan_double(p, end, out);
+  double v = double(mant);
+  v = exp10 < 0 ? v / exact_pow10[-exp10] : v * exact_pow10[exp10];
+  out = neg ? -v : v;
+  return q;
+}
+
+// strtod on a NUL terminated copy of the token at p
+static const char *
+slow_scan_double(const char *p, const char *end, double &out)
+{
+  char buf[128];
+  size_t n = 0;
+  while (p + n < end && n + 1 < sizeof(buf) &&
+         p[n] != ' ' && p[n] != '\t' && p[n] != '\r' && p[n] != '\n')
+    n++;
+  memcpy(buf, p, n);
+  buf[n] = '\0';
+  char *q;
+  out = strtod(buf, &q);
+  return p + (q - buf);
+}
+
+/**
+ * Parses a single line [begin, end) (no newline) of the form
+ *   label value value ...
+ * calling push(value) for each value. returns false if the line is
+ * malformed. the label must be -1 or 1 unless real_labels, and throws
+ * otherwise (as run_sink::commit() does for the other loaders).
+ */
+template <typename Push>
+static inline bool
+parse_fields(const char *begin, const char *end, double &y, Push push,
+             bool real_labels = false)
+{
+  const char *p = begin;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  const char *q = scan_double(p, end, y);
+  if (q == p)
+    return false;
+  if (!real_labels && y != -1.0 && y != 1.0)
+    throw std::runtime_error("real-valued label in a classification file");
+  p = q;
+  for (;;) {
+    if (p < end && *p != ' ' && *p != '\t')
+      return false;
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    if (p == end)
+      break;
+    double x;
+    q = scan_double(p, end, x);
+    if (q == p)
+      return false;
+    push(x);
+    p = q;
+  }
+  return true;
+}
+
+// the label of a line as seen by a sampler: 1 if positive, 0 if not, and
+// 2 if there is none (such lines are kept, to be rejected by the parse)
+static inline uint8_t
+label_class(const char *begin, const char *end)
+{
+  while (begin < end && (*begin == ' ' || *begin == '\t'))
+    begin++;
+  double y;
+  if (scan_double(begin, end, y) == begin)
+    return 2;
+  return y > 0.0;
+}
+
+static inline bool
+keep_line(const load_context &ctx, size_t line, uint8_t label)
+{
+  return label == 2 || ctx.sampler->keep(line, label ? 1.0 : -1.0);
+}
+
+// parses a single line into a dense vector. returns false if the line is
+// malformed.
+static bool
+parse_line(const char *begin, const char *end, vec_t &xv, double &y,
+           size_t size_hint = 0, bool real_labels = false)
+{
+  standard_vec_t sv;
+  sv.reserve(size_hint);
+  if (!parse_fields(begin, end, y, [&sv](double x) { sv.push_back(x); },
+                    real_labels))
+    return false;
+  xv = std::move(sv);
+  return true;
+}
+
+/**
+ * Loads in dense vector format.
+ *
+ * The file is mapped and split into line-aligned ranges, one per thread.
+ * A first pass counts the lines of each range, so that the second can
+ * parse every range in parallel straight into its final rows. With arenas
+ * in ctx, and all rows as wide as the first one, the rows are laid out
+ * back to back in one block (see dataset::dense()).
+ *
+ * With a sampler in ctx, the first pass also notes the label of every
+ * line, so that only the lines kept get a row and the others are never
+ * parsed; the sampled rows are still laid out back to back.
  */
 int
 read_feature_file(
     const std::string &filename,
-    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n) const
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx = load_context()) const
 {
-  std::ifstream ifs(filename);
-  std::string line;
-  n = 0;
-  while (std::getline(ifs, line)) {
-		std::istringstream l(line);
-
-    // class
-    double y;
-    l >> y;
-    ALWAYS_ASSERT(y == -1.0 || y == 1.0);
-    ys.as_standard_ref().data().push_back(y);
-
-    vec_t xv; // dense vec
-    xv.reserve(n);
-    while (l.good()) {
-      double x;
-      l >> x >> std::ws;
-      xv.as_standard_ref().data().push_back(x);
-    }
-    n = std::max(size_t(n), xv.as_standard_ref().size());
-    xs.push_back(std::move(xv));
+  static const size_t MinBytesPerThread = 1 << 20;
+  mapped_text_file f(filename);
+  const size_t nthreads = std::max(size_t(1), std::min(
+        size_t(util::ncpus_online()), f.size() / MinBytesPerThread));
+  const auto ranges = f.split_lines(nthreads);
+
+  // first_line[i] is the index in the file of the first line of range i,
+  // first_row[i] that of its first row; they differ once lines are sampled
+  std::vector<size_t> first_line(nthreads + 1, 0);
+  std::vector<std::vector<uint8_t>> labels(ctx.sampler ? nthreads : 0);
+  util::parallel_run(nthreads, [&](size_t i) {
+    size_t nlines = 0;
+    for_each_line(ranges[i].first, ranges[i].second,
+        [&](const char *begin, const char *end) {
+      if (ctx.sampler)
+        labels[i].push_back(label_class(begin, end));
+      nlines++;
+    });
+    first_line[i + 1] = nlines;
+  });
+  for (size_t i = 0; i < nthreads; i++)
+    first_line[i + 1] += first_line[i];
+  std::vector<size_t> first_row(first_line);
+  if (ctx.sampler) {
+    util::parallel_run(nthreads, [&](size_t i) {
+      size_t nkept = 0;
+      for (size_t j = 0; j < labels[i].size(); j++)
+        nkept += keep_line(ctx, first_line[i] + j, labels[i][j]);
+      first_row[i + 1] = nkept;
+    });
+    for (size_t i = 0; i < nthreads; i++)
+      first_row[i + 1] += first_row[i];
+  }
+  const size_t nrows = first_row[nthreads];
+
+  // the width of the first row sizes the layout
+  size_t width = 0;
+  for (const char *p = f.begin(); p < f.end() && !width; ) {
+    const char *nl =
+      static_cast<const char *>(memchr(p, '\n', f.end() - p));
+    const char *e = nl ? nl : f.end();
+    for_each_line(p, e, [&width, &ctx](const char *lb, const char *le) {
+      double y;
+      parse_fields(lb, le, y, [&width](double) { width++; }, ctx.real_labels);
+    });
+    p = e + 1;
+  }
+  width = std::max(width, size_t(1));
+
+  const size_t off = xs.size();
+  ALWAYS_ASSERT(ys.size() == off);
+  xs.resize(off + nrows);
+  ys.resize(off + nrows);
+  const size_t row_bytes = width * sizeof(double);
+  char * const block = (ctx.arenas && nrows) ?
+    ctx.arenas->map_block(nrows * row_bytes) : nullptr;
+
+  std::vector<double> ws((ctx.sampler && ctx.weights) ? nrows : 0);
+  std::atomic<bool> ok(true);
+  std::vector<size_t> widths(nthreads, 0);
+  std::vector<feature_stats> stats(ctx.stats ? nthreads : 0, ctx.make_stats());
+  // a failed parse leaves xs and ys as they were
+  auto undo = [&xs, &ys, off]() {
+    xs.resize(off);
+    ys.resize(off);
+  };
+  try {
+    util::parallel_run(nthreads, [&](size_t i) {
+      mem::arena * const a = block ?
+        ctx.arenas->make(block + first_row[i] * row_bytes,
+                         block + first_row[i + 1] * row_bytes) :
+        nullptr;
+      vec_t * const px = xs.data() + off;
+      double * const py = ys.data().data() + off;
+      size_t row = first_row[i], line = 0;
+      for_each_line(ranges[i].first, ranges[i].second,
+          [&](const char *begin, const char *end) {
+        if (!ok.load(std::memory_order_relaxed))
+          return;
+        if (ctx.sampler) {
+          const size_t j = line++;
+          if (!keep_line(ctx, first_line[i] + j, labels[i][j]))
+            return;
+        }
+        vec_t xv(vec_t::std_tag_t(), a);
+        xv.reserve(width);
+        standard_vec_t &sv = xv.as_standard_ref();
+        if (!parse_fields(begin, end, py[row],
+                          [&sv](double x) { sv.push_back(x); },
+                          ctx.real_labels)) {
+          ok.store(false, std::memory_order_relaxed);
+          return;
+        }
+        widths[i] = std::max(widths[i], sv.size());
+        if (ctx.stats)
+          stats[i].add(xv, py[row]);
+        if (!ws.empty())
+          ws[row] = ctx.sampler->weight(py[row]);
+        px[row++] = std::move(xv);
+      });
+    });
+  } catch (...) {
+    undo();
+    throw;
+  }
+  if (!ok.load()) {
+    undo();
+    return -1;
   }
-  assert(xs.size() == ys.size());
-  return (ifs.peek() == EOF) ? 0 : -1;
+  if (ctx.stats)
+    ctx.merge_stats(stats);
+  if (!ws.empty())
+    ctx.set_weights(off, ws);
+  for (size_t w : widths)
+    n = std::max(size_t(n), w);
+  return 0;
 }
 
 };
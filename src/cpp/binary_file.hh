@@ -1,21 +1,562 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <exception>
+#include <limits>
 #include <fstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include <vec.hh>
+#include <codec.hh>
+#include <loader.hh>
+#include <util.hh>
 
 struct binary_file_header {
   enum class type : uint8_t {
     BINARY_FILE_DENSE = 0x1,
     BINARY_FILE_SPARSE,
+    BINARY_FILE_SPARSE_BLOCKED,
   };
   type t;
 } __attribute__((packed)) ;
 
+/**
+ * Sparse files carry a row offset footer after the last row:
+ *
+ *   [file offset of row k * rows_per_entry (uint64_t)]* (nentries repetitions)
+ *   [binary_row_index_trailer]
+ *
+ * This lets readers split the file across threads without first parsing
+ * every num_features. Files written before the footer existed are still
+ * read; they just need an extra (cheap) indexing pass.
+ */
+struct binary_row_index_trailer {
+  static const uint64_t Magic = 0x78646e69726c7270ULL; // "prlrindx"
+  uint64_t index_offset;
+  uint64_t nentries;
+  uint64_t nrows;
+  uint64_t rows_per_entry;
+  uint64_t nfeatures; // highest feature_idx + 1
+  uint64_t magic;
+} __attribute__((packed)) ;
+
+/**
+ * Streams rows into a sparse file, recording the row offset footer.
+ */
+class binary_sparse_writer {
+public:
+  static const size_t DefaultRowsPerEntry = 1024;
+
+  binary_sparse_writer(const std::string &filename,
+                       size_t rows_per_entry = DefaultRowsPerEntry)
+    : ofs_(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+      rows_per_entry_(rows_per_entry),
+      offset_(0), nrows_(0), nfeatures_(0), closed_(false)
+  {
+    ALWAYS_ASSERT(rows_per_entry_ > 0);
+    if (!ofs_.good())
+      throw std::runtime_error("could not open file");
+    binary_file_header hdr;
+    hdr.t = binary_file_header::type::BINARY_FILE_SPARSE;
+    write_raw(&hdr, sizeof(hdr));
+  }
+
+  ~binary_sparse_writer()
+  {
+    if (!closed_)
+      close();
+  }
+
+  binary_sparse_writer(const binary_sparse_writer &) = delete;
+  binary_sparse_writer &operator=(const binary_sparse_writer &) = delete;
+
+  // the sparse format has no weight column; only blocked files carry them
+  void
+  append(const vec_t &x, double y, double weight = 1.0)
+  {
+    const int8_t classification = static_cast<int32_t>(y);
+    ALWAYS_ASSERT(classification == -1 || classification == 1);
+    if (weight != 1.0)
+      throw std::runtime_error("sparse binary files cannot hold sample weights");
+    if (!(nrows_ % rows_per_entry_))
+      offsets_.push_back(offset_);
+    const uint32_t num_features = x.nnz();
+    write_raw(&classification, sizeof(classification));
+    write_raw(&num_features, sizeof(num_features));
+    x.for_each_nonzero([this](size_t idx, double value) {
+      const uint32_t feature_idx = idx;
+      write_raw(&feature_idx, sizeof(feature_idx));
+      write_raw(&value, sizeof(value));
+    });
+    nfeatures_ = std::max(nfeatures_, x.highest_nonzero_dim());
+    nrows_++;
+  }
+
+  bool
+  close()
+  {
+    if (closed_)
+      return ofs_.good();
+    closed_ = true;
+    binary_row_index_trailer trailer;
+    trailer.index_offset = offset_;
+    trailer.nentries = offsets_.size();
+    trailer.nrows = nrows_;
+    trailer.rows_per_entry = rows_per_entry_;
+    trailer.nfeatures = nfeatures_;
+    trailer.magic = binary_row_index_trailer::Magic;
+    if (!offsets_.empty())
+      write_raw(offsets_.data(), offsets_.size() * sizeof(offsets_[0]));
+    write_raw(&trailer, sizeof(trailer));
+    ofs_.close();
+    return !ofs_.fail();
+  }
+
+  inline size_t get_nrows() const { return nrows_; }
+
+private:
+  inline void
+  write_raw(const void *p, size_t n)
+  {
+    ofs_.write(reinterpret_cast<const char *>(p), n);
+    offset_ += n;
+  }
+
+  std::ofstream ofs_;
+  size_t rows_per_entry_;
+  uint64_t offset_;
+  uint64_t nrows_;
+  size_t nfeatures_;
+  bool closed_;
+  std::vector<uint64_t> offsets_;
+};
+
+/**
+ * Blocked sparse format (v2):
+ *
+ *   [binary_file_header (BINARY_FILE_SPARSE_BLOCKED) |
+ *    block* |
+ *    binary_block_index_entry* (nblocks repetitions) |
+ *    binary_block_trailer]
+ *
+ * Every block holds a run of consecutive rows, stored column by column:
+ *
+ *   [binary_block_header |
+ *    label (int8_t, or double if real-valued)* (nrows repetitions) |
+ *    [weight (double)* (nrows repetitions), if the block has weights] |
+ *    num_features (varint)* (nrows repetitions) |
+ *    feature_idx delta (varint)* (nnz repetitions) |
+ *    value* (nnz repetitions, encoded as per value_type)]
+ *
+ * Index deltas restart at every row (the first delta of a row is its first
+ * feature_idx). Values are stored as doubles, as floats when that is
+ * lossless for the whole block, or omitted entirely when every value in
+ * the block is 1.0 (binary features).
+ *
+ * Sample weights are optional and per block: a block only carries the
+ * weight column (flagged in the high bit of value_type) if one of its rows
+ * has a weight other than 1.0, so unweighted files are unchanged.
+ * Likewise labels are stored as int8_t unless a row of the block has a
+ * label other than -1 or 1 (a regression target); then the whole label
+ * column is stored as doubles, flagged by RealLabelsFlag.
+ *
+ * The trailing block index lets readers decode blocks independently, in
+ * parallel, or seek straight to the block holding a given row.
+ */
+struct binary_block_header {
+  enum class value_type : uint8_t {
+    VALUE_F64 = 0x1,
+    VALUE_F32,
+    VALUE_ONES,
+  };
+  static const uint8_t WeightsFlag = 0x80;
+  static const uint8_t RealLabelsFlag = 0x40;
+  uint32_t nrows;
+  uint32_t nnz;
+  uint32_t idx_bytes; // size of the num_features and delta columns
+  uint8_t vt; // value_type, possibly with WeightsFlag and RealLabelsFlag
+
+  inline value_type
+  values() const
+  {
+    return value_type(vt & ~(WeightsFlag | RealLabelsFlag));
+  }
+
+  inline bool
+  has_weights() const
+  {
+    return vt & WeightsFlag;
+  }
+
+  inline bool
+  has_real_labels() const
+  {
+    return vt & RealLabelsFlag;
+  }
+
+  inline size_t
+  label_bytes() const
+  {
+    return size_t(nrows) * (has_real_labels() ? sizeof(double) : sizeof(int8_t));
+  }
+} __attribute__((packed)) ;
+
+struct binary_block_index_entry {
+  uint64_t offset; // from the start of the file
+  uint64_t first_row;
+  uint32_t nbytes; // including the binary_block_header
+  uint32_t nrows;
+} __attribute__((packed)) ;
+
+struct binary_block_trailer {
+  static const uint64_t Magic = 0x6b6c62726c726170ULL; // "parlrblk"
+  uint64_t index_offset;
+  uint64_t nblocks;
+  uint64_t nrows;
+  uint64_t nfeatures; // highest feature_idx + 1
+  uint64_t magic;
+} __attribute__((packed)) ;
+
+/**
+ * Streams rows into a blocked (v2) file. Rows are buffered one block at a
+ * time, so memory stays bounded by the block size.
+ */
+class binary_block_writer {
+public:
+  static const size_t DefaultRowsPerBlock = 8192;
+
+  binary_block_writer(const std::string &filename,
+                      size_t rows_per_block = DefaultRowsPerBlock)
+    : ofs_(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+      rows_per_block_(rows_per_block),
+      offset_(0), nrows_(0), nfeatures_(0), closed_(false)
+  {
+    ALWAYS_ASSERT(rows_per_block_ > 0);
+    if (!ofs_.good())
+      throw std::runtime_error("could not open file");
+    binary_file_header hdr;
+    hdr.t = binary_file_header::type::BINARY_FILE_SPARSE_BLOCKED;
+    write_raw(&hdr, sizeof(hdr));
+  }
+
+  ~binary_block_writer()
+  {
+    if (!closed_)
+      close();
+  }
+
+  binary_block_writer(const binary_block_writer &) = delete;
+  binary_block_writer &operator=(const binary_block_writer &) = delete;
+
+  void
+  append(const vec_t &x, double y, double weight = 1.0)
+  {
+    labels_.push_back(y);
+    weights_.push_back(weight);
+    codec::varint_append(lens_, x.nnz());
+    size_t last = 0;
+    x.for_each_nonzero([this, &last](size_t idx, double value) {
+      codec::varint_append(deltas_, idx - last);
+      last = idx;
+      values_.push_back(value);
+    });
+    nfeatures_ = std::max(nfeatures_, x.highest_nonzero_dim());
+    if (labels_.size() == rows_per_block_)
+      flush();
+  }
+
+  // writes any buffered rows, the block index and the trailer
+  bool
+  close()
+  {
+    if (closed_)
+      return ofs_.good();
+    closed_ = true;
+    flush();
+    binary_block_trailer trailer;
+    trailer.index_offset = offset_;
+    trailer.nblocks = index_.size();
+    trailer.nrows = nrows_;
+    trailer.nfeatures = nfeatures_;
+    trailer.magic = binary_block_trailer::Magic;
+    if (!index_.empty())
+      write_raw(index_.data(), index_.size() * sizeof(index_[0]));
+    write_raw(&trailer, sizeof(trailer));
+    ofs_.close();
+    return !ofs_.fail();
+  }
+
+  inline size_t get_nrows() const { return nrows_ + labels_.size(); }
+
+private:
+  void
+  flush()
+  {
+    if (labels_.empty())
+      return;
+    binary_block_header bhdr;
+    bhdr.nrows = labels_.size();
+    bhdr.nnz = values_.size();
+    bhdr.idx_bytes = lens_.size() + deltas_.size();
+    bool ones = true, f32 = true;
+    for (auto v : values_) {
+      ones = ones && (v == 1.0);
+      f32 = f32 && (double(float(v)) == v);
+    }
+    const binary_block_header::value_type vt =
+      ones ? binary_block_header::value_type::VALUE_ONES :
+      (f32 ? binary_block_header::value_type::VALUE_F32 :
+             binary_block_header::value_type::VALUE_F64);
+    const bool weighted = std::any_of(weights_.begin(), weights_.end(),
+        [](double w) { return w != 1.0; });
+    const bool real_labels = std::any_of(labels_.begin(), labels_.end(),
+        [](double y) { return y != -1.0 && y != 1.0; });
+    bhdr.vt = uint8_t(vt) |
+      (weighted ? binary_block_header::WeightsFlag : 0) |
+      (real_labels ? binary_block_header::RealLabelsFlag : 0);
+
+    binary_block_index_entry ent;
+    ent.offset = offset_;
+    ent.first_row = nrows_;
+    ent.nrows = bhdr.nrows;
+
+    const uint64_t start = offset_;
+    write_raw(&bhdr, sizeof(bhdr));
+    if (real_labels) {
+      write_raw(labels_.data(), labels_.size() * sizeof(double));
+    } else {
+      std::vector<int8_t> classes(labels_.begin(), labels_.end());
+      write_raw(classes.data(), classes.size());
+    }
+    if (weighted)
+      write_raw(weights_.data(), weights_.size() * sizeof(double));
+    write_raw(lens_.data(), lens_.size());
+    write_raw(deltas_.data(), deltas_.size());
+    if (vt == binary_block_header::value_type::VALUE_F64) {
+      write_raw(values_.data(), values_.size() * sizeof(double));
+    } else if (vt == binary_block_header::value_type::VALUE_F32) {
+      std::vector<float> fs(values_.begin(), values_.end());
+      write_raw(fs.data(), fs.size() * sizeof(float));
+    }
+    ALWAYS_ASSERT(offset_ - start <= std::numeric_limits<uint32_t>::max());
+    ent.nbytes = offset_ - start;
+    index_.push_back(ent);
+
+    nrows_ += labels_.size();
+    labels_.clear();
+    weights_.clear();
+    lens_.clear();
+    deltas_.clear();
+    values_.clear();
+  }
+
+  inline void
+  write_raw(const void *p, size_t n)
+  {
+    ofs_.write(reinterpret_cast<const char *>(p), n);
+    offset_ += n;
+  }
+
+  std::ofstream ofs_;
+  size_t rows_per_block_;
+  uint64_t offset_;
+  uint64_t nrows_;
+  size_t nfeatures_;
+  bool closed_;
+  std::vector<binary_block_index_entry> index_;
+
+  // column buffers for the block being built
+  std::vector<double> labels_;
+  std::vector<double> weights_;
+  std::vector<uint8_t> lens_;
+  std::vector<uint8_t> deltas_;
+  std::vector<double> values_;
+};
+
+/**
+ * Random access reader for blocked (v2) files. read_block() only touches the
+ * bytes of the requested block, so it can be used to stream a file or to
+ * skip to arbitrary blocks. A reader is not thread-safe; open one per thread.
+ */
+class binary_block_reader {
+public:
+  binary_block_reader(const std::string &filename)
+    : ifs_(filename, std::ios::in | std::ios::binary)
+  {
+    if (!ifs_.good())
+      throw std::runtime_error("could not open file");
+    binary_file_header hdr;
+    if (!ifs_.read((char *) &hdr, sizeof(hdr)) ||
+        hdr.t != binary_file_header::type::BINARY_FILE_SPARSE_BLOCKED)
+      throw std::runtime_error("not a blocked binary file");
+    ifs_.seekg(0, std::ios::end);
+    const uint64_t fsize = ifs_.tellg();
+    if (fsize < sizeof(hdr) + sizeof(trailer_))
+      throw std::runtime_error("truncated blocked binary file");
+    ifs_.seekg(fsize - sizeof(trailer_));
+    if (!ifs_.read((char *) &trailer_, sizeof(trailer_)) ||
+        trailer_.magic != binary_block_trailer::Magic)
+      throw std::runtime_error("bad blocked binary file trailer");
+    if (trailer_.index_offset > fsize - sizeof(trailer_) ||
+        trailer_.nblocks * sizeof(binary_block_index_entry) !=
+          fsize - sizeof(trailer_) - trailer_.index_offset)
+      throw std::runtime_error("bad blocked binary file index");
+    index_.resize(trailer_.nblocks);
+    ifs_.seekg(trailer_.index_offset);
+    if (!index_.empty() &&
+        !ifs_.read((char *) index_.data(), index_.size() * sizeof(index_[0])))
+      throw std::runtime_error("could not read block index");
+    // blocks tile the rows in order: loaders decode block i straight into
+    // rows [first_row, first_row + nrows), and find_block() bisects on it
+    uint64_t next_row = 0;
+    for (const binary_block_index_entry &e : index_) {
+      if (e.first_row != next_row || e.nrows > trailer_.nrows - next_row)
+        throw std::runtime_error("bad blocked binary file index");
+      next_row += e.nrows;
+    }
+    if (next_row != trailer_.nrows)
+      throw std::runtime_error("bad blocked binary file index");
+  }
+
+  inline size_t nblocks() const { return index_.size(); }
+  inline size_t nrows() const { return trailer_.nrows; }
+  inline size_t nfeatures() const { return trailer_.nfeatures; }
+
+  inline const binary_block_index_entry &
+  block(size_t i) const
+  {
+    return index_[i];
+  }
+
+  // index of the block containing row i
+  inline size_t
+  find_block(size_t row) const
+  {
+    auto it = std::upper_bound(index_.begin(), index_.end(), row,
+        [](size_t r, const binary_block_index_entry &e) { return r < e.first_row; });
+    ALWAYS_ASSERT(it != index_.begin());
+    return (it - index_.begin()) - 1;
+  }
+
+  // decodes block i into xs[off, off + block(i).nrows), ys likewise. rows
+  // are allocated from arena a, or the heap if a is null. if ws is non-null
+  // it gets the row weights (1.0 for a block without them). returns whether
+  // the block has a weight column
+  bool
+  read_block(size_t i, vec_t *xs, double *ys, mem::arena *a = nullptr,
+             double *ws = nullptr)
+  {
+    const binary_block_index_entry &ent = index_[i];
+    buf_.resize(ent.nbytes);
+    ifs_.seekg(ent.offset);
+    if (ent.nbytes < sizeof(binary_block_header) ||
+        !ifs_.read((char *) buf_.data(), buf_.size()))
+      throw std::runtime_error("could not read block");
+
+    binary_block_header bhdr;
+    memcpy(&bhdr, buf_.data(), sizeof(bhdr));
+    const binary_block_header::value_type vt = bhdr.values();
+    const size_t vsize =
+      (vt == binary_block_header::value_type::VALUE_F64) ? sizeof(double) :
+      (vt == binary_block_header::value_type::VALUE_F32) ? sizeof(float) : 0;
+    const size_t wbytes = bhdr.has_weights() ? bhdr.nrows * sizeof(double) : 0;
+    if (bhdr.nrows != ent.nrows ||
+        sizeof(bhdr) + bhdr.label_bytes() + wbytes + bhdr.idx_bytes +
+          size_t(bhdr.nnz) * vsize != ent.nbytes)
+      throw std::runtime_error("corrupt block");
+
+    const uint8_t *labels = buf_.data() + sizeof(bhdr);
+    const uint8_t *weights = labels + bhdr.label_bytes();
+    if (ws) {
+      if (wbytes)
+        memcpy(ws, weights, wbytes);
+      else
+        std::fill(ws, ws + bhdr.nrows, 1.0);
+    }
+    const uint8_t *q = weights + wbytes;
+    const uint8_t * const q_end = q + bhdr.idx_bytes;
+    const uint8_t * const values = q_end;
+    const uint8_t *lens = q;
+    const uint8_t *lens_end = lens;
+    // the num_features column comes first; find where the deltas start
+    uint64_t total = 0;
+    for (size_t r = 0; r < bhdr.nrows; r++) {
+      uint64_t len;
+      if (!codec::varint_decode_checked(lens_end, q_end, len))
+        throw std::runtime_error("corrupt block lengths");
+      total += len;
+    }
+    if (total != bhdr.nnz)
+      throw std::runtime_error("corrupt block lengths");
+    q = lens_end;
+
+    if (bhdr.has_real_labels()) {
+      memcpy(ys, labels, bhdr.label_bytes());
+    } else {
+      for (size_t r = 0; r < bhdr.nrows; r++) {
+        const int8_t classification = int8_t(labels[r]);
+        if (classification != -1 && classification != 1)
+          throw std::runtime_error("bad classification");
+        ys[r] = static_cast<double>(static_cast<int32_t>(classification));
+      }
+    }
+
+    size_t k = 0;
+    for (size_t r = 0; r < bhdr.nrows; r++) {
+      uint64_t len;
+      codec::varint_decode_checked(lens, lens_end, len);
+      vec_t xv(vec_t::sparse_tag_t(), a);
+      auto &data = xv.as_sparse_ref().data();
+      data.reserve(len);
+      size_t idx = 0;
+      for (size_t j = 0; j < len; j++, k++) {
+        uint64_t delta;
+        if (!codec::varint_decode_checked(q, q_end, delta))
+          throw std::runtime_error("corrupt block indices");
+        idx += delta;
+        data.emplace_back(idx, value_at(vt, values, k));
+      }
+      xs[r] = std::move(xv);
+    }
+    return bhdr.has_weights();
+  }
+
+private:
+  static inline double
+  value_at(binary_block_header::value_type vt, const uint8_t *p, size_t k)
+  {
+    switch (vt) {
+    case binary_block_header::value_type::VALUE_F64:
+      {
+        double d;
+        memcpy(&d, p + k * sizeof(double), sizeof(d));
+        return d;
+      }
+    case binary_block_header::value_type::VALUE_F32:
+      {
+        float f;
+        memcpy(&f, p + k * sizeof(float), sizeof(f));
+        return f;
+      }
+    case binary_block_header::value_type::VALUE_ONES:
+      return 1.0;
+    }
+    throw std::runtime_error("bad value type");
+  }
+
+  std::ifstream ifs_;
+  binary_block_trailer trailer_;
+  std::vector<binary_block_index_entry> index_;
+  std::vector<uint8_t> buf_;
+};
+
 struct binary_file {
 
 template <typename T>
@@ -57,11 +598,436 @@ is_sparse_feature_file(const std::string &filename)
   return hdr.t == binary_file_header::type::BINARY_FILE_SPARSE;
 }
 
+// one run_sink per reader thread; rows are added to its stats while still
+// hot in cache, and merged once all the threads are done
+static inline std::vector<run_sink>
+make_sinks(const load_context &ctx, size_t nthreads,
+           vec_t *px, double *py, double *pw = nullptr)
+{
+  std::vector<run_sink> sinks;
+  sinks.reserve(nthreads);
+  for (size_t i = 0; i < nthreads; i++)
+    sinks.emplace_back(ctx, px, py, pw);
+  return sinks;
+}
+
+static inline size_t
+nreader_threads(size_t nunits)
+{
+  return std::max(size_t(1), std::min(size_t(util::ncpus_online()), nunits));
+}
+
+// decodes all the blocks of a blocked file in parallel, appending to xs/ys
+// (only the sampled rows, with a sampler in ctx)
+static void
+read_blocked_feature_file(
+    const std::string &filename,
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx)
+{
+  binary_block_reader r(filename);
+  const size_t off = xs.size();
+  ALWAYS_ASSERT(ys.size() == off);
+  xs.resize(off + r.nrows());
+  ys.resize(off + r.nrows());
+  n = std::max(static_cast<size_t>(n), r.nfeatures());
+  const size_t nblocks = r.nblocks();
+  const size_t nthreads = nreader_threads(nblocks);
+  const size_t bsize = nblocks / nthreads;
+  std::vector<double> ws((ctx.weights && !ctx.sampler) ? r.nrows() : 0);
+  std::vector<run_sink> sinks = make_sinks(ctx, nthreads,
+      xs.data() + off, ys.data().data() + off, ws.empty() ? nullptr : ws.data());
+  std::atomic<bool> weighted(false);
+  util::parallel_run(nthreads, [&](size_t i) {
+    const size_t end = ((i+1)==nthreads) ? nblocks : (bsize * (i+1));
+    binary_block_reader tr(filename);
+    for (size_t b = bsize * i; b < end; b++) {
+      const size_t row = tr.block(b).first_row;
+      const size_t nr = tr.block(b).nrows;
+      const run_sink::run out = sinks[i].begin(row, nr);
+      const bool w = tr.read_block(b, out.xs, out.ys, out.a, out.ws);
+      if (w)
+        weighted.store(true, std::memory_order_relaxed);
+      sinks[i].commit(row, nr, w);
+    }
+  });
+  run_sink::finish(ctx, sinks, xs, ys, off);
+  if (weighted.load() && !ws.empty())
+    ctx.set_weights(off, ws);
+}
+
+// where every rows_per_entry-th row of a sparse file starts
+struct sparse_row_index {
+  std::vector<uint64_t> offsets;
+  uint64_t data_end; // one past the last row byte
+  uint64_t nrows;
+  uint64_t rows_per_entry;
+  uint64_t nfeatures; // 0 if unknown
+};
+
+static inline uint64_t
+file_size(std::ifstream &ifs)
+{
+  ifs.seekg(0, std::ios::end);
+  return ifs.tellg();
+}
+
+// uses the footer if there is one, otherwise scans the row headers
+static sparse_row_index
+sparse_row_index_of(const std::string &filename)
+{
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.good())
+    throw std::runtime_error("could not open file");
+  const uint64_t fsize = file_size(ifs);
+  const uint64_t data_begin = sizeof(binary_file_header);
+
+  sparse_row_index idx;
+  binary_row_index_trailer trailer;
+  if (fsize >= data_begin + sizeof(trailer)) {
+    ifs.seekg(fsize - sizeof(trailer));
+    if (read_from_istream(ifs, trailer) &&
+        trailer.magic == binary_row_index_trailer::Magic &&
+        trailer.rows_per_entry > 0 &&
+        trailer.index_offset >= data_begin &&
+        trailer.index_offset <= fsize - sizeof(trailer) &&
+        trailer.nentries * sizeof(uint64_t) ==
+          fsize - sizeof(trailer) - trailer.index_offset) {
+      idx.offsets.resize(trailer.nentries);
+      ifs.seekg(trailer.index_offset);
+      if (!idx.offsets.empty() &&
+          !ifs.read((char *) idx.offsets.data(),
+                    idx.offsets.size() * sizeof(uint64_t)))
+        throw std::runtime_error("could not read row index");
+      // readers size each entry's rows from nrows (sparse_entry_nrows()),
+      // so there must be exactly one entry per rows_per_entry rows, each
+      // starting past the previous one and before the footer
+      const uint64_t rpe = trailer.rows_per_entry;
+      if (trailer.nentries != trailer.nrows / rpe + !!(trailer.nrows % rpe))
+        throw std::runtime_error("bad row index");
+      uint64_t prev = data_begin;
+      for (size_t e = 0; e < idx.offsets.size(); e++) {
+        if ((e ? idx.offsets[e] <= prev : idx.offsets[e] != data_begin) ||
+            idx.offsets[e] >= trailer.index_offset)
+          throw std::runtime_error("bad row index");
+        prev = idx.offsets[e];
+      }
+      idx.data_end = trailer.index_offset;
+      idx.nrows = trailer.nrows;
+      idx.rows_per_entry = trailer.rows_per_entry;
+      idx.nfeatures = trailer.nfeatures;
+      return idx;
+    }
+  }
+
+  // legacy file: hop from row header to row header, skipping the payloads
+  idx.data_end = fsize;
+  idx.nrows = 0;
+  idx.rows_per_entry = binary_sparse_writer::DefaultRowsPerEntry;
+  idx.nfeatures = 0;
+  static const size_t BufSize = 1 << 22;
+  std::vector<char> buf(BufSize);
+  uint64_t buf_begin = 0, buf_end = 0; // file range held in buf
+  uint64_t pos = data_begin;
+  while (pos < fsize) {
+    const size_t RowHeaderSize = sizeof(int8_t) + sizeof(uint32_t);
+    if (pos + RowHeaderSize > fsize)
+      throw std::runtime_error("bad sparse feature vector desc");
+    if (pos < buf_begin || pos + RowHeaderSize > buf_end) {
+      ifs.clear();
+      ifs.seekg(pos);
+      ifs.read(buf.data(), buf.size());
+      buf_begin = pos;
+      buf_end = pos + ifs.gcount();
+    }
+    uint32_t num_features;
+    memcpy(&num_features, &buf[pos - buf_begin + sizeof(int8_t)],
+           sizeof(num_features));
+    if (!(idx.nrows % idx.rows_per_entry))
+      idx.offsets.push_back(pos);
+    idx.nrows++;
+    pos += RowHeaderSize +
+      uint64_t(num_features) * (sizeof(uint32_t) + sizeof(double));
+  }
+  if (pos != fsize)
+    throw std::runtime_error("bad sparse feature vector");
+  return idx;
+}
+
+// parses the rows in [begin, end) of buf, which must hold exactly nrows rows
+static size_t
+parse_sparse_rows(const char *begin, const char *end,
+                  size_t nrows, vec_t *xs, double *ys,
+                  mem::arena *a = nullptr)
+{
+  size_t nfeatures = 0;
+  const char *p = begin;
+  for (size_t r = 0; r < nrows; r++) {
+    int8_t classification;
+    uint32_t num_features;
+    if (size_t(end - p) < sizeof(classification) + sizeof(num_features))
+      throw std::runtime_error("bad sparse feature vector desc");
+    memcpy(&classification, p, sizeof(classification));
+    p += sizeof(classification);
+    memcpy(&num_features, p, sizeof(num_features));
+    p += sizeof(num_features);
+    ALWAYS_ASSERT(classification == -1 || classification == 1);
+    const size_t EntrySize = sizeof(uint32_t) + sizeof(double);
+    if (size_t(end - p) < num_features * EntrySize)
+      throw std::runtime_error("bad sparse feature vector");
+    vec_t xv(vec_t::sparse_tag_t(), a);
+    auto &data = xv.as_sparse_ref().data();
+    data.reserve(num_features);
+    for (size_t j = 0; j < num_features; j++, p += EntrySize) {
+      uint32_t feature_idx;
+      double value;
+      memcpy(&feature_idx, p, sizeof(feature_idx));
+      memcpy(&value, p + sizeof(feature_idx), sizeof(value));
+      // rows are written in ascending order, but be forgiving
+      if (unlikely(!data.empty() && data.back().first >= feature_idx))
+        xv.ensureref(feature_idx) = value;
+      else
+        data.emplace_back(feature_idx, value);
+    }
+    nfeatures = std::max(nfeatures, xv.highest_nonzero_dim());
+    xs[r] = std::move(xv);
+    ys[r] = static_cast<double>(static_cast<int32_t>(classification));
+  }
+  if (p != end)
+    throw std::runtime_error("bad sparse feature vector");
+  return nfeatures;
+}
+
+// reads and parses row index entry e into xs/ys (which must have room for
+// the entry's rows), returning the highest feature_idx + 1 seen
+static size_t
+read_sparse_entry(std::ifstream &ifs, const sparse_row_index &idx,
+                  size_t e, std::vector<char> &buf,
+                  vec_t *xs, double *ys, mem::arena *a = nullptr)
+{
+  const uint64_t first = idx.offsets[e];
+  const uint64_t last =
+    ((e+1)==idx.offsets.size()) ? idx.data_end : idx.offsets[e+1];
+  if (last < first)
+    throw std::runtime_error("bad row index");
+  buf.resize(last - first);
+  ifs.seekg(first);
+  if (!ifs.read(buf.data(), buf.size()))
+    throw std::runtime_error("bad sparse feature vector");
+  return parse_sparse_rows(buf.data(), buf.data() + buf.size(),
+                           sparse_entry_nrows(idx, e), xs, ys, a);
+}
+
+static inline size_t
+sparse_entry_nrows(const sparse_row_index &idx, size_t e)
+{
+  return std::min(idx.rows_per_entry, idx.nrows - e * idx.rows_per_entry);
+}
+
+static void
+read_sparse_feature_file(
+    const std::string &filename,
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx)
+{
+  const sparse_row_index idx = sparse_row_index_of(filename);
+  const size_t off = xs.size();
+  ALWAYS_ASSERT(ys.size() == off);
+  xs.resize(off + idx.nrows);
+  ys.resize(off + idx.nrows);
+  const size_t nentries = idx.offsets.size();
+  const size_t nthreads = nreader_threads(nentries);
+  const size_t bsize = nentries / nthreads;
+  std::vector<size_t> nfeatures(nthreads);
+  std::vector<run_sink> sinks =
+    make_sinks(ctx, nthreads, xs.data() + off, ys.data().data() + off);
+  util::parallel_run(nthreads, [&](size_t i) {
+    std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+    if (!ifs.good())
+      throw std::runtime_error("could not open file");
+    std::vector<char> buf;
+    const size_t end = ((i+1)==nthreads) ? nentries : (bsize * (i+1));
+    for (size_t e = bsize * i; e < end; e++) {
+      const size_t row = e * idx.rows_per_entry;
+      const size_t nr = sparse_entry_nrows(idx, e);
+      const run_sink::run out = sinks[i].begin(row, nr);
+      nfeatures[i] = std::max(nfeatures[i],
+          read_sparse_entry(ifs, idx, e, buf, out.xs, out.ys, out.a));
+      sinks[i].commit(row, nr, false);
+    }
+  });
+  run_sink::finish(ctx, sinks, xs, ys, off);
+  size_t nf = idx.nfeatures;
+  for (auto f : nfeatures)
+    nf = std::max(nf, f);
+  n = std::max(static_cast<size_t>(n), nf);
+}
+
+// dense rows all have the same size, so no index is needed
+struct dense_layout {
+  static const uint64_t DataBegin =
+    sizeof(binary_file_header) + sizeof(uint32_t);
+  static const size_t RowsPerRead = 1024;
+  uint32_t num_features;
+  uint64_t row_size;
+  size_t nrows;
+};
+
+static dense_layout
+dense_layout_of(std::ifstream &ifs)
+{
+  dense_layout l;
+  const uint64_t fsize = file_size(ifs);
+  ifs.seekg(sizeof(binary_file_header));
+  if (fsize < dense_layout::DataBegin || !read_from_istream(ifs, l.num_features))
+    throw std::runtime_error("bad dense format");
+  l.row_size = sizeof(int8_t) + uint64_t(l.num_features) * sizeof(double);
+  if ((fsize - dense_layout::DataBegin) % l.row_size)
+    throw std::runtime_error("bad dense feature vector");
+  l.nrows = (fsize - dense_layout::DataBegin) / l.row_size;
+  return l;
+}
+
+// reads the nr rows starting at row into xs/ys
+static void
+read_dense_rows(std::ifstream &ifs, const dense_layout &l,
+                size_t row, size_t nr, std::vector<char> &buf,
+                vec_t *xs, double *ys, mem::arena *a = nullptr)
+{
+  buf.resize(nr * l.row_size);
+  ifs.seekg(dense_layout::DataBegin + row * l.row_size);
+  if (!ifs.read(buf.data(), buf.size()))
+    throw std::runtime_error("bad dense feature vector");
+  for (size_t r = 0; r < nr; r++) {
+    const char * const p = buf.data() + r * l.row_size;
+    int8_t classification;
+    memcpy(&classification, p, sizeof(classification));
+    ALWAYS_ASSERT(classification == -1 || classification == 1);
+    vec_t xv(vec_t::std_tag_t(), a);
+    auto &data = xv.as_standard_ref().data();
+    data.resize(l.num_features);
+    memcpy(data.data(), p + sizeof(classification),
+           l.num_features * sizeof(double));
+    xs[r] = std::move(xv);
+    ys[r] = static_cast<double>(static_cast<int32_t>(classification));
+  }
+}
+
+static void
+read_dense_feature_file(
+    const std::string &filename,
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx)
+{
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.good())
+    throw std::runtime_error("could not open file");
+  const dense_layout l = dense_layout_of(ifs);
+  n = l.num_features;
+  const size_t nrows = l.nrows;
+  const size_t off = xs.size();
+  ALWAYS_ASSERT(ys.size() == off);
+  xs.resize(off + nrows);
+  ys.resize(off + nrows);
+
+  const size_t RowsPerRead = dense_layout::RowsPerRead;
+  const size_t nchunks = (nrows + RowsPerRead - 1) / RowsPerRead;
+  const size_t nthreads = nreader_threads(nchunks);
+  const size_t bsize = nchunks / nthreads;
+  std::vector<run_sink> sinks =
+    make_sinks(ctx, nthreads, xs.data() + off, ys.data().data() + off);
+  util::parallel_run(nthreads, [&](size_t i) {
+    std::ifstream tifs(filename, std::ios::in | std::ios::binary);
+    if (!tifs.good())
+      throw std::runtime_error("could not open file");
+    std::vector<char> buf;
+    const size_t end = ((i+1)==nthreads) ? nchunks : (bsize * (i+1));
+    for (size_t c = bsize * i; c < end; c++) {
+      const size_t row = c * RowsPerRead;
+      const size_t nr = std::min(RowsPerRead, nrows - row);
+      const run_sink::run out = sinks[i].begin(row, nr);
+      read_dense_rows(tifs, l, row, nr, buf, out.xs, out.ys, out.a);
+      sinks[i].commit(row, nr, false);
+    }
+  });
+  run_sink::finish(ctx, sinks, xs, ys, off);
+}
+
+static inline binary_file_header::type
+header_type_of(const std::string &filename)
+{
+  std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+  if (!ifs.good())
+    throw std::runtime_error("could not open file");
+  binary_file_header hdr;
+  if (!read_from_istream(ifs, hdr))
+    throw std::runtime_error("bad header");
+  return hdr.t;
+}
+
+/**
+ * Calls fn(xs, ys, ws) on consecutive runs of rows of any binary file, in
+ * file order. ws holds the sample weights of the run, or is empty if it has
+ * none. Only one run (an index entry, block, or read chunk) is held in
+ * memory at a time, so arbitrarily large files can be scanned.
+ */
+template <typename Fn>
+static void
+stream_feature_file(const std::string &filename, Fn fn)
+{
+  std::vector<vec_t> xs;
+  standard_vec_t ys;
+  const standard_vec_t no_weights;
+  std::vector<char> buf;
+  switch (header_type_of(filename)) {
+  case binary_file_header::type::BINARY_FILE_SPARSE_BLOCKED:
+    {
+      binary_block_reader r(filename);
+      standard_vec_t ws;
+      for (size_t b = 0; b < r.nblocks(); b++) {
+        xs.resize(r.block(b).nrows);
+        ys.resize(r.block(b).nrows);
+        ws.resize(r.block(b).nrows);
+        const bool weighted =
+          r.read_block(b, xs.data(), ys.data().data(), nullptr, ws.data().data());
+        fn(xs, ys, weighted ? ws : no_weights);
+      }
+    }
+    return;
+  case binary_file_header::type::BINARY_FILE_SPARSE:
+    {
+      const sparse_row_index idx = sparse_row_index_of(filename);
+      std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+      for (size_t e = 0; e < idx.offsets.size(); e++) {
+        xs.resize(sparse_entry_nrows(idx, e));
+        ys.resize(xs.size());
+        read_sparse_entry(ifs, idx, e, buf, xs.data(), ys.data().data());
+        fn(xs, ys, no_weights);
+      }
+    }
+    return;
+  case binary_file_header::type::BINARY_FILE_DENSE:
+    {
+      std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+      const dense_layout l = dense_layout_of(ifs);
+      for (size_t row = 0; row < l.nrows; row += dense_layout::RowsPerRead) {
+        xs.resize(std::min(dense_layout::RowsPerRead, l.nrows - row));
+        ys.resize(xs.size());
+        read_dense_rows(ifs, l, row, xs.size(), buf, xs.data(), ys.data().data());
+        fn(xs, ys, no_weights);
+      }
+    }
+    return;
+  }
+  throw std::runtime_error("bad header");
+}
+
 // returns -1 on failure, 0 on success
 int
 read_feature_file(
     const std::string &filename,
-    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n) const
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx = load_context()) const
 {
   std::ifstream ifs(filename, std::ios::in | std::ios::binary);
   if (!ifs.good())
@@ -71,8 +1037,9 @@ read_feature_file(
   binary_file_header hdr;
   if (!read_from_istream(ifs, hdr))
     throw std::runtime_error("bad header");
+  ifs.close();
 
-  // sparse_format: sparse_line*
+  // sparse_format: sparse_line* [row offset footer]
   // sparse_line:
   //   [classification (int8_t) |
   //    num_features (uint32_t) |
@@ -82,47 +1049,21 @@ read_feature_file(
   // dense_line:
   //   [classification (int8_t) |
   //    [value (double)]* (num_features repetitions)]
+  //
+  // all three formats are decoded by one thread per core
 
-  if (hdr.t == binary_file_header::type::BINARY_FILE_SPARSE) {
-    while (ifs.good()) {
-      if (ifs.peek() == EOF)
-        break;
-      int8_t classification;
-      uint32_t num_features;
-      if (!read_from_istream(ifs, classification) ||
-          !read_from_istream(ifs, num_features))
-        throw std::runtime_error("bad sparse feature vector desc");
-      ALWAYS_ASSERT(classification == -1 || classification == 1);
-      vec_t xv((vec_t::sparse_tag_t()));
-      xv.reserve(num_features);
-      if (!read_feature_vector(ifs, xv, num_features, true))
-        throw std::runtime_error("bad sparse feature vector");
-      n = std::max(xv.highest_nonzero_dim(), static_cast<size_t>(n));
-      xs.push_back(std::move(xv));
-      ys.data().push_back(
-          static_cast<double>(static_cast<int32_t>(classification)));
-    }
-  } else {
-    uint32_t num_features;
-    if (!read_from_istream(ifs, num_features))
-      throw std::runtime_error("bad dense format");
-    n = num_features;
-    while (ifs.good()) {
-      if (ifs.peek() == EOF)
-        break;
-      int8_t classification;
-      vec_t xv;
-      if (!read_from_istream(ifs, classification) ||
-          !read_feature_vector(ifs, xv, num_features, false))
-        throw std::runtime_error("bad dense feature vector");
-      ALWAYS_ASSERT(classification == -1 || classification == 1);
-      xs.push_back(std::move(xv));
-      ys.data().push_back(
-          static_cast<double>(static_cast<int32_t>(classification)));
-    }
+  switch (hdr.t) {
+  case binary_file_header::type::BINARY_FILE_SPARSE_BLOCKED:
+    read_blocked_feature_file(filename, xs, ys, n, ctx);
+    return 0;
+  case binary_file_header::type::BINARY_FILE_SPARSE:
+    read_sparse_feature_file(filename, xs, ys, n, ctx);
+    return 0;
+  case binary_file_header::type::BINARY_FILE_DENSE:
+    read_dense_feature_file(filename, xs, ys, n, ctx);
+    return 0;
   }
-
-  return (ifs.peek() == EOF) ? 0 : -1;
+  throw std::runtime_error("bad header");
 }
 
 template <typename T>
@@ -141,55 +1082,55 @@ write_feature_file(
     const standard_vec_t &ys,
     bool sparse_format) const
 {
+  if (sparse_format) {
+    binary_sparse_writer w(filename);
+    for (size_t i = 0; i < xs.size(); i++)
+      w.append(xs[i], ys[i]);
+    return w.close() ? 0 : -1;
+  }
+
   std::ofstream ofs(filename);
 
   binary_file_header hdr;
-  hdr.t = sparse_format ?
-    binary_file_header::type::BINARY_FILE_SPARSE :
-    binary_file_header::type::BINARY_FILE_DENSE;
+  hdr.t = binary_file_header::type::BINARY_FILE_DENSE;
 
   if (!write_to_ostream(ofs, hdr))
     return -1;
 
-  if (sparse_format) {
-    for (size_t i = 0; i < xs.size(); i++) {
-      const auto &xv = xs[i];
-      const int8_t classification =
-        static_cast<int32_t>(ys[i]);
-      ALWAYS_ASSERT(classification == -1 || classification == 1);
-      const uint32_t num_features = xv.nnz();
-      if (!write_to_ostream(ofs, classification) ||
-          !write_to_ostream(ofs, num_features))
-        return -1;
-      const auto end = xv.end();
-      for (auto it = xv.begin(); it != end; ++it) {
-        const uint32_t feature_idx = it.tell();
-        if (!write_to_ostream(ofs, feature_idx) ||
-            !write_to_ostream(ofs, *it))
-          return -1;
-      }
-    }
-  } else {
-    // XXX: cannot currently support writing sparse vectors in
-    // dense format
-    const uint32_t num_features = xs.empty() ? 0 : xs.front().nnz();
-    if (!write_to_ostream(ofs, num_features))
+  // XXX: cannot currently support writing sparse vectors in
+  // dense format
+  const uint32_t num_features = xs.empty() ? 0 : xs.front().nnz();
+  if (!write_to_ostream(ofs, num_features))
+    return -1;
+  for (size_t i = 0; i < xs.size(); i++) {
+    const auto &xv = xs[i];
+    assert(xv.nnz() == num_features);
+    const int8_t classification =
+      static_cast<int32_t>(ys[i]);
+    ALWAYS_ASSERT(classification == -1 || classification == 1);
+    if (!write_to_ostream(ofs, classification))
       return -1;
-    for (size_t i = 0; i < xs.size(); i++) {
-      const auto &xv = xs[i];
-      assert(xv.nnz() == num_features);
-      const int8_t classification =
-        static_cast<int32_t>(ys[i]);
-      ALWAYS_ASSERT(classification == -1 || classification == 1);
-      if (!write_to_ostream(ofs, classification))
+    for (auto v : xv.as_standard_ref().data())
+      if (!write_to_ostream(ofs, v))
         return -1;
-      for (auto v : xv.as_standard_ref().data())
-        if (!write_to_ostream(ofs, v))
-          return -1;
-    }
   }
 
   return ofs.good() ? 0 : -1;
 };
 
+// writes xs/ys in the blocked sparse format; returns -1 on failure,
+// 0 on success
+int
+write_blocked_feature_file(
+    const std::string &filename,
+    const std::vector<vec_t> &xs,
+    const standard_vec_t &ys,
+    size_t rows_per_block = binary_block_writer::DefaultRowsPerBlock) const
+{
+  binary_block_writer w(filename, rows_per_block);
+  for (size_t i = 0; i < xs.size(); i++)
+    w.append(xs[i], ys[i]);
+  return w.close() ? 0 : -1;
+}
+
 };
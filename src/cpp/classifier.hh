@@ -8,6 +8,7 @@
 #include <vec.hh>
 #include <loss_functions.hh>
 #include <dataset.hh>
+#include <telemetry.hh>
 
 namespace classifier {
 
@@ -22,6 +23,7 @@ public:
     history(size_t sample_id) = 0;
   virtual size_t get_nhistory_samples() const = 0;
   virtual standard_vec_t predict(const dataset &d) const = 0;
+  virtual standard_vec_t predict_margin(const dataset &d) const = 0;
   virtual size_t get_nrounds() const = 0;
   virtual clf_iface<Model> *clone() const = 0;
   virtual std::string name() const = 0;
@@ -40,6 +42,7 @@ public:
     history(size_t round) OVERRIDE { return impl_.history(round); }
   size_t get_nhistory_samples() const OVERRIDE { return impl_.get_nhistory_samples(); }
   standard_vec_t predict(const dataset &d) const OVERRIDE { return impl_.get_model().predict(d); }
+  standard_vec_t predict_margin(const dataset &d) const OVERRIDE { return impl_.get_model().predict_margin(d); }
   size_t get_nrounds() const OVERRIDE { return impl_.get_nrounds(); }
   clf_iface<typename Impl::model_type> *clone() const OVERRIDE { return new clf_delegator(impl_); }
   std::string name() const OVERRIDE { return impl_.name(); }
@@ -69,7 +72,8 @@ public:
       nrounds_(clf.nrounds_),
       training_sz_(clf.training_sz_),
       prng_(new Generator(std::uniform_int_distribution<unsigned>()(*clf.prng_))),
-      verbose_(clf.verbose_)
+      verbose_(clf.verbose_),
+      telemetry_(clf.telemetry_)
   {
 
   }
@@ -81,6 +85,14 @@ public:
   inline size_t get_nrounds() const { return nrounds_; }
   inline size_t get_training_sz() const { return training_sz_; }
 
+  // fit() reports per-round (and per-worker) metrics to t, if not null
+  inline void
+  set_telemetry(const std::shared_ptr<telemetry::collector> &t)
+  {
+    telemetry_ = t;
+  }
+  inline telemetry::collector *get_telemetry() const { return telemetry_.get(); }
+
   // [iteration ID (1-based), model]
   virtual model::model_history<Model>
   history(size_t i)
@@ -117,11 +129,26 @@ public:
   }
 
 protected:
+  // the metrics every iterative optimizer reports after each round
+  void
+  emit_round(size_t round, double round_ms, double risk) const
+  {
+    telemetry::collector * const t = telemetry_.get();
+    if (!t)
+      return;
+    t->emit("round_ms", round, round_ms);
+    if (round_ms > 0.0)
+      t->emit("rows_per_sec", round, training_sz_ / (round_ms / 1000.0));
+    t->emit("risk", round, risk);
+    t->emit("rss_bytes", round, double(telemetry::rss_bytes()));
+  }
+
   Model model_;
   size_t nrounds_;
   size_t training_sz_;
   std::shared_ptr<Generator> prng_;
   bool verbose_;
+  std::shared_ptr<telemetry::collector> telemetry_;
   struct state_entry {
     size_t iteration_;
     size_t runtime_usec_;
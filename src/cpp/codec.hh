@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include <macros.hh>
+
+/**
+ * Small integer codecs shared by the in-memory packed rows and the on-disk
+ * formats. Varints are LEB128: 7 bits of payload per byte, low bits first,
+ * high bit set on every byte but the last.
+ */
+namespace codec {
+
+static const size_t MaxVarintBytes = 10;
+
+static inline size_t
+varint_size(uint64_t v)
+{
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+// writes v at p, returns one past the last byte written
+static inline uint8_t *
+varint_encode(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = uint8_t(v) | 0x80;
+    v >>= 7;
+  }
+  *p++ = uint8_t(v);
+  return p;
+}
+
+static inline void
+varint_append(std::vector<uint8_t> &buf, uint64_t v)
+{
+  uint8_t tmp[MaxVarintBytes];
+  buf.insert(buf.end(), tmp, varint_encode(tmp, v));
+}
+
+// decodes one varint at p and advances p past it
+static inline ALWAYS_INLINE uint64_t
+varint_decode(const uint8_t *&p)
+{
+  // single byte deltas are by far the common case in sorted rows
+  if (likely(!(*p & 0x80)))
+    return *p++;
+  uint64_t v = 0;
+  unsigned shift = 0;
+  for (;;) {
+    const uint8_t b = *p++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+    shift += 7;
+  }
+}
+
+// bounds-checked variant for untrusted input; returns false on overrun
+static inline bool
+varint_decode_checked(const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+  v = 0;
+  unsigned shift = 0;
+  while (p != end && shift < 64) {
+    const uint8_t b = *p++;
+    v |= uint64_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+    shift += 7;
+  }
+  return false;
+}
+
+} // namespace codec
@@ -1,35 +1,318 @@
 /**
- * convert.cc - converts an svmlight file to binary file
+ * convert.cc - converts an svmlight, ascii, or binary feature file to a
+ * binary file
+ *
+ * The input format is autodetected. Text input is read in line-aligned
+ * chunks which are parsed in parallel and written out in order, so memory
+ * use is bounded by the number of chunks in flight rather than by the size
+ * of the input. Binary input is streamed one row run at a time, which makes
+ * it possible to re-encode an existing file into the blocked format.
+ *
+ * Sample weights can be attached to the rows of a blocked output file from
+ * a side file with one weight per line, in row order. Weights already in a
+ * blocked input file are carried over unless a side file replaces them.
+ * With --regression, text labels are read as real-valued targets, which
+ * only the blocked format can hold.
  */
 
+#include <getopt.h>
+
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <ascii_file.hh>
 #include <binary_file.hh>
+#include <line_reader.hh>
 #include <svmlight_file.hh>
+#include <task_executor.hh>
+#include <timer.hh>
 #include <vec.hh>
 
 using namespace std;
 
+enum class input_format { SVMLIGHT, ASCII, BINARY };
+
+static const char *
+input_format_name(input_format f)
+{
+  switch (f) {
+  case input_format::SVMLIGHT: return "svmlight";
+  case input_format::ASCII: return "ascii";
+  case input_format::BINARY: return "binary";
+  }
+  NOT_REACHABLE;
+}
+
+// binary files start with a one byte type tag, which is never printable;
+// of the text formats only svmlight has idx:value pairs
+static input_format
+detect_input_format(const string &filename)
+{
+  ifstream ifs(filename, ios::in | ios::binary);
+  if (!ifs.good())
+    throw runtime_error("could not open file");
+  const int c = ifs.peek();
+  if (c == int(binary_file_header::type::BINARY_FILE_DENSE) ||
+      c == int(binary_file_header::type::BINARY_FILE_SPARSE) ||
+      c == int(binary_file_header::type::BINARY_FILE_SPARSE_BLOCKED))
+    return input_format::BINARY;
+  string line;
+  while (getline(ifs, line) && line.find_first_not_of(" \t\r") == string::npos)
+    ;
+  return line.find(':') != string::npos ?
+    input_format::SVMLIGHT : input_format::ASCII;
+}
+
+// the per-row weights given with --weights, if any. errors are kept
+// rather than thrown, since rows are appended while parser threads run
+class weight_source {
+public:
+  explicit weight_source(const string &filename)
+  {
+    if (filename.empty())
+      return;
+    ifs_.open(filename);
+    if (!ifs_.good())
+      throw runtime_error("could not open weights file");
+  }
+
+  // the weight of the next row, or fallback without a weights file
+  inline double
+  next(double fallback)
+  {
+    if (!ifs_.is_open() || !error_.empty())
+      return fallback;
+    double w;
+    if (!(ifs_ >> w)) {
+      error_ = "weights file has fewer rows than the input";
+      return fallback;
+    }
+    if (!(w >= 0.0)) {
+      error_ = "sample weights must be non-negative";
+      return fallback;
+    }
+    return w;
+  }
+
+  // empty unless a weight was missing or bad, or there are weights left
+  const string &
+  finish()
+  {
+    double w;
+    if (ifs_.is_open() && error_.empty() && (ifs_ >> w))
+      error_ = "weights file has more rows than the input";
+    return error_;
+  }
+
+private:
+  ifstream ifs_;
+  string error_;
+};
+
+struct parsed_chunk {
+  vector<vec_t> xs_;
+  standard_vec_t ys_;
+  bool ok_;
+};
+
+static shared_ptr<parsed_chunk>
+parse_chunk(input_format fmt, const string &chunk, bool real_labels)
+{
+  shared_ptr<parsed_chunk> ret = make_shared<parsed_chunk>();
+  ret->ok_ = true;
+  size_t dim = 0;
+  for_each_line(chunk.data(), chunk.data() + chunk.size(),
+      [&](const char *begin, const char *end) {
+    if (!ret->ok_)
+      return;
+    vec_t xv;
+    double y;
+    const bool ok = (fmt == input_format::SVMLIGHT) ?
+      svmlight_file::parse_line(begin, end, xv, y, real_labels) :
+      ascii_file::parse_line(begin, end, xv, y, dim, real_labels);
+    if (!ok) {
+      ret->ok_ = false;
+      return;
+    }
+    if (fmt == input_format::ASCII)
+      dim = xv.nnz();
+    ret->xs_.push_back(move(xv));
+    ret->ys_.push_back(y);
+  });
+  return ret;
+}
+
+/**
+ * Main thread reads chunks and hands them round-robin to the parser
+ * threads; results are drained in submission order once more than
+ * max_inflight chunks are outstanding.
+ */
+template <typename Writer>
+static bool
+convert_text(input_format fmt, const string &infile, Writer &w,
+             weight_source &weights, bool real_labels,
+             size_t nthreads, size_t chunk_bytes)
+{
+  typedef shared_ptr<parsed_chunk> result_t;
+  vector<unique_ptr<task_executor_thread<result_t>>> workers;
+  for (size_t i = 0; i < nthreads; i++)
+    workers.emplace_back(new task_executor_thread<result_t>);
+
+  const size_t max_inflight = 2 * nthreads;
+  deque<future<result_t>> inflight;
+  bool ok = true;
+  auto drain_one = [&]() {
+    result_t r = inflight.front().get();
+    inflight.pop_front();
+    if (!r->ok_)
+      ok = false;
+    for (size_t i = 0; ok && i < r->xs_.size(); i++)
+      w.append(r->xs_[i], r->ys_[i], weights.next(1.0));
+  };
+
+  line_chunk_reader reader(infile, chunk_bytes);
+  size_t nchunks = 0;
+  for (;;) {
+    shared_ptr<string> chunk = make_shared<string>();
+    if (!ok || !reader.next(*chunk))
+      break;
+    inflight.push_back(workers[nchunks++ % nthreads]->enq(
+      [fmt, chunk, real_labels]() {
+        return parse_chunk(fmt, *chunk, real_labels);
+      }));
+    if (inflight.size() >= max_inflight)
+      drain_one();
+  }
+  while (!inflight.empty())
+    drain_one();
+
+  for (auto &p : workers)
+    p->shutdown();
+  return ok;
+}
+
+template <typename Writer>
+static bool
+convert_binary(const string &infile, Writer &w, weight_source &weights)
+{
+  binary_file::stream_feature_file(infile,
+      [&w, &weights](const vector<vec_t> &xs, const standard_vec_t &ys,
+                     const standard_vec_t &ws) {
+    for (size_t i = 0; i < xs.size(); i++)
+      w.append(xs[i], ys[i], weights.next(ws.size() ? ws[i] : 1.0));
+  });
+  return true;
+}
+
+template <typename Writer>
+static bool
+convert(input_format fmt, const string &infile, Writer &w,
+        weight_source &weights, bool real_labels,
+        size_t nthreads, size_t chunk_bytes)
+{
+  const bool ok = (fmt == input_format::BINARY) ?
+    convert_binary(infile, w, weights) :
+    convert_text(fmt, infile, w, weights, real_labels, nthreads, chunk_bytes);
+  // close() even on a failed parse so the partial output is well formed
+  if (!w.close() || !ok)
+    return false;
+  if (!weights.finish().empty()) {
+    cerr << "[ERROR] " << weights.finish() << endl;
+    return false;
+  }
+  return true;
+}
+
+static void
+usage(const char *prog)
+{
+  cerr << "[usage] " << prog << " [options] input_file binary_file" << endl
+       << "  -b, --blocked          write the blocked (v2) sparse format" << endl
+       << "  -t, --threads N        parser threads (default: hardware concurrency)" << endl
+       << "  -c, --chunk-bytes N    bytes of text per parse chunk (default: "
+       << line_chunk_reader::DefaultChunkBytes << ")" << endl
+       << "  -W, --weights FILE     sample weights, one per line (needs -b)" << endl
+       << "  -R, --regression       real-valued labels (needs -b)" << endl;
+}
+
 int
 main(int argc, char **argv)
 {
-  if (argc != 3) {
-    cerr << "[usage] " << argv[0] << " svmlight_file binary_file" << endl;
-    return 1;
+  bool blocked = false;
+  size_t nthreads = thread::hardware_concurrency();
+  size_t chunk_bytes = line_chunk_reader::DefaultChunkBytes;
+  string weights_file;
+  bool real_labels = false;
+  while (1) {
+    static struct option long_options[] =
+    {
+      {"blocked"     , no_argument       , 0 , 'b'} ,
+      {"threads"     , required_argument , 0 , 't'} ,
+      {"chunk-bytes" , required_argument , 0 , 'c'} ,
+      {"weights"     , required_argument , 0 , 'W'} ,
+      {"regression"  , no_argument       , 0 , 'R'} ,
+      {0, 0, 0, 0}
+    };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "bt:c:W:R", long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'b':
+      blocked = true;
+      break;
+    case 't':
+      nthreads = strtoul(optarg, nullptr, 10);
+      break;
+    case 'c':
+      chunk_bytes = strtoul(optarg, nullptr, 10);
+      break;
+    case 'W':
+      weights_file = optarg;
+      break;
+    case 'R':
+      real_labels = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
   }
-
-  vector<vec_t> xs;
-  standard_vec_t ys;
-  unsigned int n;
-  if (svmlight_file().read_feature_file(argv[1], xs, ys, n)) {
-    cerr << "[ERROR] could not read svmlight_file" << endl;
+  if (argc - optind != 2 || !chunk_bytes ||
+      ((!weights_file.empty() || real_labels) && !blocked)) {
+    usage(argv[0]);
     return 1;
   }
+  nthreads = max(nthreads, size_t(1));
+  const string infile = argv[optind];
+  const string outfile = argv[optind + 1];
 
-  if (binary_file().write_feature_file(argv[2], xs, ys, true)) {
-    cerr << "[ERROR] could not write binary_file" << endl;
+  try {
+    const input_format fmt = detect_input_format(infile);
+    cerr << "[INFO] converting " << input_format_name(fmt) << " file "
+         << infile << " to " << (blocked ? "blocked " : "") << "binary file "
+         << outfile << " (nthreads=" << nthreads << ")" << endl;
+    scoped_timer t("conversion");
+    weight_source weights(weights_file);
+    bool ok;
+    if (blocked) {
+      binary_block_writer w(outfile);
+      ok = convert(fmt, infile, w, weights, real_labels, nthreads, chunk_bytes);
+    } else {
+      binary_sparse_writer w(outfile);
+      ok = convert(fmt, infile, w, weights, real_labels, nthreads, chunk_bytes);
+    }
+    if (!ok) {
+      cerr << "[ERROR] could not convert " << infile << endl;
+      return 1;
+    }
+  } catch (exception &e) {
+    cerr << "[ERROR] " << e.what() << endl;
     return 1;
   }
 
@@ -6,41 +6,131 @@
 using namespace std;
 using namespace util;
 
-// read [begin, end) into work, starting from off
+// copy [begin, end) into work, starting from off, allocating from a
 template <typename ForwardIterator>
 static void
 threadwork(std::vector<vec_t> &work,
            size_t off,
            ForwardIterator begin,
-           ForwardIterator end)
+           ForwardIterator end,
+           mem::arena *a)
 {
   while (begin != end) {
-    work[off++] = *begin;
+    work[off++] = vec_t(*begin, a);
     ++begin;
   }
 }
 
-bool
-dataset::do_parallel_materialize()
+static void
+packwork(std::vector<vec_t> &x, size_t begin, size_t end, mem::arena *a)
+{
+  for (size_t i = begin; i < end; i++)
+    x[i].pack(a);
+}
+
+void
+dataset::vector_storage::pack_rows()
 {
-  const auto ncpus = ncpus_online();
-  if (x_shape_.first < ncpus)
-    // fallback
-    return false;
-  const size_t bsize = x_shape_.first / ncpus;
+  const size_t ncpus = ncpus_online();
+  const size_t nthreads = (x_.size() < ncpus) ? 1 : ncpus;
+  const size_t bsize = x_.size() / nthreads;
+  // packed rows go to new arenas (in the same pool, so they live as long
+  // as the rows); the space of the sparse rows they replace is not reused
+  if (!arenas_)
+    arenas_ = make_shared<mem::arena_pool>();
+  vector<thread> workers;
+  for (size_t i = 0; i < nthreads; i++) {
+    const size_t end = ((i+1)==nthreads) ? x_.size() : (bsize * (i+1));
+    workers.emplace_back(packwork, ref(x_), bsize * i, end, arenas_->make());
+  }
+  for (auto &w : workers)
+    w.join();
+}
+
+static void
+statswork(feature_stats &stats,
+          dataset::const_iterator begin,
+          dataset::const_iterator end)
+{
+  while (begin != end) {
+    stats.add(*begin.first(), *begin.second());
+    ++begin;
+  }
+}
+
+shared_ptr<const feature_stats>
+dataset::compute_stats() const
+{
+  const size_t ncpus = ncpus_online();
+  const size_t nthreads = (x_shape_.first < ncpus) ? 1 : ncpus;
+  const size_t bsize = x_shape_.first / nthreads;
+  // counts only: a full-width partial per thread is all the scratch space
+  vector<feature_stats> partials(nthreads, feature_stats(x_shape_.second, false));
+  vector<thread> workers;
+  for (size_t i = 0; i < nthreads; i++) {
+    auto begin_it = begin() + (bsize * i);
+    auto end_it = ((i+1)==nthreads) ? end() : (begin() + (bsize * (i+1)));
+    workers.emplace_back(statswork, ref(partials[i]), begin_it, end_it);
+  }
+  for (auto &w : workers)
+    w.join();
+  feature_stats::merge_all(partials, nthreads);
+  return make_shared<const feature_stats>(move(partials[0]));
+}
+
+void
+dataset::do_materialize(size_t nthreads, bool dense_layout)
+{
+  if (x_shape_.first < nthreads)
+    nthreads = 1;
+  const size_t bsize = x_shape_.first / nthreads;
+  const size_t row_bytes = x_shape_.second * sizeof(double);
+  auto arenas = make_shared<mem::arena_pool>();
+  char * const block = dense_layout ?
+    arenas->map_block(x_shape_.first * row_bytes) : nullptr;
   vector<thread> workers;
   vector<vec_t> x(x_shape_.first);
-  for (size_t i = 0; i < ncpus; i++) {
+  for (size_t i = 0; i < nthreads; i++) {
+    const size_t end_idx = ((i+1)==nthreads) ? x_shape_.first : (bsize * (i+1));
     auto begin = x_begin() + (bsize * i);
-    auto end =
-      ((i+1)==ncpus) ? x_end() : (x_begin() + (bsize * (i+1)));
-    workers.emplace_back(threadwork<x_const_iterator>, ref(x), bsize*i, begin, end);
+    auto end = x_begin() + end_idx;
+    // rows that do not fit their slice go to chunks of the arena's own, so
+    // the block is only a layout hint
+    mem::arena * const a = block ?
+      arenas->make(block + bsize * i * row_bytes, block + end_idx * row_bytes) :
+      arenas->make();
+    workers.emplace_back(threadwork<x_const_iterator>, ref(x), bsize*i,
+                         begin, end, a);
   }
   for (auto &w : workers)
     w.join();
-  standard_vec_t y(get_y());
   assert(x.size() == x_shape_.first);
-  assert(y.size() == x_shape_.first);
-  storage_.reset(new vector_storage(std::move(x), std::move(y)));
-  return true;
+  assert(get_y().size() == x_shape_.first);
+  vector_storage *vs = new vector_storage(
+      std::move(x), standard_vec_t(get_y()), x_shape_.second, arenas);
+  if (const standard_vec_t *w = get_weights())
+    vs->set_weights(standard_vec_t(*w));
+  storage_.reset(vs);
+}
+
+dataset
+dataset::sample(const stratified_sampler &s) const
+{
+  const standard_vec_t &y = get_y();
+  const standard_vec_t *w = get_weights();
+  vector<vec_t> x;
+  standard_vec_t ys, ws;
+  for (size_t i = 0; i < x_shape_.first; i++) {
+    if (!s.keep(i, y[i]))
+      continue;
+    x.emplace_back(get_x(i));
+    ys.push_back(y[i]);
+    ws.push_back((w ? (*w)[i] : 1.0) * s.weight(y[i]));
+  }
+  dataset ret(move(x), move(ys));
+  ret.set_weights(move(ws));
+  ret.parallel_materialize_ = parallel_materialize_;
+  ret.transform_cache_bytes_ = transform_cache_bytes_;
+  ret.transform_cache_float_ = transform_cache_float_;
+  return ret;
 }
@@ -5,7 +5,15 @@
 #include <random>
 #include <type_traits>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <vec.hh>
+#include <dense.hh>
+#include <mem.hh>
+#include <philox.hh>
+#include <row_cache.hh>
+#include <sampling.hh>
+#include <stats.hh>
 #include <util.hh>
 #include <macros.hh>
 
@@ -24,9 +32,19 @@ public:
       return std::make_pair(&get_x(idx), get_y(idx));
     }
     virtual const standard_vec_t & get_raw_y() const = 0;
+    // sample weights, one per row, or null if every row weighs 1.0
+    virtual const standard_vec_t * get_raw_w() const { return nullptr; }
     virtual std::pair<size_t, size_t>
       x_shape() const = 0;
     virtual bool can_be_materialized() const = 0;
+    // rows are computed on access, so references returned by get_x() are
+    // only good until the next access from the same thread
+    virtual bool computes_rows() const { return false; }
+    virtual const row_cache * cache() const { return nullptr; }
+    // all rows as one contiguous block, if they are laid out that way
+    virtual const dense::block * dense() const { return nullptr; }
+    // re-encode sparse rows in packed form (see packed_vec), if supported
+    virtual void pack_rows() {}
   };
 
   // XXX: there is a better way to do this in C++11 (can
@@ -114,6 +132,13 @@ public:
       return *this;
     }
 
+    // the row index this iterator is at (through the permutation, if any)
+    inline size_t
+    index() const
+    {
+      return p_ ? (*p_)[idx_] : idx_;
+    }
+
     inline const_iterator_impl
     operator++(int)
     {
@@ -198,15 +223,29 @@ public:
   public:
     vector_storage(const std::vector<vec_t> &x,
                    const standard_vec_t &y)
-      : x_(x), y_(y)
+      : x_(x), y_(y), nfeatures_(compute_nfeatures(x_))
     {
       assert(x_.size() == y_.size());
+      find_dense();
     }
     vector_storage(std::vector<vec_t> &&x,
                    standard_vec_t &&y)
-      : x_(std::move(x)), y_(std::move(y))
+      : x_(std::move(x)), y_(std::move(y)), nfeatures_(compute_nfeatures(x_))
+    {
+      assert(x_.size() == y_.size());
+      find_dense();
+    }
+    // nfeatures is already known (e.g. computed by the loader). the rows
+    // may be allocated from arenas, which are then kept alive with them
+    vector_storage(std::vector<vec_t> &&x,
+                   standard_vec_t &&y,
+                   size_t nfeatures,
+                   const std::shared_ptr<mem::arena_pool> &arenas = nullptr)
+      : arenas_(arenas), x_(std::move(x)), y_(std::move(y)),
+        nfeatures_(nfeatures)
     {
       assert(x_.size() == y_.size());
+      find_dense();
     }
     const vec_t &
     get_x(size_t idx) const OVERRIDE
@@ -221,33 +260,86 @@ public:
     std::pair<size_t, size_t>
     x_shape() const OVERRIDE
     {
-      size_t nfeatures = 0;
-      for (auto &x : x_)
-        nfeatures = std::max(nfeatures, x.highest_nonzero_dim());
-      return std::make_pair(x_.size(), nfeatures);
+      return std::make_pair(x_.size(), nfeatures_);
     }
     const standard_vec_t &
     get_raw_y() const OVERRIDE
     {
       return y_;
     }
+    const standard_vec_t *
+    get_raw_w() const OVERRIDE
+    {
+      return w_.size() ? &w_ : nullptr;
+    }
+    inline void
+    set_weights(standard_vec_t &&w)
+    {
+      ALWAYS_ASSERT(w.size() == x_.size());
+      w_ = std::move(w);
+    }
     bool
     can_be_materialized() const OVERRIDE
     {
       return false;
     }
+    void pack_rows() OVERRIDE;
+    const dense::block *
+    dense() const OVERRIDE
+    {
+      return dense_.data_ ? &dense_ : nullptr;
+    }
   private:
+    // rows which are all dense, nfeatures wide and back to back in memory
+    // (see dataset::make_dense()) can also be accessed as one block
+    void
+    find_dense()
+    {
+      if (x_.empty() || !nfeatures_)
+        return;
+      const double * const base = x_[0].is_standard() ?
+        x_[0].as_standard_ref().data().data() : nullptr;
+      for (size_t i = 0; i < x_.size(); i++) {
+        if (!x_[i].is_standard() ||
+            x_[i].as_standard_ref().size() != nfeatures_ ||
+            x_[i].as_standard_ref().data().data() != base + i * nfeatures_)
+          return;
+      }
+      dense_ = dense::block(base, x_.size(), nfeatures_, nfeatures_);
+    }
+    static size_t
+    compute_nfeatures(const std::vector<vec_t> &x)
+    {
+      size_t nfeatures = 0;
+      for (auto &v : x)
+        nfeatures = std::max(nfeatures, v.highest_nonzero_dim());
+      return nfeatures;
+    }
+    // declared first so the arenas are released after the rows
+    std::shared_ptr<mem::arena_pool> arenas_;
     std::vector<vec_t> x_;
     standard_vec_t y_;
+    standard_vec_t w_; // empty if unweighted
+    size_t nfeatures_;
+    dense::block dense_;
   };
 
   template <typename Transformer>
   class transforming_storage : public storage_iface {
   public:
+    // a nonzero cache_bytes keeps up to that many bytes of transformed rows
+    // around, instead of recomputing them on every access
     transforming_storage(
         const std::shared_ptr<storage_iface> &impl,
-        Transformer trfm)
-      : impl_(impl), trfm_(trfm) {}
+        Transformer trfm,
+        size_t cache_bytes = 0,
+        bool cache_float = false)
+      : impl_(impl), trfm_(trfm)
+    {
+      if (cache_bytes)
+        cache_.reset(new row_cache(
+              impl_->x_shape().first, cache_bytes, cache_float));
+    }
     const vec_t &
     get_x(size_t idx) const OVERRIDE
     {
@@ -269,40 +361,94 @@ public:
     {
       return impl_->get_raw_y();
     }
+    const standard_vec_t *
+    get_raw_w() const OVERRIDE
+    {
+      return impl_->get_raw_w();
+    }
+    // a cached transform is meant to stand in for materializing it
     bool
     can_be_materialized() const OVERRIDE
+    {
+      return !cache_;
+    }
+    bool
+    computes_rows() const OVERRIDE
     {
       return true;
     }
+    const row_cache *
+    cache() const OVERRIDE
+    {
+      return cache_.get();
+    }
   private:
     inline const vec_t &
     sync(size_t idx)
     {
-      return (v_.my() = trfm_(impl_->get_x(idx)));
+      row_cache::handle &h = h_.my();
+      if (!cache_)
+        return (h.scratch() = trfm_(impl_->get_x(idx)));
+      if (!cache_->lookup(idx, h))
+        cache_->insert(idx, trfm_(impl_->get_x(idx)), h);
+      return h.get();
     }
     std::shared_ptr<storage_iface> impl_;
     Transformer trfm_;
-    util::percore<vec_t> v_;
+    std::unique_ptr<row_cache> cache_;
+    util::per_thread<row_cache::handle> h_;
   };
 
   dataset(const std::vector<vec_t> &x, const standard_vec_t &y)
     : storage_(new vector_storage(x, y)),
-      parallel_materialize_(false)
+      stats_(std::make_shared<stats_cache>()),
+      parallel_materialize_(false),
+      transform_cache_bytes_(0),
+      transform_cache_float_(false)
   {
     initshape();
   }
 
   dataset(std::vector<vec_t> &&x, standard_vec_t &&y)
     : storage_(new vector_storage(std::move(x), std::move(y))),
-      parallel_materialize_(false)
+      stats_(std::make_shared<stats_cache>()),
+      parallel_materialize_(false),
+      transform_cache_bytes_(0),
+      transform_cache_float_(false)
+  {
+    initshape();
+  }
+
+  /**
+   * Takes the statistics of the rows as computed by the loader (see
+   * load_context), which makes the shape, stats(), max_x_norm() and
+   * feature_counts() available without another pass over the rows. If the
+   * rows were allocated from arenas, the dataset takes a reference to them.
+   */
+  dataset(std::vector<vec_t> &&x, standard_vec_t &&y, feature_stats &&stats,
+          const std::shared_ptr<mem::arena_pool> &arenas = nullptr)
+    : stats_(std::make_shared<stats_cache>()),
+      parallel_materialize_(false),
+      transform_cache_bytes_(0),
+      transform_cache_float_(false)
   {
+    ALWAYS_ASSERT(stats.nrows() == x.size());
+    const size_t nfeatures = stats.nfeatures();
+    storage_.reset(
+        new vector_storage(std::move(x), std::move(y), nfeatures, arenas));
+    stats_->stats_ = std::make_shared<const feature_stats>(std::move(stats));
     initshape();
   }
 
   template <typename Transformer>
   dataset(const dataset &that, Transformer trfm)
-    : storage_(new transforming_storage<Transformer>(that.storage_, trfm)),
-      parallel_materialize_(that.parallel_materialize_)
+    : storage_(new transforming_storage<Transformer>(
+          that.storage_, trfm,
+          that.transform_cache_bytes_, that.transform_cache_float_)),
+      stats_(std::make_shared<stats_cache>()),
+      parallel_materialize_(that.parallel_materialize_),
+      transform_cache_bytes_(that.transform_cache_bytes_),
+      transform_cache_float_(that.transform_cache_float_)
   {
     initshape();
   }
@@ -315,6 +461,36 @@ public:
 
   inline bool get_parallel_materialize() const { return parallel_materialize_; }
 
+  /**
+   * Datasets transformed from this one keep up to bytes of transformed rows
+   * in a row_cache (as floats if as_float) rather than being materialized:
+   * materialize() leaves them alone, and rows that do not fit are
+   * recomputed on access. 0 (the default) turns the cache off.
+   */
+  void
+  set_transform_cache(size_t bytes, bool as_float = false)
+  {
+    transform_cache_bytes_ = bytes;
+    transform_cache_float_ = as_float;
+  }
+
+  inline size_t get_transform_cache_bytes() const { return transform_cache_bytes_; }
+  inline bool get_transform_cache_float() const { return transform_cache_float_; }
+
+  // the cache of a transformed dataset, if it has one
+  inline const row_cache *
+  transform_cache() const
+  {
+    return storage_->cache();
+  }
+
+  // see storage_iface::computes_rows()
+  inline bool
+  computes_rows() const
+  {
+    return storage_->computes_rows();
+  }
+
   inline const vec_t &
   get_x(size_t idx) const
   {
@@ -327,6 +503,59 @@ public:
     return storage_->get_raw_y();
   }
 
+  // the sample weights, or null if every row weighs 1.0. transformed
+  // datasets share the weights of the dataset they come from
+  inline const standard_vec_t *
+  get_weights() const
+  {
+    return storage_->get_raw_w();
+  }
+
+  /**
+   * Gives row i a weight of w[i] in training and evaluation: losses,
+   * gradients and metrics become weighted averages. Weights must be
+   * finite, non-negative and not all zero. Like pack_rows(), this applies
+   * to every dataset sharing the same rows.
+   */
+  void
+  set_weights(standard_vec_t &&w)
+  {
+    vector_storage *vs = dynamic_cast<vector_storage *>(storage_.get());
+    if (!vs)
+      throw std::runtime_error("weights can only be set on stored rows");
+    if (w.size() != x_shape_.first)
+      throw std::runtime_error("need one weight per row");
+    double sum = 0.0;
+    for (size_t i = 0; i < w.size(); i++) {
+      // by the bits, as -ffast-math may drop the NaN case of the compare
+      if (!(w[i] >= 0.0) || !util::finite_bits(w[i]))
+        throw std::runtime_error("sample weights must be finite and non-negative");
+      sum += w[i];
+    }
+    if (w.size() && !(sum > 0.0 && util::finite_bits(sum)))
+      throw std::runtime_error("sample weights must have a positive, finite sum");
+    vs->set_weights(std::move(w));
+  }
+
+  // sum of the weights of rows [begin, end), i.e. end - begin if unweighted
+  inline double
+  weight_sum(size_t begin, size_t end) const
+  {
+    const standard_vec_t *w = get_weights();
+    if (!w)
+      return double(end - begin);
+    double sum = 0.0;
+    for (size_t i = begin; i < end; i++)
+      sum += (*w)[i];
+    return sum;
+  }
+
+  inline double
+  weight_sum() const
+  {
+    return weight_sum(0, x_shape_.first);
+  }
+
   typedef const_iterator_impl<storage_iface_x_extractor> x_const_iterator;
   typedef const_iterator_impl<storage_iface_y_extractor> y_const_iterator;
   typedef zip_iterator<x_const_iterator, y_const_iterator> const_iterator;
@@ -373,14 +602,24 @@ public:
     return x_shape_;
   }
 
-  double
+  inline double
   max_x_norm() const
   {
-    double best = 0.0;
-    const auto end = x_end();
-    for (auto it = x_begin(); it != end; ++it)
-      best = std::max(best, (*it).norm());
-    return best;
+    return stats().max_norm();
+  }
+
+  /**
+   * Computed by a parallel pass over the rows on first use, then cached.
+   * Copies of a dataset share the cache (they share the rows), while
+   * transformed datasets start with an empty one.
+   */
+  const feature_stats &
+  stats() const
+  {
+    std::lock_guard<std::mutex> l(stats_->mu_);
+    if (!stats_->stats_)
+      stats_->stats_ = compute_stats();
+    return *stats_->stats_;
   }
 
   class permutation {
@@ -440,38 +679,108 @@ public:
     return permutation(this, std::move(pi));
   }
 
+  // a uniformly random order of the rows, generated by nthreads threads
+  // from key; the same order for any nthreads (see random_permutation())
+  inline permutation
+  permute(uint64_t key, size_t nthreads) const
+  {
+    return permutation(this, random_permutation(x_shape_.first, key, nthreads));
+  }
+
+  // a view of the rows in the given order, which must be a permutation of
+  // [0, get_x_shape().first)
+  inline permutation
+  reorder(std::vector<size_t> &&pi) const
+  {
+    ALWAYS_ASSERT(pi.size() == x_shape_.first);
+    return permutation(this, std::move(pi));
+  }
+
+  /**
+   * Computes and stores the rows of a transformed dataset. If the first
+   * row comes out dense and full width, the rows are laid out back to back
+   * so that dense() is available afterwards.
+   */
   void
   materialize()
   {
     if (!storage_->can_be_materialized())
       return;
-    if (!parallel_materialize_ || !do_parallel_materialize()) {
-      std::vector<vec_t> x(x_begin(), x_end());
-      standard_vec_t y(get_y());
-      assert(x.size() == x_shape_.first);
-      assert(y.size() == x_shape_.first);
-      storage_.reset(new vector_storage(std::move(x), std::move(y)));
+    bool dense_layout = false;
+    if (x_shape_.first) {
+      const vec_t &x0 = get_x(0);
+      dense_layout = x0.is_standard() &&
+        x0.as_standard_ref().size() == x_shape_.second;
+    }
+    do_materialize(parallel_materialize_ ? util::ncpus_online() : 1,
+                   dense_layout);
+  }
+
+  /**
+   * If every row is dense and full width, copies them into one contiguous
+   * block (unless they already are) and returns true. Datasets sharing
+   * the old storage are not affected.
+   */
+  bool
+  make_dense()
+  {
+    if (dense())
+      return true;
+    if (storage_->computes_rows() || !x_shape_.first || !x_shape_.second)
+      return false;
+    for (size_t i = 0; i < x_shape_.first; i++) {
+      const vec_t &x = get_x(i);
+      if (!x.is_standard() || x.as_standard_ref().size() != x_shape_.second)
+        return false;
     }
+    do_materialize(parallel_materialize_ ? util::ncpus_online() : 1, true);
+    return dense() != nullptr;
+  }
+
+  // the rows as one row-major block, for dense kernels; null unless the
+  // rows were laid out by make_dense() or materialize()
+  inline const dense::block *
+  dense() const
+  {
+    return storage_->dense();
   }
 
-  inline std::vector<size_t>
+  /**
+   * Packs the sparse rows of a materialized dataset in place, trading a
+   * little decode work in the kernels for less memory traffic. Datasets
+   * sharing the same storage see the packed rows as well.
+   */
+  void
+  pack_rows()
+  {
+    storage_->pack_rows();
+  }
+
+  /**
+   * A copy of the rows s keeps (row i is the i-th row of this dataset),
+   * each weighing its current weight times s.weight(y). Sampling at load
+   * time (see load_context) gives the same rows without ever holding the
+   * others.
+   */
+  dataset sample(const stratified_sampler &s) const;
+
+  inline const std::vector<size_t> &
   feature_counts() const
   {
-    std::vector<size_t> ret(x_shape_.second);
-    const auto it_end = x_end();
-    for (auto it = x_begin(); it != it_end; ++it) {
-      const auto &x = *it;
-      const auto inner_it_end = x.end();
-      for (auto inner_it = x.begin();
-           inner_it != inner_it_end; ++inner_it)
-        ret[inner_it.tell()]++;
-    }
-    return ret;
+    return stats().counts();
   }
 
 private:
 
-  bool do_parallel_materialize();
+  struct stats_cache {
+    std::mutex mu_;
+    std::shared_ptr<const feature_stats> stats_;
+  };
+
+  // materializes into arenas, one per thread. with dense_layout, the arenas
+  // are consecutive slices of one block sized for full width dense rows
+  void do_materialize(size_t nthreads, bool dense_layout);
+  std::shared_ptr<const feature_stats> compute_stats() const;
 
   inline void
   initshape()
@@ -480,6 +789,9 @@ private:
   }
 
   std::shared_ptr<storage_iface> storage_;
+  std::shared_ptr<stats_cache> stats_;
   std::pair<size_t, size_t> x_shape_;
   bool parallel_materialize_;
+  size_t transform_cache_bytes_;
+  bool transform_cache_float_;
 };
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+
+#include <macros.hh>
+#include <util.hh>
+
+/**
+ * Kernels for dense rows stored back to back (see dataset::dense()).
+ *
+ * Reductions run over several independent accumulators, so they vectorize
+ * even without -ffast-math reassociating a single sum, and the restrict
+ * qualifiers spare the compiler runtime alias checks.
+ */
+namespace dense {
+
+// a row-major rows x cols matrix of doubles, one row every stride doubles
+struct block {
+  block() : data_(nullptr), rows_(0), cols_(0), stride_(0) {}
+  block(const double *data, size_t rows, size_t cols, size_t stride)
+    : data_(data), rows_(rows), cols_(cols), stride_(stride) {}
+
+  inline const double *
+  row(size_t i) const
+  {
+    assert(i < rows_);
+    return data_ + i * stride_;
+  }
+
+  const double *data_;
+  size_t rows_;
+  size_t cols_;
+  size_t stride_;
+};
+
+static const size_t Lanes = 8;
+
+static inline double
+dot(const double *__restrict__ a, const double *__restrict__ b, size_t n)
+{
+  double acc[Lanes] = {0.0};
+  const size_t nb = n - n % Lanes;
+  for (size_t i = 0; i < nb; i += Lanes)
+    for (size_t j = 0; j < Lanes; j++)
+      acc[j] += a[i + j] * b[i + j];
+  double s = 0.0;
+  for (size_t i = nb; i < n; i++)
+    s += a[i] * b[i];
+  for (size_t j = 0; j < Lanes; j++)
+    s += acc[j];
+  return s;
+}
+
+// y += alpha * x
+static inline void
+axpy(double alpha, const double *__restrict__ x, double *__restrict__ y,
+     size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    y[i] += alpha * x[i];
+}
+
+// issues prefetches for the first max_lines cache lines of a row
+static inline void
+prefetch(const double *p, size_t n, size_t max_lines = 8)
+{
+  const size_t lines =
+    std::min(max_lines, (n * sizeof(double) + CACHELINE_SIZE - 1) / CACHELINE_SIZE);
+  const char * const c = reinterpret_cast<const char *>(p);
+  for (size_t l = 0; l < lines; l++)
+    __builtin_prefetch(c + l * CACHELINE_SIZE, 0, 3);
+}
+
+/**
+ * In-place Cholesky factorization of the n x n symmetric positive
+ * definite matrix a (row-major, only the lower triangle is read), leaving
+ * L with a = L L^T in the lower triangle. Right-looking and blocked: each
+ * step factors a Block-wide diagonal block, solves the panel below it,
+ * and updates the trailing lower triangle with contiguous row dot
+ * products, the latter two split by rows over nthreads. Returns false,
+ * with a partly overwritten, if a is not numerically positive definite.
+ */
+static inline bool
+cholesky(double *a, size_t n, size_t nthreads)
+{
+  static const size_t Block = 64;
+  for (size_t kb = 0; kb < n; kb += Block) {
+    const size_t ke = std::min(n, kb + Block);
+    for (size_t j = kb; j < ke; j++) {
+      double * const aj = a + j * n;
+      const double d = aj[j] - dot(aj + kb, aj + kb, j - kb);
+      if (!(d > 0.0))
+        return false;
+      aj[j] = std::sqrt(d);
+      for (size_t i = j + 1; i < ke; i++) {
+        double * const ai = a + i * n;
+        ai[j] = (ai[j] - dot(ai + kb, aj + kb, j - kb)) / aj[j];
+      }
+    }
+    if (ke == n)
+      break;
+    // rows are interleaved over threads, evening out the triangle
+    const size_t nt = std::max(size_t(1), std::min(nthreads, (n - ke) / Block));
+    util::parallel_run(nt, [a, n, kb, ke, nt](size_t t) {
+      for (size_t i = ke + t; i < n; i += nt) {
+        double * const ai = a + i * n;
+        for (size_t j = kb; j < ke; j++) {
+          const double * const aj = a + j * n;
+          ai[j] = (ai[j] - dot(ai + kb, aj + kb, j - kb)) / aj[j];
+        }
+      }
+    });
+    util::parallel_run(nt, [a, n, kb, ke, nt](size_t t) {
+      for (size_t i = ke + t; i < n; i += nt) {
+        double * const ai = a + i * n;
+        for (size_t j = ke; j <= i; j++)
+          ai[j] -= dot(ai + kb, a + j * n + kb, ke - kb);
+      }
+    });
+  }
+  return true;
+}
+
+/**
+ * The transpose of the inverse of a lower triangular n x n matrix l, as
+ * an upper triangular row-major matrix: row c of the result is column c
+ * of l^{-1}, found by forward substitution on contiguous rows of l.
+ * Entries below the diagonal are zero.
+ */
+static inline void
+lower_inverse_transpose(const double *l, size_t n, double *out,
+                        size_t nthreads)
+{
+  std::fill(out, out + n * n, 0.0);
+  const size_t nt = std::max(size_t(1), std::min(nthreads, n / 16));
+  util::parallel_run(nt, [l, n, out, nt](size_t t) {
+    for (size_t c = t; c < n; c += nt) {
+      double * const w = out + c * n;
+      w[c] = 1.0 / l[c * n + c];
+      for (size_t i = c + 1; i < n; i++)
+        w[i] = -dot(l + i * n + c, w + c, i - c) / l[i * n + i];
+    }
+  });
+}
+
+} // namespace dense
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <macros.hh>
+#include <vec.hh>
+#include <dataset.hh>
+#include <util.hh>
+
+/**
+ * The features a linear model sees in a row, generated from the row as it
+ * is read rather than stored. The optimizers' dot and update loops go
+ * through for_each() of their model's map (see linear_model::get_features()),
+ * so an expanded feature space costs no more row bandwidth than the raw
+ * one.
+ *
+ * A map provides:
+ *   dim(xdim): the number of weights for rows of dimension xdim
+ *   for_each(x, f): f(feature_idx, value) for every feature of x
+ *   dot(w, x): <w, features of x>, features past the end of w being zeros
+ *   feature_counts(d): how many rows of d have each feature
+ */
+namespace feature_maps {
+
+// a row's features are its nonzeros
+class identity_map {
+public:
+  static const bool is_identity = true;
+
+  inline size_t dim(size_t xdim) const { return xdim; }
+
+  template <typename Fn>
+  inline void
+  for_each(const vec_t &x, Fn f) const
+  {
+    x.for_each_nonzero(f);
+  }
+
+  inline double
+  dot(const standard_vec_t &w, const vec_t &x) const
+  {
+    return ops::dot(w, x);
+  }
+
+  inline std::vector<size_t>
+  feature_counts(const dataset &d) const
+  {
+    return d.feature_counts();
+  }
+
+  inline void mapconfig(std::map<std::string, std::string> &) const {}
+};
+
+/**
+ * A row's nonzeros below xdim, followed by the products of every pair of
+ * them, each with itself included, hashed into 2^bits buckets after the
+ * raw features (as with Vowpal Wabbit's quadratic features). A row with k
+ * nonzeros has k (k + 1) / 2 crosses; colliding crosses share a weight.
+ */
+class interaction_map {
+public:
+  static const bool is_identity = false;
+
+  // 2^24 crosses already take 128MB per weight-sized vector, of which
+  // the optimizers keep several
+  static const unsigned MaxBits = 24;
+
+  interaction_map(size_t xdim, unsigned bits)
+    : xdim_(xdim), bits_(bits), mask_((uint64_t(1) << bits) - 1)
+  {
+    if (!bits || bits > MaxBits)
+      throw std::runtime_error(
+          "interaction bits must be in [1, " + std::to_string(MaxBits) + "]");
+  }
+
+  inline size_t dim(size_t) const { return xdim_ + mask_ + 1; }
+
+  // f must not call for_each() of any interaction_map itself: the row's
+  // nonzeros are buffered per thread while its crosses are generated
+  template <typename Fn>
+  inline void
+  for_each(const vec_t &x, Fn f) const
+  {
+    std::vector<std::pair<size_t, double>> &nz = scratch();
+    nz.clear();
+    const size_t xdim = xdim_;
+    x.for_each_nonzero([&nz, &f, xdim](size_t idx, double value) {
+      if (idx >= xdim)
+        return;
+      nz.emplace_back(idx, value);
+      f(idx, value);
+    });
+    const size_t n = nz.size();
+    for (size_t a = 0; a < n; a++) {
+      const uint64_t ha = uint64_t(nz[a].first) * Golden;
+      const double va = nz[a].second;
+      for (size_t b = a; b < n; b++)
+        f(xdim + (mix(ha + nz[b].first) & mask_), va * nz[b].second);
+    }
+  }
+
+  inline double
+  dot(const standard_vec_t &w, const vec_t &x) const
+  {
+    double s = 0.0;
+    const size_t d = w.size();
+    for_each(x, [&s, &w, d](size_t idx, double value) {
+      if (idx < d)
+        s += w[idx] * value;
+    });
+    return s;
+  }
+
+  // one pass over the rows in parallel. raw features are few and hot, so
+  // each thread counts them privately; crosses go straight into the shared
+  // result, which is the only vector of dim() entries
+  inline std::vector<size_t>
+  feature_counts(const dataset &d) const
+  {
+    const size_t n = d.get_x_shape().first;
+    const size_t nthreads =
+      std::max(size_t(1), std::min(size_t(util::ncpus_online()), n / 1024));
+    std::vector<size_t> counts(dim(0), 0);
+    std::vector<std::vector<size_t>> raw(nthreads);
+    size_t *const shared = counts.data();
+    const size_t xdim = xdim_;
+    util::parallel_run(nthreads, [&](size_t t) {
+      std::vector<size_t> &c = raw[t];
+      c.assign(xdim, 0);
+      for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++)
+        for_each(d.get_x(i), [&c, shared, xdim](size_t idx, double) {
+          if (idx < xdim)
+            c[idx]++;
+          else
+            __sync_fetch_and_add(&shared[idx], 1);
+        });
+    });
+    for (size_t t = 0; t < nthreads; t++)
+      for (size_t j = 0; j < xdim; j++)
+        counts[j] += raw[t][j];
+    return counts;
+  }
+
+  inline void
+  mapconfig(std::map<std::string, std::string> &m) const
+  {
+    m["model_interaction_bits"] = std::to_string(bits_);
+    m["model_interaction_xdim"] = std::to_string(xdim_);
+  }
+
+  inline size_t get_xdim() const { return xdim_; }
+  inline unsigned get_bits() const { return bits_; }
+
+private:
+  static const uint64_t Golden = 0x9e3779b97f4a7c15ULL;
+
+  // splitmix64 finalizer
+  static inline uint64_t
+  mix(uint64_t z)
+  {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  static inline std::vector<std::pair<size_t, double>> &
+  scratch()
+  {
+    static thread_local std::vector<std::pair<size_t, double>> nz;
+    return nz;
+  }
+
+  size_t xdim_;
+  unsigned bits_;
+  uint64_t mask_;
+};
+
+} // namespace feature_maps
@@ -12,6 +12,7 @@
 #include <pretty_printers.hh>
 #include <loss_functions.hh>
 #include <dataset.hh>
+#include <dense.hh>
 #include <timer.hh>
 #include <model.hh>
 #include <classifier.hh>
@@ -58,43 +59,48 @@ public:
 
     const auto shape = transformed.get_x_shape();
     this->training_sz_ = shape.first;
+    const size_t nfeatures = this->model_.get_features().dim(shape.second);
 
     this->w_history_.clear();
     if (keep_histories)
       this->w_history_.reserve(this->nrounds_);
-    this->model_.weightvec().resize(shape.second);
+    this->model_.weightvec().resize(nfeatures);
 
-    standard_vec_t accum(shape.second);
-    timer tt1;
+    // with sample weights, the gradient is the weighted average
+    const standard_vec_t * const sw = transformed.get_weights();
+    const double total_weight = transformed.weight_sum();
+    if (this->verbose_)
+      std::cerr << "[INFO] sample weights: " << (sw ? "yes" : "no") << std::endl;
+
+    standard_vec_t accum(nfeatures);
+    timer tt1(timer::T_CLK_MONOTONIC_RAW);
     for (size_t round = 0; round < this->nrounds_; round++) {
       tt1.lap();
       const size_t t_eff = (1+round) + t_offset_;
       const double eta_t = c0_ / (this->model_.get_lambda() * t_eff);
       accum.reset();
 
-      const auto it_end = transformed.end();
-      for (auto it = transformed.begin(); it != it_end; ++it) {
-        const auto &x = *it.first();
-        const double dloss = this->model_.get_lossfn().dloss(
-            *it.second(), ops::dot(this->model_.weightvec(), x));
-        const auto inner_it_end = x.end();
-        for (auto inner_it = x.begin();
-            inner_it != inner_it_end; ++inner_it) {
-          const size_t feature_idx = inner_it.tell();
-          accum[feature_idx] += (*inner_it) * dloss;
-        }
-      }
+      if (sw)
+        accum_grad<true>(accum, transformed, sw->data().data());
+      else
+        accum_grad<false>(accum, transformed, nullptr);
 
-      accum *= (eta_t / double(this->training_sz_));
+      accum *= (eta_t / total_weight);
       this->model_.weightvec() *= (1.0 - eta_t * this->model_.get_lambda());
       this->model_.weightvec() -= accum;
 
-      if (this->verbose_) {
-        std::cerr << "[INFO] finished round " << (round+1) << " in "
-                  << tt1.lap_ms() << " ms" << std::endl;
-        std::cerr << "[INFO] current risk: "
-                  << this->model_.empirical_risk(transformed) << std::endl;
-        std::cerr << "[INFO] step size: " << eta_t << std::endl;
+      const double round_ms = tt1.lap_ms();
+      if (this->verbose_ || this->telemetry_) {
+        const double risk = this->model_.transformed_empirical_risk(transformed);
+        if (this->verbose_) {
+          std::cerr << "[INFO] finished round " << (round+1) << " in "
+                    << round_ms << " ms" << std::endl;
+          std::cerr << "[INFO] current risk: " << risk << std::endl;
+          std::cerr << "[INFO] step size: " << eta_t << std::endl;
+        }
+        this->emit_round(round + 1, round_ms, risk);
+        if (this->telemetry_)
+          this->telemetry_->emit("step_size", round + 1, eta_t);
       }
     }
   }
@@ -116,6 +122,38 @@ public:
   }
 
 private:
+  template <bool Weighted>
+  void
+  accum_grad(standard_vec_t &accum, const dataset &d, const double *sw) const
+  {
+    const standard_vec_t &w = this->model_.weightvec();
+    const auto &fmap = this->model_.get_features();
+    if (const dense::block *b =
+          Model::feature_map_type::is_identity ? d.dense() : nullptr) {
+      const standard_vec_t &y = d.get_y();
+      const size_t cols = std::min(b->cols_, accum.size());
+      for (size_t i = 0; i < b->rows_; i++) {
+        double dloss = this->model_.get_lossfn().dloss(
+            y[i], model::dense_row_dot(*b, i, w));
+        if (Weighted)
+          dloss *= sw[i];
+        dense::axpy(dloss, b->row(i), accum.data().data(), cols);
+      }
+      return;
+    }
+    const auto it_end = d.end();
+    size_t i = 0;
+    for (auto it = d.begin(); it != it_end; ++it, ++i) {
+      const auto &x = *it.first();
+      double dloss = this->model_.get_lossfn().dloss(*it.second(), fmap.dot(w, x));
+      if (Weighted)
+        dloss *= sw[i];
+      fmap.for_each(x, [&accum, dloss](size_t feature_idx, double value) {
+        accum[feature_idx] += value * dloss;
+      });
+    }
+  }
+
   size_t t_offset_;
   double c0_;
 };
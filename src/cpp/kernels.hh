@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <macros.hh>
+#include <vec.hh>
+#include <util.hh>
+
+/**
+ * Translation invariant kernels k(x, y) = k(x - y) with bandwidth sigma,
+ * for the random Fourier features of model::kernelized_linear_model:
+ * sample_fourier() draws a frequency vector from the kernel's Fourier
+ * transform (Rahimi and Recht, 2007).
+ *
+ * Samples are drawn in two passes over a vector: the uniforms first, one
+ * generator call at a time, then a branch-free loop mapping them through
+ * the inverse CDF, which the compiler can vectorize.
+ *
+ * Kernels that are not translation invariant are instead functions of
+ * <x, y>, ||x||^2 and ||y||^2, given to from_products(), and are
+ * approximated by model::nystrom_linear_model.
+ */
+namespace kernels {
+
+// a uniform in the open interval (0, 1)
+template <typename Generator>
+static inline double
+open_uniform(Generator &g)
+{
+  static const double half_ulp = std::ldexp(1.0, -54);
+  const double u = std::generate_canonical<double, 53>(g);
+  return std::min(u + half_ulp, 1.0 - half_ulp);
+}
+
+template <typename Generator>
+static inline void
+fill_open_uniform(double *out, size_t n, Generator &g)
+{
+  for (size_t i = 0; i < n; i++)
+    out[i] = open_uniform(g);
+}
+
+// standard normals, two per pair of uniforms (Box-Muller)
+template <typename Generator>
+static inline void
+fill_normal(double *out, size_t n, Generator &g)
+{
+  const size_t npairs = (n + 1) / 2;
+  std::vector<double> u(2 * npairs);
+  fill_open_uniform(u.data(), u.size(), g);
+  for (size_t i = 0; i < npairs; i++) {
+    const double r = std::sqrt(-2.0 * std::log(u[2 * i]));
+    const double theta = 2.0 * M_PI * u[2 * i + 1];
+    u[2 * i] = r * std::cos(theta);
+    u[2 * i + 1] = r * std::sin(theta);
+  }
+  std::copy(u.begin(), u.begin() + n, out);
+}
+
+static inline void
+check_sigma(double sigma)
+{
+  if (!(sigma > 0.0) || !util::finite_bits(sigma))
+    throw std::runtime_error("kernel bandwidth must be positive");
+}
+
+// calls f on every coordinate of x - y
+template <typename Fn>
+static inline void
+for_each_difference(const standard_vec_t &x, const standard_vec_t &y, Fn f)
+{
+  ALWAYS_ASSERT(x.size() == y.size());
+  for (size_t i = 0; i < x.size(); i++)
+    f(x[i] - y[i]);
+}
+
+/**
+ * Gaussian kernel, exp(-||x - y||_2^2 / (2 sigma^2)); its Fourier
+ * transform is N(0, I / sigma^2).
+ */
+class rbf_kernel {
+public:
+  static const bool is_translation_invariant = true;
+
+  explicit rbf_kernel(double sigma = 1.0)
+    : sigma_(sigma)
+  {
+    check_sigma(sigma);
+  }
+
+  inline double
+  operator()(const standard_vec_t &x, const standard_vec_t &y) const
+  {
+    double s = 0.0;
+    for_each_difference(x, y, [&s](double d) { s += d * d; });
+    return std::exp(-s / (2.0 * sigma_ * sigma_));
+  }
+
+  template <typename Generator>
+  inline standard_vec_t
+  sample_fourier(size_t xdim, Generator &g) const
+  {
+    standard_vec_t w;
+    w.resize(xdim);
+    double * const p = w.data().data();
+    fill_normal(p, xdim, g);
+    const double scale = 1.0 / sigma_;
+    for (size_t i = 0; i < xdim; i++)
+      p[i] *= scale;
+    return w;
+  }
+
+  inline double get_sigma() const { return sigma_; }
+  static inline std::string name() { return "rbf"; }
+
+private:
+  double sigma_;
+};
+
+/**
+ * Laplacian kernel, exp(-||x - y||_1 / sigma); its Fourier transform is a
+ * product of Cauchy(0, 1 / sigma) densities.
+ */
+class laplacian_kernel {
+public:
+  static const bool is_translation_invariant = true;
+
+  explicit laplacian_kernel(double sigma = 1.0)
+    : sigma_(sigma)
+  {
+    check_sigma(sigma);
+  }
+
+  inline double
+  operator()(const standard_vec_t &x, const standard_vec_t &y) const
+  {
+    double s = 0.0;
+    for_each_difference(x, y, [&s](double d) { s += std::fabs(d); });
+    return std::exp(-s / sigma_);
+  }
+
+  template <typename Generator>
+  inline standard_vec_t
+  sample_fourier(size_t xdim, Generator &g) const
+  {
+    standard_vec_t w;
+    w.resize(xdim);
+    double * const p = w.data().data();
+    fill_open_uniform(p, xdim, g);
+    const double scale = 1.0 / sigma_;
+    for (size_t i = 0; i < xdim; i++)
+      p[i] = scale * std::tan(M_PI * (p[i] - 0.5));
+    return w;
+  }
+
+  inline double get_sigma() const { return sigma_; }
+  static inline std::string name() { return "laplacian"; }
+
+private:
+  double sigma_;
+};
+
+/**
+ * Cauchy kernel, prod_i 1 / (1 + ((x_i - y_i) / sigma)^2); its Fourier
+ * transform is a product of Laplace(0, 1 / sigma) densities.
+ */
+class cauchy_kernel {
+public:
+  static const bool is_translation_invariant = true;
+
+  explicit cauchy_kernel(double sigma = 1.0)
+    : sigma_(sigma)
+  {
+    check_sigma(sigma);
+  }
+
+  inline double
+  operator()(const standard_vec_t &x, const standard_vec_t &y) const
+  {
+    double p = 1.0;
+    const double s2 = sigma_ * sigma_;
+    for_each_difference(x, y, [&p, s2](double d) { p /= 1.0 + d * d / s2; });
+    return p;
+  }
+
+  template <typename Generator>
+  inline standard_vec_t
+  sample_fourier(size_t xdim, Generator &g) const
+  {
+    standard_vec_t w;
+    w.resize(xdim);
+    double * const p = w.data().data();
+    fill_open_uniform(p, xdim, g);
+    const double scale = 1.0 / sigma_;
+    for (size_t i = 0; i < xdim; i++) {
+      const double v = p[i] - 0.5;
+      p[i] = scale * std::copysign(std::log1p(-2.0 * std::fabs(v)), v);
+    }
+    return w;
+  }
+
+  inline double get_sigma() const { return sigma_; }
+  static inline std::string name() { return "cauchy"; }
+
+private:
+  double sigma_;
+};
+
+// <x, y>, ||x||^2 and ||y||^2 of two dense vectors
+static inline void
+products(const standard_vec_t &x, const standard_vec_t &y,
+         double &xy, double &xx, double &yy)
+{
+  ALWAYS_ASSERT(x.size() == y.size());
+  xy = xx = yy = 0.0;
+  for (size_t i = 0; i < x.size(); i++) {
+    xy += x[i] * y[i];
+    xx += x[i] * x[i];
+    yy += y[i] * y[i];
+  }
+}
+
+/**
+ * Polynomial kernel, (<x, y> / sigma^2 + offset)^degree.
+ */
+class polynomial_kernel {
+public:
+  static const bool is_translation_invariant = false;
+
+  explicit polynomial_kernel(double sigma = 1.0, unsigned degree = 2,
+                             double offset = 1.0)
+    : sigma_(sigma), degree_(degree), offset_(offset)
+  {
+    check_sigma(sigma);
+    if (!degree)
+      throw std::runtime_error("polynomial kernel degree must be positive");
+    if (!(offset >= 0.0))
+      throw std::runtime_error("polynomial kernel offset must be nonnegative");
+  }
+
+  inline double
+  from_products(double xy, double, double) const
+  {
+    const double b = xy / (sigma_ * sigma_) + offset_;
+    double p = b;
+    for (unsigned i = 1; i < degree_; i++)
+      p *= b;
+    return p;
+  }
+
+  inline double
+  operator()(const standard_vec_t &x, const standard_vec_t &y) const
+  {
+    double xy, xx, yy;
+    products(x, y, xy, xx, yy);
+    return from_products(xy, xx, yy);
+  }
+
+  inline double get_sigma() const { return sigma_; }
+  inline unsigned get_degree() const { return degree_; }
+  inline double get_offset() const { return offset_; }
+  static inline std::string name() { return "poly"; }
+
+private:
+  double sigma_;
+  unsigned degree_;
+  double offset_;
+};
+
+/**
+ * Arc-cosine kernel of order n in {0, 1, 2} (Cho and Saul, 2009) on
+ * x / sigma and y / sigma:
+ *   (1 / pi) ||x||^n ||y||^n J_n(theta),
+ * with theta the angle between x and y, and
+ *   J_0 = pi - theta,
+ *   J_1 = sin(theta) + (pi - theta) cos(theta),
+ *   J_2 = 3 sin(theta) cos(theta) + (pi - theta) (1 + 2 cos^2(theta)).
+ * The zero vector is taken to be orthogonal to everything.
+ */
+class arccos_kernel {
+public:
+  static const bool is_translation_invariant = false;
+
+  explicit arccos_kernel(double sigma = 1.0, unsigned order = 1)
+    : sigma_(sigma), order_(order)
+  {
+    check_sigma(sigma);
+    if (order > 2)
+      throw std::runtime_error("arc-cosine kernel order must be 0, 1 or 2");
+  }
+
+  inline double
+  from_products(double xy, double xx, double yy) const
+  {
+    const double nn = std::sqrt(xx * yy);
+    const double c = nn > 0.0 ? std::max(-1.0, std::min(1.0, xy / nn)) : 0.0;
+    const double s = std::sqrt(1.0 - c * c);
+    const double pt = M_PI - std::acos(c);
+    const double s2 = sigma_ * sigma_;
+    switch (order_) {
+    case 0:
+      return pt / M_PI;
+    case 1:
+      return nn / s2 * (s + pt * c) / M_PI;
+    default:
+      return nn * nn / (s2 * s2) * (3.0 * s * c + pt * (1.0 + 2.0 * c * c)) / M_PI;
+    }
+  }
+
+  inline double
+  operator()(const standard_vec_t &x, const standard_vec_t &y) const
+  {
+    double xy, xx, yy;
+    products(x, y, xy, xx, yy);
+    return from_products(xy, xx, yy);
+  }
+
+  inline double get_sigma() const { return sigma_; }
+  inline unsigned get_order() const { return order_; }
+  static inline std::string name() { return "arccos"; }
+
+private:
+  double sigma_;
+  unsigned order_;
+};
+
+} // namespace kernels
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Reads a text file in large chunks that always end on a line boundary, so
+ * chunks can be handed to different threads and parsed independently.
+ */
+class line_chunk_reader {
+public:
+  static const size_t DefaultChunkBytes = 1 << 22;
+
+  line_chunk_reader(const std::string &filename,
+                    size_t chunk_bytes = DefaultChunkBytes)
+    : ifs_(filename, std::ios::in | std::ios::binary),
+      chunk_bytes_(chunk_bytes)
+  {
+    if (!ifs_.good())
+      throw std::runtime_error("could not open file");
+  }
+
+  // fills chunk with one or more whole lines; returns false at EOF
+  bool
+  next(std::string &chunk)
+  {
+    chunk.swap(carry_);
+    carry_.clear();
+    while (ifs_.good()) {
+      const size_t off = chunk.size();
+      chunk.resize(off + chunk_bytes_);
+      ifs_.read(&chunk[off], chunk_bytes_);
+      chunk.resize(off + ifs_.gcount());
+      const size_t nl = chunk.rfind('\n');
+      if (nl != std::string::npos && nl >= off) {
+        carry_.assign(chunk, nl + 1, std::string::npos);
+        chunk.resize(nl + 1);
+        return true;
+      }
+      // no newline in what we just read: keep reading into the same chunk
+    }
+    // last line may be missing its newline
+    return !chunk.empty();
+  }
+
+private:
+  std::ifstream ifs_;
+  size_t chunk_bytes_;
+  std::string carry_;
+};
+
+// calls fn(begin, end) for every non-empty line in [begin, end)
+template <typename Fn>
+static inline void
+for_each_line(const char *begin, const char *end, Fn fn)
+{
+  while (begin < end) {
+    const char *nl =
+      static_cast<const char *>(memchr(begin, '\n', end - begin));
+    const char *line_end = nl ? nl : end;
+    const char *e = line_end;
+    if (e > begin && e[-1] == '\r')
+      e--;
+    if (e > begin)
+      fn(begin, e);
+    begin = line_end + 1;
+  }
+}
+
+/**
+ * A whole text file mapped read-only, for parsers that split it between
+ * threads. The mapping is not NUL terminated.
+ */
+class mapped_text_file {
+public:
+  explicit mapped_text_file(const std::string &filename)
+    : data_(nullptr), size_(0)
+  {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("could not open file");
+    struct stat st;
+    if (fstat(fd, &st)) {
+      close(fd);
+      throw std::runtime_error("could not stat file");
+    }
+    size_ = st.st_size;
+    if (size_) {
+      void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("could not map file");
+      }
+      madvise(p, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char *>(p);
+    }
+    close(fd);
+  }
+
+  ~mapped_text_file()
+  {
+    if (data_)
+      munmap(const_cast<char *>(data_), size_);
+  }
+
+  mapped_text_file(const mapped_text_file &) = delete;
+  mapped_text_file &operator=(const mapped_text_file &) = delete;
+
+  inline const char * begin() const { return data_; }
+  inline const char * end() const { return data_ + size_; }
+  inline size_t size() const { return size_; }
+
+  // at most n consecutive ranges covering the file, each made of whole
+  // lines (some may be empty)
+  std::vector<std::pair<const char *, const char *>>
+  split_lines(size_t n) const
+  {
+    std::vector<std::pair<const char *, const char *>> ret;
+    const char *p = begin();
+    for (size_t i = 0; i < n; i++) {
+      const char *e = (i + 1 == n) ? end() : begin() + size_ / n * (i + 1);
+      if (e < p)
+        e = p;
+      if (e != end()) {
+        const char *nl =
+          static_cast<const char *>(memchr(e, '\n', end() - e));
+        e = nl ? nl + 1 : end();
+      }
+      ret.emplace_back(p, e);
+      p = e;
+    }
+    return ret;
+  }
+
+private:
+  const char *data_;
+  size_t size_;
+};
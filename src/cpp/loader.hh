@@ -0,0 +1,201 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <mem.hh>
+#include <sampling.hh>
+#include <stats.hh>
+#include <util.hh>
+#include <vec.hh>
+
+/**
+ * Optional arguments shared by the read_feature_file() loaders
+ * (ascii_file, binary_file, svmlight_file).
+ */
+struct load_context {
+  load_context()
+    : stats(nullptr), weights(nullptr), sampler(nullptr), real_labels(false) {}
+
+  // if non-null, every row read is also added to *stats as it is parsed,
+  // so a dataset can be built without another pass over the rows. loader
+  // threads keep per-feature moments only if *stats does
+  feature_stats *stats;
+
+  // if non-null, row payloads are allocated from arenas added to this pool
+  // (one per loader thread) instead of the heap. the pool must outlive the
+  // rows; dataset can take ownership of it
+  std::shared_ptr<mem::arena_pool> arenas;
+
+  // if non-null, loaders for formats that carry sample weights (blocked
+  // binary files) store the weight of every row here, aligned with xs. it
+  // is left untouched when the file has no weights
+  standard_vec_t *weights;
+
+  // if non-null, only the rows the sampler keeps are loaded, and (with
+  // weights) each weighs its file weight times sampler->weight(y). rows are
+  // numbered from 0 in every file, whatever the rows already in xs
+  const stratified_sampler *sampler;
+
+  // accept any real-valued label (regression targets) rather than only
+  // class labels
+  bool real_labels;
+
+  inline bool
+  keep(size_t row, double y) const
+  {
+    return !sampler || sampler->keep(row, y);
+  }
+
+  // stores ws as the weights of rows [off, off + ws.size()), giving any
+  // earlier rows a weight of 1.0
+  inline void
+  set_weights(size_t off, const std::vector<double> &ws) const
+  {
+    const size_t n = std::min(size_t(weights->size()), off);
+    weights->resize(off + ws.size());
+    for (size_t i = n; i < off; i++)
+      (*weights)[i] = 1.0;
+    for (size_t i = 0; i < ws.size(); i++)
+      (*weights)[off + i] = ws[i];
+  }
+
+  inline mem::arena *
+  make_arena() const
+  {
+    return arenas ? arenas->make() : nullptr;
+  }
+
+  // an empty partial of *stats for one loader thread
+  inline feature_stats
+  make_stats() const
+  {
+    return feature_stats(0, stats && stats->has_moments());
+  }
+
+  // merges the loader threads' partials into *stats, by feature range
+  inline void
+  merge_stats(std::vector<feature_stats> &parts) const
+  {
+    parts.insert(parts.begin(), std::move(*stats));
+    feature_stats::merge_all(parts, util::ncpus_online());
+    *stats = std::move(parts[0]);
+  }
+};
+
+/**
+ * Where a loader thread puts the runs of consecutive rows (blocks, index
+ * entries, read chunks) it decodes. Without a sampler a run is decoded
+ * straight into its final place; with one, into scratch rows of which
+ * only the kept ones are copied out (into the thread's arena) and set
+ * aside, to be appended in file order by finish(). Either way only rows
+ * that end up being loaded reach the stats or an arena.
+ */
+class run_sink {
+public:
+  struct run {
+    vec_t *xs;
+    double *ys;
+    double *ws; // null unless weights are being collected
+    mem::arena *a;
+  };
+
+  // xs/ys (and ws, if non-null) point at row 0 of the file in the output
+  run_sink(const load_context &ctx, vec_t *xs, double *ys, double *ws)
+    : ctx_(&ctx), xs_(xs), ys_(ys), ws_(ws), a_(ctx.make_arena()),
+      stats_(ctx.make_stats())
+  {}
+
+  // the buffers to decode rows [row, row + nr) into
+  inline run
+  begin(size_t row, size_t nr)
+  {
+    if (!ctx_->sampler)
+      return run{xs_ + row, ys_ + row, ws_ ? ws_ + row : nullptr, a_};
+    scratch_x_.resize(nr);
+    scratch_y_.resize(nr);
+    scratch_w_.resize(nr);
+    return run{scratch_x_.data(), scratch_y_.data(),
+               ctx_->weights ? scratch_w_.data() : nullptr, nullptr};
+  }
+
+  // the run begun at row has been decoded. weighted says whether it had
+  // sample weights (otherwise its ws were left alone)
+  inline void
+  commit(size_t row, size_t nr, bool weighted)
+  {
+    if (!ctx_->real_labels) {
+      const double * const ys = ctx_->sampler ? scratch_y_.data() : ys_ + row;
+      for (size_t i = 0; i < nr; i++)
+        if (ys[i] != -1.0 && ys[i] != 1.0)
+          throw std::runtime_error("real-valued label in a classification file");
+    }
+    if (!ctx_->sampler) {
+      for (size_t i = 0; ctx_->stats && i < nr; i++)
+        stats_.add(xs_[row + i], ys_[row + i]);
+      return;
+    }
+    for (size_t i = 0; i < nr; i++) {
+      const double y = scratch_y_[i];
+      if (!ctx_->sampler->keep(row + i, y))
+        continue;
+      kept_x_.emplace_back(scratch_x_[i], a_);
+      kept_y_.push_back(y);
+      kept_w_.push_back(
+          (weighted ? scratch_w_[i] : 1.0) * ctx_->sampler->weight(y));
+      if (ctx_->stats)
+        stats_.add(kept_x_.back(), y);
+    }
+  }
+
+  /**
+   * Merges the stats of the sinks into ctx.stats and, with a sampler,
+   * replaces xs[off, end) (and ys) with the kept rows of every sink in
+   * turn, storing their weights in ctx.weights. Returns the number of
+   * rows loaded.
+   */
+  static size_t
+  finish(const load_context &ctx, std::vector<run_sink> &sinks,
+         std::vector<vec_t> &xs, standard_vec_t &ys, size_t off)
+  {
+    if (ctx.stats) {
+      std::vector<feature_stats> parts;
+      parts.reserve(sinks.size());
+      for (auto &s : sinks)
+        parts.push_back(std::move(s.stats_));
+      ctx.merge_stats(parts);
+    }
+    if (!ctx.sampler)
+      return xs.size() - off;
+    xs.resize(off);
+    ys.resize(off);
+    std::vector<double> ws;
+    for (auto &s : sinks) {
+      for (size_t i = 0; i < s.kept_x_.size(); i++) {
+        xs.push_back(std::move(s.kept_x_[i]));
+        ys.push_back(s.kept_y_[i]);
+      }
+      ws.insert(ws.end(), s.kept_w_.begin(), s.kept_w_.end());
+      s.kept_x_.clear();
+    }
+    if (ctx.weights)
+      ctx.set_weights(off, ws);
+    return xs.size() - off;
+  }
+
+private:
+  const load_context *ctx_;
+  vec_t *xs_;
+  double *ys_;
+  double *ws_;
+  mem::arena *a_;
+  feature_stats stats_;
+  std::vector<vec_t> scratch_x_;
+  std::vector<double> scratch_y_;
+  std::vector<double> scratch_w_;
+  std::vector<vec_t> kept_x_;
+  std::vector<double> kept_y_;
+  std::vector<double> kept_w_;
+};
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <cassert>
+#include <vector>
 #include <amd64.hh>
+#include <mem.hh>
 
 namespace impl {
   template <size_t Size> struct uint_sel {};
@@ -11,12 +13,16 @@ namespace impl {
 
 /**
  * Locking vector
+ *
+ * The elements can be backed by hugepages (see mem::page_mode) to cut TLB
+ * misses on randomly accessed weights; such a vector starts out unfaulted,
+ * and prefault() can be used to fault it in from several threads.
  */
 template <typename T>
 class standard_lvec {
 public:
-  standard_lvec(size_t n)
-    : impl_(n) {}
+  standard_lvec(size_t n, mem::page_mode mode = mem::page_mode::NONE)
+    : impl_(n, mem::page_allocator<T>(mode)) {}
 
   typedef typename impl::uint_sel<sizeof(T)>::type uint_type;
   static const uint_type LOCK_MASK = 0x1;
@@ -35,6 +41,16 @@ public:
     impl_[idx] = t;
   }
 
+  // the elements as a plain array, for bulk unlocked access
+  inline T * unsafedata() { return impl_.data(); }
+
+  // for an upcoming read and write of idx
+  inline void
+  prefetch(size_t idx) const
+  {
+    __builtin_prefetch(&impl_[idx], 1, 3);
+  }
+
   inline void
   lock(size_t idx)
   {
@@ -91,6 +107,24 @@ public:
 			v[i] = impl_[i];
 	}
 
+  inline void
+  prefault(size_t nthreads)
+  {
+    mem::prefault(impl_.data(), impl_.size() * sizeof(T), nthreads);
+  }
+
+  // the backing actually obtained, after any hugepage fallbacks
+  inline mem::page_mode
+  page_mode() const
+  {
+    if (impl_.get_allocator().get_mode() == mem::page_mode::NONE ||
+        impl_.empty())
+      return mem::page_mode::NONE;
+    return mem::mapped_page_mode(impl_.data());
+  }
+
+  inline size_t size() const { return impl_.size(); }
+
 private:
-  std::vector< T > impl_;
+  std::vector< T, mem::page_allocator<T> > impl_;
 };
@@ -0,0 +1,557 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <macros.hh>
+
+namespace mem {
+
+static const size_t HugePageSize = 1 << 21;
+
+// maps at least bytes of zeroed memory, 2MB aligned and advised for
+// transparent hugepages where the platform supports it. returns nullptr on
+// failure. *mapped is set to the size to pass to unmap_huge()
+static inline void *
+map_huge(size_t bytes, size_t *mapped)
+{
+  const size_t len = (bytes + HugePageSize - 1) & ~(HugePageSize - 1);
+  // over-map so the region can be trimmed to a hugepage boundary
+  const size_t maplen = len + HugePageSize;
+  void *p = mmap(nullptr, maplen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  const uintptr_t base = reinterpret_cast<uintptr_t>(p);
+  const uintptr_t aligned = (base + HugePageSize - 1) & ~(HugePageSize - 1);
+  if (aligned != base)
+    munmap(p, aligned - base);
+  const uintptr_t tail = aligned + len;
+  if (tail != base + maplen)
+    munmap(reinterpret_cast<void *>(tail), base + maplen - tail);
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void *>(aligned), len, MADV_HUGEPAGE);
+#endif
+  *mapped = len;
+  return reinterpret_cast<void *>(aligned);
+}
+
+static inline void
+unmap_huge(void *p, size_t mapped)
+{
+  munmap(p, mapped);
+}
+
+/**
+ * How large, long-lived buffers (e.g. the weights) are backed:
+ *   NONE:        the heap
+ *   THP:         anonymous memory advised for 2MB transparent hugepages
+ *   HUGETLB_2M:  explicit 2MB hugetlbfs pages (MAP_HUGETLB)
+ *   HUGETLB_1G:  explicit 1GB hugetlbfs pages
+ * hugetlbfs pages must be reserved by the administrator beforehand
+ * (vm.nr_hugepages); when they are not available the mapping falls back to
+ * the next smaller mode.
+ */
+enum class page_mode { NONE, THP, HUGETLB_2M, HUGETLB_1G };
+
+static inline const char *
+page_mode_str(page_mode m)
+{
+  switch (m) {
+  case page_mode::NONE: return "none";
+  case page_mode::THP: return "thp";
+  case page_mode::HUGETLB_2M: return "2m";
+  case page_mode::HUGETLB_1G: return "1g";
+  }
+  return nullptr;
+}
+
+static inline page_mode
+page_mode_from_str(const std::string &s)
+{
+  if (s == "none")
+    return page_mode::NONE;
+  if (s == "thp")
+    return page_mode::THP;
+  if (s == "2m")
+    return page_mode::HUGETLB_2M;
+  if (s == "1g")
+    return page_mode::HUGETLB_1G;
+  throw std::runtime_error("invalid page mode: " + s);
+}
+
+namespace detail {
+
+struct page_mapping {
+  size_t len;
+  page_mode mode;
+};
+
+// mapped length and actual mode of every live map_pages() region
+inline std::map<void *, page_mapping> &
+page_mappings(std::mutex *&mu)
+{
+  static std::mutex m;
+  static std::map<void *, page_mapping> mappings;
+  mu = &m;
+  return mappings;
+}
+
+static inline void *
+map_hugetlb(size_t bytes, unsigned shift, size_t *mapped)
+{
+#ifdef MAP_HUGETLB
+  const size_t page = size_t(1) << shift;
+  const size_t len = (bytes + page - 1) & ~(page - 1);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+  flags |= int(shift) << MAP_HUGE_SHIFT;
+#endif
+  void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  *mapped = len;
+  return p;
+#else
+  return nullptr;
+#endif
+}
+
+} // namespace detail
+
+// maps at least bytes of zeroed memory backed as requested by mode (which
+// must not be NONE). returns nullptr on failure; *actual is set to the mode
+// that was used after any fallbacks
+static inline void *
+map_pages(size_t bytes, page_mode mode, page_mode *actual)
+{
+  void *p = nullptr;
+  size_t len = 0;
+  switch (mode) {
+  case page_mode::HUGETLB_1G:
+    if ((p = detail::map_hugetlb(bytes, 30, &len)))
+      break;
+    mode = page_mode::HUGETLB_2M;
+    // fall-through
+  case page_mode::HUGETLB_2M:
+    if ((p = detail::map_hugetlb(bytes, 21, &len)))
+      break;
+    mode = page_mode::THP;
+    // fall-through
+  case page_mode::THP:
+  case page_mode::NONE:
+    mode = page_mode::THP;
+    p = map_huge(bytes, &len);
+    break;
+  }
+  if (!p)
+    return nullptr;
+  std::mutex *mu;
+  auto &mappings = detail::page_mappings(mu);
+  std::lock_guard<std::mutex> l(*mu);
+  mappings[p] = detail::page_mapping{len, mode};
+  *actual = mode;
+  return p;
+}
+
+static inline void
+unmap_pages(void *p)
+{
+  std::mutex *mu;
+  auto &mappings = detail::page_mappings(mu);
+  std::lock_guard<std::mutex> l(*mu);
+  auto it = mappings.find(p);
+  ALWAYS_ASSERT(it != mappings.end());
+  munmap(p, it->second.len);
+  mappings.erase(it);
+}
+
+// the mode actually backing p, which must come from map_pages()
+static inline page_mode
+mapped_page_mode(const void *p)
+{
+  std::mutex *mu;
+  auto &mappings = detail::page_mappings(mu);
+  std::lock_guard<std::mutex> l(*mu);
+  auto it = mappings.find(const_cast<void *>(p));
+  return it == mappings.end() ? page_mode::NONE : it->second.mode;
+}
+
+/**
+ * Touches every page of [p, p + bytes) from nthreads threads, so the page
+ * faults (and hugepage zeroing) are paid up front and in parallel rather
+ * than by whichever thread first touches a page. Contents are unchanged;
+ * nobody else may be writing to the range.
+ */
+static inline void
+prefault(void *p, size_t bytes, size_t nthreads)
+{
+  static const size_t PageSize = 4096;
+  const size_t npages = (bytes + PageSize - 1) / PageSize;
+  if (!npages)
+    return;
+  nthreads = std::max(size_t(1), std::min(nthreads, npages));
+  const size_t bsize = npages / nthreads;
+  char * const base = static_cast<char *>(p);
+  auto touch = [base, bytes](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      volatile char * const c = base + std::min(i * PageSize, bytes - 1);
+      *c = *c;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < nthreads; i++) {
+    const size_t end = ((i+1)==nthreads) ? npages : (bsize * (i+1));
+    workers.emplace_back(touch, bsize * i, end);
+  }
+  for (auto &w : workers)
+    w.join();
+}
+
+/**
+ * Bump allocator over large hugepage-backed chunks. Memory is only given
+ * back when the arena is destroyed, so it suits data that is built once
+ * and lives as long as its owner, like the rows of a dataset.
+ *
+ * Each loader thread is meant to have its own arena; allocate() takes an
+ * uncontended spinlock so that the occasional allocation from another
+ * thread (e.g. growing a row after load) is still safe.
+ */
+class arena {
+public:
+  static const size_t ChunkBytes = 4 * HugePageSize;
+
+  arena() : cur_(nullptr), end_(nullptr), reserved_(0), live_(0) {}
+
+  // bump-allocates from [begin, end), which the arena does not own, before
+  // falling back to chunks of its own
+  arena(char *begin, char *end)
+    : cur_(begin), end_(end), reserved_(0), live_(0) {}
+
+  ~arena()
+  {
+    for (auto &c : chunks_)
+      unmap_huge(c.first, c.second);
+  }
+
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  void *
+  allocate(size_t bytes, size_t align)
+  {
+    while (lock_.test_and_set(std::memory_order_acquire))
+      ;
+    void *ret;
+    uintptr_t p = align_up(reinterpret_cast<uintptr_t>(cur_), align);
+    const bool fits = cur_ && p + bytes <= reinterpret_cast<uintptr_t>(end_);
+    if (unlikely(!fits && bytes > ChunkBytes / 4)) {
+      // big requests get a mapping of their own rather than wasting the
+      // rest of the current chunk
+      ret = map(bytes);
+    } else {
+      if (unlikely(!fits)) {
+        cur_ = static_cast<char *>(map(ChunkBytes));
+        end_ = cur_ ? cur_ + ChunkBytes : nullptr;
+        p = reinterpret_cast<uintptr_t>(cur_);
+      }
+      ret = cur_ ? reinterpret_cast<void *>(p) : nullptr;
+      if (cur_)
+        cur_ = reinterpret_cast<char *>(p + bytes);
+    }
+    lock_.clear(std::memory_order_release);
+    if (unlikely(!ret))
+      throw std::bad_alloc();
+    live_.fetch_add(1, std::memory_order_relaxed);
+    return ret;
+  }
+
+  // an allocation is no longer in use; its space is not reused
+  inline void
+  release()
+  {
+    live_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // bytes mapped by this arena
+  inline size_t reserved() const { return reserved_; }
+
+  // allocations not yet release()d
+  inline size_t live() const { return live_.load(std::memory_order_relaxed); }
+
+private:
+  static inline uintptr_t
+  align_up(uintptr_t p, size_t align)
+  {
+    return (p + align - 1) & ~uintptr_t(align - 1);
+  }
+
+  void *
+  map(size_t bytes)
+  {
+    size_t mapped;
+    void *p = map_huge(bytes, &mapped);
+    if (!p)
+      return nullptr;
+    chunks_.emplace_back(p, mapped);
+    reserved_ += mapped;
+    return p;
+  }
+
+  char *cur_;
+  char *end_;
+  size_t reserved_;
+  std::atomic<size_t> live_;
+  std::vector<std::pair<void *, size_t>> chunks_;
+  std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+};
+
+/**
+ * A set of arenas, typically one per thread that took part in building
+ * some data; whoever holds the pool keeps that data alive. make() is
+ * thread-safe.
+ *
+ * Every row allocated from the pool must be destroyed before it: rows keep
+ * a bare arena pointer (see row_allocator), so a row that outlived its pool
+ * would point into unmapped memory. The destructor checks this, aborting
+ * rather than leaving such rows behind. Datasets hold a reference to the
+ * pool their rows came from (see dataset::vector_storage), and a loader's
+ * caller must keep load_context::arenas alive until its rows are in one.
+ */
+class arena_pool {
+public:
+  arena_pool() = default;
+
+  ~arena_pool()
+  {
+    for (auto &a : arenas_)
+      ALWAYS_ASSERT(!a->live());
+    arenas_.clear();
+    for (auto &b : blocks_)
+      unmap_huge(b.first, b.second);
+  }
+
+  arena_pool(const arena_pool &) = delete;
+  arena_pool &operator=(const arena_pool &) = delete;
+
+  arena *
+  make()
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    arenas_.emplace_back(new arena);
+    return arenas_.back().get();
+  }
+
+  // an arena that starts out in [begin, end), typically a slice of a
+  // map_block()
+  arena *
+  make(char *begin, char *end)
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    arenas_.emplace_back(new arena(begin, end));
+    return arenas_.back().get();
+  }
+
+  /**
+   * One hugepage-backed mapping of at least bytes, released with the pool.
+   * Handing consecutive slices of it to make(begin, end) lets several
+   * threads lay out rows that end up back to back in memory.
+   */
+  char *
+  map_block(size_t bytes)
+  {
+    size_t mapped;
+    void *p = map_huge(bytes, &mapped);
+    if (!p)
+      throw std::bad_alloc();
+    std::lock_guard<std::mutex> l(mu_);
+    blocks_.emplace_back(p, mapped);
+    return static_cast<char *>(p);
+  }
+
+  size_t
+  reserved() const
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    size_t ret = 0;
+    for (auto &a : arenas_)
+      ret += a->reserved();
+    for (auto &b : blocks_)
+      ret += b.second;
+    return ret;
+  }
+
+  size_t
+  size() const
+  {
+    std::lock_guard<std::mutex> l(mu_);
+    return arenas_.size();
+  }
+
+private:
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<arena>> arenas_;
+  std::vector<std::pair<void *, size_t>> blocks_;
+};
+
+/**
+ * Allocator for row payloads. A default constructed allocator uses the
+ * heap; one bound to an arena bump-allocates from it and never frees.
+ *
+ * Copy-constructing a container drops the arena (the copy may well outlive
+ * it), while moves and swaps carry it along with the buffer: loaders build
+ * each row in its arena and move-assign it into place. A moved row is then
+ * still bound by its arena_pool's lifetime, which the pool enforces.
+ *
+ * The arena pointer is allocator state inside every row, so vec_t is 40
+ * bytes rather than the 32 it would be with a stateless allocator.
+ */
+template <typename T>
+class row_allocator {
+  template <typename U> friend class row_allocator;
+public:
+  typedef T value_type;
+  typedef std::false_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  row_allocator() : a_(nullptr) {}
+  explicit row_allocator(arena *a) : a_(a) {}
+  template <typename U>
+  row_allocator(const row_allocator<U> &that) : a_(that.a_) {}
+
+  inline T *
+  allocate(size_t n)
+  {
+    if (a_)
+      return static_cast<T *>(a_->allocate(n * sizeof(T), alignof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  inline void
+  deallocate(T *p, size_t)
+  {
+    if (a_)
+      a_->release();
+    else
+      ::operator delete(p);
+  }
+
+  inline row_allocator
+  select_on_container_copy_construction() const
+  {
+    return row_allocator();
+  }
+
+  inline arena * get_arena() const { return a_; }
+
+  template <typename U>
+  inline bool
+  operator==(const row_allocator<U> &that) const
+  {
+    return a_ == that.a_;
+  }
+
+  template <typename U>
+  inline bool
+  operator!=(const row_allocator<U> &that) const
+  {
+    return a_ != that.a_;
+  }
+
+private:
+  arena *a_;
+};
+
+/**
+ * Allocator for large flat buffers of trivial values. With a mode other
+ * than NONE, each allocation gets its own map_pages() region. That memory is
+ * already zero, so default construction is skipped: a std::vector of n
+ * elements is then created without touching its pages, and they can be
+ * prefault()ed in parallel.
+ */
+template <typename T>
+class page_allocator {
+  template <typename U> friend class page_allocator;
+public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  page_allocator() : mode_(page_mode::NONE) {}
+  explicit page_allocator(page_mode mode) : mode_(mode) {}
+  template <typename U>
+  page_allocator(const page_allocator<U> &that) : mode_(that.mode_) {}
+
+  inline T *
+  allocate(size_t n)
+  {
+    if (mode_ == page_mode::NONE)
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    page_mode actual;
+    void *p = map_pages(n * sizeof(T), mode_, &actual);
+    if (!p)
+      throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+
+  inline void
+  deallocate(T *p, size_t)
+  {
+    if (mode_ == page_mode::NONE)
+      ::operator delete(p);
+    else
+      unmap_pages(p);
+  }
+
+  template <typename U>
+  inline void
+  construct(U *p)
+  {
+    static_assert(std::is_trivial<U>::value, "need trivial type");
+    if (mode_ == page_mode::NONE)
+      ::new (static_cast<void *>(p)) U();
+  }
+
+  template <typename U, typename... Args>
+  inline void
+  construct(U *p, Args &&... args)
+  {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+
+  inline page_mode get_mode() const { return mode_; }
+
+  template <typename U>
+  inline bool
+  operator==(const page_allocator<U> &that) const
+  {
+    return mode_ == that.mode_;
+  }
+
+  template <typename U>
+  inline bool
+  operator!=(const page_allocator<U> &that) const
+  {
+    return mode_ != that.mode_;
+  }
+
+private:
+  page_mode mode_;
+};
+
+} // namespace mem
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <vector>
+
 #include <macros.hh>
 #include <vec.hh>
+#include <util.hh>
 
 namespace metrics {
 
@@ -17,6 +24,285 @@ public:
         correct++;
     return double(correct) / double(actual.size());
   }
+
+  // the fraction of the total sample weight predicted correctly; the same
+  // as score(actual, predict) if weights is null
+  inline double
+  score(const standard_vec_t &actual, const standard_vec_t &predict,
+        const standard_vec_t *weights) const
+  {
+    if (!weights)
+      return score(actual, predict);
+    ALWAYS_ASSERT(actual.size() == predict.size());
+    ALWAYS_ASSERT(actual.size() == weights->size());
+    double correct = 0.0, total = 0.0;
+    for (size_t i = 0; i < actual.size(); i++) {
+      if (actual[i] == predict[i])
+        correct += (*weights)[i];
+      total += (*weights)[i];
+    }
+    return correct / total;
+  }
+};
+
+// root mean squared error of real-valued predictions
+class rmse {
+public:
+  inline double
+  score(const standard_vec_t &actual, const standard_vec_t &predict,
+        const standard_vec_t *weights = nullptr) const
+  {
+    ALWAYS_ASSERT(actual.size() == predict.size());
+    ALWAYS_ASSERT(!weights || actual.size() == weights->size());
+    double sum = 0.0, total = 0.0;
+    for (size_t i = 0; i < actual.size(); i++) {
+      const double w = weights ? (*weights)[i] : 1.0;
+      const double e = actual[i] - predict[i];
+      sum += w * e * e;
+      total += w;
+    }
+    return std::sqrt(sum / total);
+  }
+};
+
+// mean absolute error of real-valued predictions
+class mae {
+public:
+  inline double
+  score(const standard_vec_t &actual, const standard_vec_t &predict,
+        const standard_vec_t *weights = nullptr) const
+  {
+    ALWAYS_ASSERT(actual.size() == predict.size());
+    ALWAYS_ASSERT(!weights || actual.size() == weights->size());
+    double sum = 0.0, total = 0.0;
+    for (size_t i = 0; i < actual.size(); i++) {
+      const double w = weights ? (*weights)[i] : 1.0;
+      sum += w * std::fabs(actual[i] - predict[i]);
+      total += w;
+    }
+    return sum / total;
+  }
 };
 
+/**
+ * Ranking and probability metrics of a binary classifier, computed from
+ * its margins, the -1/1 labels and optionally per-row sample weights:
+ * ROC-AUC, PR-AUC (average precision), log-loss, calibration and the
+ * precision/recall of the k rows with the largest margins.
+ *
+ * Log-loss and calibration read sigmoid(margin) as P(y = 1), i.e. they
+ * assume the margins of a logistic model.
+ *
+ * One parallel pass over contiguous chunks of the rows accumulates the
+ * pointwise metrics and sorts each chunk by decreasing margin; the chunks
+ * are then merged pairwise in parallel and the ranking metrics come out of
+ * a single sweep of the merged order. Rows with equal margins form a
+ * single threshold, and when such a group straddles the k-th row it counts
+ * pro rata, so the ranking metrics depend neither on the order of ties nor
+ * on the number of threads.
+ *
+ * Rows whose margin is NaN or infinite (e.g. from a diverged model) are
+ * left out of every metric and only counted, see nonfinite().
+ */
+class binary_report {
+public:
+  static const size_t CalibrationBins = 10;
+
+  binary_report(const standard_vec_t &actual, const standard_vec_t &margins,
+                const standard_vec_t *weights = nullptr, size_t k = 0)
+    : k_(k), nonfinite_(0),
+      roc_auc_(0.0), pr_auc_(0.0), log_loss_(0.0),
+      mean_prediction_(0.0), positive_rate_(0.0), calibration_error_(0.0),
+      precision_at_k_(0.0), recall_at_k_(0.0)
+  {
+    ALWAYS_ASSERT(actual.size() == margins.size());
+    ALWAYS_ASSERT(!weights || actual.size() == weights->size());
+    const size_t n = actual.size();
+    const size_t nchunks = std::max(size_t(1), std::min(
+          size_t(util::ncpus_online()), n / MinRowsPerThread));
+
+    std::vector<entry> entries(n);
+    std::vector<size_t> bounds(nchunks + 1);
+    for (size_t i = 0; i <= nchunks; i++)
+      bounds[i] = n * i / nchunks;
+    std::vector<sums> partial(nchunks);
+    util::parallel_run(nchunks, [&](size_t c) {
+      sums &s = partial[c];
+      for (size_t i = bounds[c]; i < bounds[c + 1]; i++) {
+        const double w = weights ? (*weights)[i] : 1.0;
+        const double m = margins[i];
+        const bool pos = actual[i] > 0.0;
+        // ranked last with no weight, so they sort (NaNs would break the
+        // ordering) without counting anywhere
+        if (!util::finite_bits(m)) {
+          s.nonfinite++;
+          entries[i] = entry{std::numeric_limits<double>::lowest(), 0.0, 0.0};
+          continue;
+        }
+        const double p = 1.0 / (1.0 + std::exp(-m));
+        // log(1 + exp(-y m)) without overflowing
+        const double ym = pos ? m : -m;
+        s.loss += w * (std::max(-ym, 0.0) + std::log1p(std::exp(-std::fabs(ym))));
+        s.total += w;
+        s.pos += pos ? w : 0.0;
+        s.prob += w * p;
+        const size_t b =
+          std::min(size_t(p * CalibrationBins), CalibrationBins - 1);
+        s.bin_pos[b] += pos ? w : 0.0;
+        s.bin_prob[b] += w * p;
+        entries[i] = entry{m, pos ? w : 0.0, pos ? 0.0 : w};
+      }
+      std::sort(entries.begin() + bounds[c], entries.begin() + bounds[c + 1]);
+    });
+    for (size_t width = 1; width < nchunks; width *= 2) {
+      const size_t npairs = (nchunks + 2 * width - 1) / (2 * width);
+      util::parallel_run(npairs, [&](size_t j) {
+        const size_t lo = 2 * width * j;
+        const size_t mid = std::min(lo + width, nchunks);
+        const size_t hi = std::min(lo + 2 * width, nchunks);
+        std::inplace_merge(entries.begin() + bounds[lo],
+                           entries.begin() + bounds[mid],
+                           entries.begin() + bounds[hi]);
+      });
+    }
+
+    sums s;
+    for (const auto &p : partial)
+      s.merge(p);
+    nonfinite_ = s.nonfinite;
+    k_ = std::min(k_, n - nonfinite_);
+    const double npos = s.pos, nneg = s.total - s.pos;
+    log_loss_ = s.loss / s.total;
+    mean_prediction_ = s.prob / s.total;
+    positive_rate_ = npos / s.total;
+    for (size_t b = 0; b < CalibrationBins; b++)
+      calibration_error_ +=
+        std::fabs(s.bin_prob[b] - s.bin_pos[b]) / s.total;
+
+    // tp and fp are the weights of the rows ranked above the current group
+    double tp = 0.0, fp = 0.0, topk_pos = 0.0, topk_total = 0.0;
+    size_t rank = 0;
+    for (size_t i = 0; i < n; ) {
+      double gpos = 0.0, gneg = 0.0;
+      size_t j = i;
+      for (; j < n && entries[j].margin == entries[i].margin; j++) {
+        gpos += entries[j].pos;
+        gneg += entries[j].neg;
+      }
+      roc_auc_ += gneg * (tp + 0.5 * gpos);
+      if (gpos > 0.0)
+        pr_auc_ += gpos * (tp + gpos) / (tp + gpos + fp + gneg);
+      if (rank < k_) {
+        const double f = std::min(1.0, double(k_ - rank) / double(j - i));
+        topk_pos += f * gpos;
+        topk_total += f * (gpos + gneg);
+      }
+      tp += gpos;
+      fp += gneg;
+      rank += j - i;
+      i = j;
+    }
+    roc_auc_ /= npos * nneg;
+    pr_auc_ /= npos;
+    precision_at_k_ = topk_pos / topk_total;
+    recall_at_k_ = topk_pos / npos;
+  }
+
+  inline double roc_auc() const { return roc_auc_; }
+  inline double pr_auc() const { return pr_auc_; }
+  inline double log_loss() const { return log_loss_; }
+
+  // the average predicted probability and the actual rate of positives
+  inline double mean_prediction() const { return mean_prediction_; }
+  inline double positive_rate() const { return positive_rate_; }
+
+  // the expected calibration error: the weighted mean, over
+  // CalibrationBins equal-width bins of the predicted probability, of the
+  // gap between the predictions and the positive rate of each bin
+  inline double calibration_error() const { return calibration_error_; }
+
+  inline size_t get_k() const { return k_; }
+  // the number of rows left out for a NaN or infinite margin
+  inline size_t nonfinite() const { return nonfinite_; }
+  inline double precision_at_k() const { return precision_at_k_; }
+  inline double recall_at_k() const { return recall_at_k_; }
+
+private:
+  static const size_t MinRowsPerThread = 1 << 16;
+
+  // a row as ranked; pos (neg) is its weight if it is a positive (negative)
+  struct entry {
+    double margin;
+    double pos;
+    double neg;
+
+    // decreasing margins; equal ones are ordered by value so the merged
+    // order, and the sums over it, are the same for any number of chunks
+    inline bool
+    operator<(const entry &o) const
+    {
+      if (margin != o.margin)
+        return margin > o.margin;
+      if (pos != o.pos)
+        return pos < o.pos;
+      return neg < o.neg;
+    }
+  };
+
+  struct sums {
+    sums()
+      : loss(0.0), total(0.0), pos(0.0), prob(0.0), nonfinite(0),
+        bin_pos(CalibrationBins, 0.0),
+        bin_prob(CalibrationBins, 0.0)
+    {}
+
+    void
+    merge(const sums &o)
+    {
+      loss += o.loss;
+      total += o.total;
+      pos += o.pos;
+      prob += o.prob;
+      nonfinite += o.nonfinite;
+      for (size_t b = 0; b < CalibrationBins; b++) {
+        bin_pos[b] += o.bin_pos[b];
+        bin_prob[b] += o.bin_prob[b];
+      }
+    }
+
+    double loss;
+    double total;
+    double pos;
+    double prob;
+    size_t nonfinite;
+    std::vector<double> bin_pos;
+    std::vector<double> bin_prob;
+  };
+
+  size_t k_;
+  size_t nonfinite_;
+  double roc_auc_;
+  double pr_auc_;
+  double log_loss_;
+  double mean_prediction_;
+  double positive_rate_;
+  double calibration_error_;
+  double precision_at_k_;
+  double recall_at_k_;
+};
+
+inline std::ostream &
+operator<<(std::ostream &o, const binary_report &r)
+{
+  o << "{roc_auc=" << r.roc_auc() << ", pr_auc=" << r.pr_auc()
+    << ", log_loss=" << r.log_loss()
+    << ", mean_prediction=" << r.mean_prediction()
+    << ", positive_rate=" << r.positive_rate()
+    << ", calibration_error=" << r.calibration_error()
+    << ", precision@" << r.get_k() << "=" << r.precision_at_k()
+    << ", recall@" << r.get_k() << "=" << r.recall_at_k()
+    << ", nonfinite=" << r.nonfinite() << "}";
+  return o;
+}
+
 } // namespace metrics
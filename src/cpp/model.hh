@@ -4,7 +4,14 @@
 #include <vec.hh>
 #include <loss_functions.hh>
 #include <dataset.hh>
-
+#include <dense.hh>
+#include <feature_maps.hh>
+#include <philox.hh>
+#include <util.hh>
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
 #include <thread>
 #include <limits>
 #include <tbb/concurrent_queue.h>
@@ -24,36 +31,82 @@ linear_Ax(ForwardIterator begin, ForwardIterator end, const standard_vec_t &x)
   return b;
 }
 
-template <typename LossFunc>
+// dot products of w with the rows of a dense block (see dataset::dense());
+// coordinates past the end of w count as zeros, as in ops::dot
+static inline double
+dense_row_dot(const dense::block &b, size_t i, const standard_vec_t &w)
+{
+  return dense::dot(b.row(i), w.data().data(), std::min(b.cols_, w.size()));
+}
+
+static inline standard_vec_t
+linear_Ax(const dataset &d, const standard_vec_t &x)
+{
+  const dense::block *b = d.dense();
+  if (!b)
+    return linear_Ax(d.x_begin(), d.x_end(), x);
+  standard_vec_t ret(b->rows_);
+  for (size_t i = 0; i < b->rows_; i++)
+    ret[i] = dense_row_dot(*b, i, x);
+  return ret;
+}
+
+// <w, features of x> for every row of d, under a feature map
+template <typename FeatureMap>
+static inline standard_vec_t
+linear_Ax(const dataset &d, const standard_vec_t &w, const FeatureMap &fmap)
+{
+  if (FeatureMap::is_identity)
+    return linear_Ax(d, w);
+  const size_t n = d.get_x_shape().first;
+  standard_vec_t ret(n);
+  for (size_t i = 0; i < n; i++)
+    ret[i] = fmap.dot(w, d.get_x(i));
+  return ret;
+}
+
+/**
+ * A linear model over the features FeatureMap generates from each row
+ * (see feature_maps.hh); by default, the row itself.
+ */
+template <typename LossFunc,
+          typename FeatureMap = feature_maps::identity_map>
 class linear_model {
 public:
 
   typedef LossFunc loss_function_type;
+  typedef FeatureMap feature_map_type;
   static constexpr const double norm_bound_const = 1.0;
 
   linear_model(double lambda,
-               LossFunc lossfn = LossFunc())
+               LossFunc lossfn = LossFunc(),
+               FeatureMap fmap = FeatureMap())
     : lambda_(lambda),
       w_(),
       lossfn_(lossfn),
+      fmap_(fmap),
       nthreads_(4)
   {}
 
   linear_model(double lambda,
                const standard_vec_t &w,
-               LossFunc lossfn = LossFunc())
+               LossFunc lossfn = LossFunc(),
+               FeatureMap fmap = FeatureMap())
     : lambda_(lambda),
       w_(w),
       lossfn_(lossfn),
+      fmap_(fmap),
       nthreads_(4)
   { }
 
   linear_model(double lambda,
                standard_vec_t &&w,
-               LossFunc lossfn = LossFunc())
+               LossFunc lossfn = LossFunc(),
+               FeatureMap fmap = FeatureMap())
     : lambda_(lambda),
       w_(std::move(w)),
       lossfn_(lossfn),
+      fmap_(fmap),
       nthreads_(4)
   { }
 
@@ -63,6 +116,7 @@ public:
   }
 
   linear_model(const linear_model &that)
+    : fmap_(that.fmap_)
   {
     shutdown_pool();
     lambda_ = that.lambda_;
@@ -91,6 +145,16 @@ private:
     size_t end_;
   };
 
+  // 1 / the weight of rows [start, end), or 0 if they weigh nothing (an
+  // empty range, or only zero-weight rows), in which case their losses
+  // also sum to 0
+  static inline double
+  inv_weight_sum(const dataset &d, size_t start, size_t end)
+  {
+    const double n = d.weight_sum(start, end);
+    return n > 0.0 ? 1.0 / n : 0.0;
+  }
+
 public:
 
   inline double
@@ -114,23 +178,21 @@ public:
       q.pop(s);
       accum += s;
     }
-    accum /= double(n);
+    accum *= inv_weight_sum(d, 0, n);
     accum += lambda_ / 2.0 * ops::dot(w, w);
     return accum;
   }
 
   /**
-   * Evaluates the objective function on d, F(D)
+   * Evaluates the objective function on d, F(D). With sample weights the
+   * loss term is the weighted average of the row losses
    */
   inline double
   empirical_risk(const standard_vec_t &w, const dataset &d, size_t start, size_t end) const
   {
-    const size_t n = end - start;
-    double sum_loss = 0.0;
-    const auto it_end = d.begin() + end;
-    for (auto it = d.begin() + start; it != it_end; ++it)
-      sum_loss += lossfn_.loss(*it.second(), ops::dot(w, *it.first()));
-    return 1.0 / double(n) * sum_loss + lambda_ / 2.0 * ops::dot(w, w);
+    const double sum_loss = task(w, d, start, end);
+    return inv_weight_sum(d, start, end) * sum_loss +
+      lambda_ / 2.0 * ops::dot(w, w);
   }
 
   inline double
@@ -153,41 +215,19 @@ public:
       size_t start,
       size_t end) const
   {
-    const size_t n = end - start;
     grad.resize(w.size());
     grad.zero();
-    const auto it_end = d.begin() + end;
-    for (auto it = d.begin() + start; it != it_end; ++it) {
-      const auto &x = *it.first();
-      const double dloss = lossfn_.dloss(*it.second(), ops::dot(w, x));
-      const auto inner_it_end = x.end();
-      for (auto inner_it = x.begin();
-           inner_it != inner_it_end; ++inner_it) {
-        const size_t feature_idx = inner_it.tell();
-        grad[feature_idx] += (*inner_it) * dloss;
-      }
-    }
-    grad *= (1.0 / double(n));
+    accum_dloss_x(grad, w, d, start, end);
+    grad *= inv_weight_sum(d, start, end);
     grad.add(lambda_, w);
   }
 
   inline standard_vec_t
   grad_empirical_risk(const standard_vec_t &w, const dataset &d, size_t start, size_t end) const
   {
-    const size_t n = end - start;
     standard_vec_t term1(w.size());
-    const auto it_end = d.begin() + end;
-    for (auto it = d.begin() + start; it != it_end; ++it) {
-      const auto &x = *it.first();
-      const double dloss = lossfn_.dloss(*it.second(), ops::dot(w, x));
-      const auto inner_it_end = x.end();
-      for (auto inner_it = x.begin();
-           inner_it != inner_it_end; ++inner_it) {
-        const size_t feature_idx = inner_it.tell();
-        term1[feature_idx] += (*inner_it) * dloss;
-      }
-    }
-    return 1.0 / double(n) * term1 + lambda_ * w;
+    accum_dloss_x(term1, w, d, start, end);
+    return inv_weight_sum(d, start, end) * term1 + lambda_ * w;
   }
 
   inline standard_vec_t
@@ -220,27 +260,42 @@ public:
     return d;
   }
 
+  // the risk of a dataset already mapped by transform()
+  inline double
+  transformed_empirical_risk(const dataset &transformed) const
+  {
+    return empirical_risk(transformed);
+  }
+
   inline standard_vec_t
   predict(const dataset &d) const
   {
-    return linear_Ax(d.x_begin(), d.x_end(), w_).sign();
+    return predict_margin(d).sign();
+  }
+
+  // the raw margins <w, x>, i.e. the predictions of a regression model
+  inline standard_vec_t
+  predict_margin(const dataset &d) const
+  {
+    return linear_Ax(d, w_, fmap_);
   }
 
   inline double get_lambda() const { return lambda_; }
   inline standard_vec_t &weightvec() { return w_; }
   inline const standard_vec_t & weightvec() const { return w_; }
   inline const LossFunc & get_lossfn() const { return lossfn_; }
+  inline const FeatureMap & get_features() const { return fmap_; }
 
-  inline linear_model<LossFunc>
+  inline linear_model<LossFunc, FeatureMap>
   buildfrom(const standard_vec_t &w) const
   {
-    return linear_model<LossFunc>(lambda_, w, lossfn_);
+    return linear_model<LossFunc, FeatureMap>(lambda_, w, lossfn_, fmap_);
   }
 
-  inline linear_model<LossFunc>
+  inline linear_model<LossFunc, FeatureMap>
   buildfrom(standard_vec_t &&w) const
   {
-    return linear_model<LossFunc>(lambda_, std::move(w), lossfn_);
+    return linear_model<LossFunc, FeatureMap>(lambda_, std::move(w), lossfn_, fmap_);
   }
 
   inline std::map<std::string, std::string>
@@ -249,24 +304,99 @@ public:
     std::map<std::string, std::string> m;
     m["model_type"]   = "linear";
     m["model_lambda"] = std::to_string(lambda_);
+    fmap_.mapconfig(m);
     return m;
   }
 
 protected:
 
+  // sum of the (weighted) losses over [start, end)
   inline double
   task(const standard_vec_t &w,
        const dataset &d,
        size_t start,
        size_t end) const
+  {
+    const standard_vec_t *sw = d.get_weights();
+    return sw ? task<true>(w, d, start, end, sw->data().data()) :
+                task<false>(w, d, start, end, nullptr);
+  }
+
+  template <bool Weighted>
+  inline double
+  task(const standard_vec_t &w,
+       const dataset &d,
+       size_t start,
+       size_t end,
+       const double *sw) const
   {
     double sum_loss = 0.0;
+    if (const dense::block *b = FeatureMap::is_identity ? d.dense() : nullptr) {
+      const standard_vec_t &y = d.get_y();
+      for (size_t i = start; i < end; i++) {
+        const double loss = lossfn_.loss(y[i], dense_row_dot(*b, i, w));
+        sum_loss += Weighted ? sw[i] * loss : loss;
+      }
+      return sum_loss;
+    }
     const auto it_end = d.begin() + end;
-    for (auto it = d.begin() + start; it != it_end; ++it)
-      sum_loss += lossfn_.loss(*it.second(), ops::dot(w, *it.first()));
+    size_t i = start;
+    for (auto it = d.begin() + start; it != it_end; ++it, ++i) {
+      const double loss = lossfn_.loss(*it.second(), fmap_.dot(w, *it.first()));
+      sum_loss += Weighted ? sw[i] * loss : loss;
+    }
     return sum_loss;
   }
 
+  // acc += sum of w_i dloss(y_i, <w, x_i>) x_i over [start, end), where w_i
+  // is the sample weight of row i
+  inline void
+  accum_dloss_x(standard_vec_t &acc,
+                const standard_vec_t &w,
+                const dataset &d,
+                size_t start,
+                size_t end) const
+  {
+    const standard_vec_t *sw = d.get_weights();
+    if (sw)
+      accum_dloss_x<true>(acc, w, d, start, end, sw->data().data());
+    else
+      accum_dloss_x<false>(acc, w, d, start, end, nullptr);
+  }
+
+  template <bool Weighted>
+  inline void
+  accum_dloss_x(standard_vec_t &acc,
+                const standard_vec_t &w,
+                const dataset &d,
+                size_t start,
+                size_t end,
+                const double *sw) const
+  {
+    if (const dense::block *b = FeatureMap::is_identity ? d.dense() : nullptr) {
+      const standard_vec_t &y = d.get_y();
+      const size_t cols = std::min(b->cols_, acc.size());
+      for (size_t i = start; i < end; i++) {
+        double dloss = lossfn_.dloss(y[i], dense_row_dot(*b, i, w));
+        if (Weighted)
+          dloss *= sw[i];
+        dense::axpy(dloss, b->row(i), acc.data().data(), cols);
+      }
+      return;
+    }
+    const auto it_end = d.begin() + end;
+    size_t i = start;
+    for (auto it = d.begin() + start; it != it_end; ++it, ++i) {
+      const auto &x = *it.first();
+      double dloss = lossfn_.dloss(*it.second(), fmap_.dot(w, x));
+      if (Weighted)
+        dloss *= sw[i];
+      fmap_.for_each(x, [&acc, dloss](size_t feature_idx, double value) {
+        acc[feature_idx] += value * dloss;
+      });
+    }
+  }
+
   inline void
   worker(tbb::concurrent_bounded_queue<message *> &inq,
          tbb::concurrent_bounded_queue<double> &outq) const
@@ -310,6 +440,7 @@ protected:
   double lambda_;
   standard_vec_t w_;
   LossFunc lossfn_;
+  FeatureMap fmap_;
 
   // state for parallel evaluation
   size_t nthreads_;
@@ -333,6 +464,7 @@ public:
 
   static_assert(Kernel::is_translation_invariant, "xx");
   typedef LossFunc loss_function_type;
+  typedef feature_maps::identity_map feature_map_type;
   static constexpr const double norm_bound_const = sqrt(2.0);
 
   kernelized_linear_model(
@@ -361,19 +493,34 @@ public:
       kernel_(kernel)
   { }
 
+  // draws kdim (fourier sample, phase) pairs in parallel: prng only picks
+  // a key, and sample i comes from philox stream i of it, so the samples
+  // don't depend on the number of threads. each sample goes straight into
+  // its column of the projection; only one per thread is alive at a time
   template <typename Generator>
   inline void
   initialize(Generator &prng, size_t xdim, size_t kdim)
   {
     assert(xdim);
     assert(kdim);
-    fourier_samples_.resize(kdim);
-    for (size_t i = 0; i < kdim; i++)
-      fourier_samples_[i] = kernel_.sample_fourier(xdim, prng);
-    std::uniform_real_distribution<double> unif(0.0, 2.0 * M_PI);
+    const uint64_t key = std::uniform_int_distribution<uint64_t>()(prng);
     b_samples_.resize(kdim);
-    for (size_t i = 0; i < kdim; i++)
-      b_samples_[i] = unif(prng);
+    std::shared_ptr<std::vector<double>> proj =
+      std::make_shared<std::vector<double>>(xdim * kdim);
+    const size_t nthreads = std::max(size_t(1),
+        std::min(size_t(util::ncpus_online()), kdim / 64));
+    util::parallel_run(nthreads, [&](size_t t) {
+      for (size_t i = kdim * t / nthreads; i < kdim * (t + 1) / nthreads; i++) {
+        philox g(key, i);
+        const standard_vec_t sample = kernel_.sample_fourier(xdim, g);
+        for (size_t j = 0; j < xdim; j++)
+          (*proj)[j * kdim + i] = sample[j];
+        std::uniform_real_distribution<double> unif(0.0, 2.0 * M_PI);
+        b_samples_[i] = unif(g);
+      }
+    });
+    xdim_ = xdim;
+    proj_ = proj;
   }
 
   inline void
@@ -381,7 +528,7 @@ public:
             const std::vector<double> &b_samples)
   {
     assert(fourier_samples.size() == b_samples.size());
-    fourier_samples_ = fourier_samples;
+    build_projection(fourier_samples);
     b_samples_ = b_samples;
   }
 
@@ -390,7 +537,8 @@ public:
             std::vector<double> &&b_samples)
   {
     assert(fourier_samples.size() == b_samples.size());
-    fourier_samples_ = std::move(fourier_samples);
+    build_projection(fourier_samples);
+    std::vector<standard_vec_t>().swap(fourier_samples);
     b_samples_ = std::move(b_samples);
   }
 
@@ -405,7 +553,7 @@ public:
       return impl_->transform(x);
     }
 
-    inline size_t postdim() const { return impl_->fourier_samples_.size(); }
+    inline size_t postdim() const { return impl_->b_samples_.size(); }
 
   private:
     const kernelized_linear_model *impl_;
@@ -417,18 +565,38 @@ public:
     return transformer(this);
   }
 
+  // z = b + sum_j x_j * proj_[j], one vector kernel per nonzero of x,
+  // then phi(x) = sqrt(2/k) cos(z); features beyond the sampled
+  // dimension are ignored
   inline vec_t
   transform(const vec_t &x) const
   {
+    assert(proj_);
+    const size_t k = b_samples_.size();
     vec_t ret;
     standard_vec_t &sret = ret.as_standard_ref();
-    sret.resize(fourier_samples_.size());
-    for (size_t i = 0; i < fourier_samples_.size(); i++)
-      sret[i] = cos(ops::dot(fourier_samples_[i], x) + b_samples_[i]);
-    sret *= sqrt(2.0/double(fourier_samples_.size()));
+    sret.resize(k);
+    double * const z = sret.data().data();
+    std::copy(b_samples_.begin(), b_samples_.end(), z);
+    const double * const proj = proj_->data();
+    const size_t xdim = xdim_;
+    x.for_each_nonzero([z, proj, k, xdim](size_t j, double v) {
+      if (j < xdim)
+        dense::axpy(v, proj + j * k, z, k);
+    });
+    const double scale = sqrt(2.0/double(k));
+    for (size_t i = 0; i < k; i++)
+      z[i] = scale * cos(z[i]);
     return ret;
   }
 
+  // the risk of a dataset already mapped by transform()
+  inline double
+  transformed_empirical_risk(const dataset &transformed) const
+  {
+    return underlying_.empirical_risk(transformed);
+  }
+
   inline double
   empirical_risk(const dataset &d) const
   {
@@ -455,11 +623,17 @@ public:
 
   inline standard_vec_t
   predict(const dataset &d) const
+  {
+    return predict_margin(d).sign();
+  }
+
+  inline standard_vec_t
+  predict_margin(const dataset &d) const
   {
     dataset transformed(d, get_transformer());
     if (transformed.get_parallel_materialize())
       transformed.materialize();
-    return underlying_.predict(transformed);
+    return underlying_.predict_margin(transformed);
   }
 
   inline dataset
@@ -473,22 +647,24 @@ public:
   inline const standard_vec_t & weightvec() const { return underlying_.weightvec(); }
   inline const LossFunc & get_lossfn() const { return underlying_.get_lossfn(); }
   inline const Kernel & get_kernel() const { return kernel_; }
+  // transformed rows are used as they are
+  inline const feature_maps::identity_map &
+  get_features() const { return underlying_.get_features(); }
 
+  // copies share the samples' projection
   inline kernelized_linear_model<LossFunc, Kernel>
   buildfrom(const standard_vec_t &w) const
   {
-    kernelized_linear_model<LossFunc, Kernel> ret(
-        underlying_.get_lambda(), w, underlying_.get_lossfn(), kernel_);
-    ret.bootstrap(fourier_samples_, b_samples_);
+    kernelized_linear_model<LossFunc, Kernel> ret(*this);
+    ret.weightvec() = w;
     return ret;
   }
 
   inline kernelized_linear_model<LossFunc, Kernel>
   buildfrom(standard_vec_t &&w) const
   {
-    kernelized_linear_model<LossFunc, Kernel> ret(
-        underlying_.get_lambda(), std::move(w), underlying_.get_lossfn(), kernel_);
-    ret.bootstrap(fourier_samples_, b_samples_);
+    kernelized_linear_model<LossFunc, Kernel> ret(*this);
+    ret.weightvec() = std::move(w);
     return ret;
   }
 
@@ -497,17 +673,352 @@ public:
   {
     std::map<std::string, std::string> m = underlying_.mapconfig();
     m["model_type"] = "kernelized_linear";
+    m["model_kernel"] = Kernel::name();
+    m["model_kernel_sigma"] = std::to_string(kernel_.get_sigma());
+    m["model_kernel_dim"] = std::to_string(b_samples_.size());
     return m;
   }
 
 private:
+  // lays the samples out feature-major, proj_[j * k + i] being
+  // fourier_samples[i][j], so transform() runs down contiguous rows
+  void
+  build_projection(const std::vector<standard_vec_t> &fourier_samples)
+  {
+    const size_t k = fourier_samples.size();
+    xdim_ = k ? fourier_samples[0].size() : 0;
+    std::shared_ptr<std::vector<double>> proj =
+      std::make_shared<std::vector<double>>(xdim_ * k);
+    const size_t xdim = xdim_;
+    const size_t nthreads = std::max(size_t(1),
+        std::min(size_t(util::ncpus_online()), xdim / 64));
+    util::parallel_run(nthreads, [&](size_t t) {
+      for (size_t j = t; j < xdim; j += nthreads)
+        for (size_t i = 0; i < k; i++)
+          (*proj)[j * k + i] = fourier_samples[i][j];
+    });
+    proj_ = proj;
+  }
+
   linear_model<LossFunc> underlying_;
   Kernel kernel_;
 
   // the randomized basis vectors are
-  // phi_i(x) = cos(<fourier_samples_[i],x> + b_samples_[i])
-  std::vector<standard_vec_t> fourier_samples_; // number of reduced directions
-  std::vector<double> b_samples_; // same size as fourier_samples_
+  // phi_i(x) = cos(<w_i, x> + b_samples_[i]), w_i being column i of proj_;
+  // only the projection is kept, and copies share it
+  std::vector<double> b_samples_; // number of reduced directions
+  size_t xdim_ = 0;
+  std::shared_ptr<const std::vector<double>> proj_; // xdim_ x k
+};
+
+/**
+ * Nystrom approximation of a kernel that need not be translation
+ * invariant, following
+ *   Christopher Williams and Matthias Seeger.
+ *   Using the Nystrom Method to Speed Up Kernel Machines. NIPS 2001.
+ *
+ * m landmark rows l_1..l_m are sampled from the training data, and a row
+ * maps to phi(x) = L^{-1} k(x), with k(x)_i = k(x, l_i) and L L^T the
+ * landmark kernel matrix, so that <phi(x), phi(y)> = k(x)^T K^{-1} k(y).
+ * (K^{-1/2} gives the same inner products; L^{-1} only differs from it by
+ * a rotation, which neither the regularizer nor SGD can tell apart.)
+ *
+ * Kernel must provide from_products(<x, y>, ||x||^2, ||y||^2).
+ */
+template <typename LossFunc, typename Kernel>
+class nystrom_linear_model {
+public:
+
+  typedef LossFunc loss_function_type;
+  typedef feature_maps::identity_map feature_map_type;
+  // ||phi(x)||^2 <= k(x, x), which depends on the kernel and the data
+  static constexpr const double norm_bound_const = 1.0;
+
+  nystrom_linear_model(
+      double lambda,
+      LossFunc lossfn = LossFunc(),
+      Kernel kernel = Kernel())
+    : underlying_(lambda, lossfn),
+      kernel_(kernel)
+  { }
+
+  /**
+   * Samples m distinct landmark rows of d (prng only picks a key, as in
+   * kernelized_linear_model::initialize), then factors their kernel
+   * matrix, adding jitter to its diagonal until it is positive definite.
+   */
+  template <typename Generator>
+  inline void
+  initialize(Generator &prng, const dataset &d, size_t m)
+  {
+    const size_t n = d.get_x_shape().first;
+    if (!n)
+      throw std::runtime_error("no rows to sample landmarks from");
+    m = std::min(m, n);
+    const uint64_t key = std::uniform_int_distribution<uint64_t>()(prng);
+    const size_t ncpus = util::ncpus_online();
+    std::vector<size_t> rows = random_permutation(n, key, ncpus);
+    rows.resize(m);
+    std::sort(rows.begin(), rows.end());
+
+    // the landmarks, inverted: for each feature some landmark has, the
+    // landmarks that have it. each thread gathers the nonzeros of a share
+    // of the landmarks, and the union is sorted by feature
+    const size_t nthreads = std::max(size_t(1), std::min(size_t(ncpus), m / 16));
+    typedef std::tuple<size_t, uint32_t, double> posting; // feature, landmark, value
+    std::vector<std::vector<posting>> parts(nthreads);
+    std::shared_ptr<landmark_index> index = std::make_shared<landmark_index>();
+    index->norms.resize(m);
+    util::parallel_run(nthreads, [&](size_t t) {
+      for (size_t i = m * t / nthreads; i < m * (t + 1) / nthreads; i++) {
+        double nn = 0.0;
+        d.get_x(rows[i]).for_each_nonzero([&](size_t j, double v) {
+          parts[t].emplace_back(j, uint32_t(i), v);
+          nn += v * v;
+        });
+        index->norms[i] = nn;
+      }
+    });
+    std::vector<posting> all;
+    for (auto &part : parts) {
+      all.insert(all.end(), part.begin(), part.end());
+      std::vector<posting>().swap(part);
+    }
+    std::sort(all.begin(), all.end());
+    index->landmark.reserve(all.size());
+    index->value.reserve(all.size());
+    for (const posting &e : all) {
+      if (index->features.empty() || index->features.back() != std::get<0>(e)) {
+        index->features.push_back(std::get<0>(e));
+        index->begin.push_back(index->landmark.size());
+      }
+      index->landmark.push_back(std::get<1>(e));
+      index->value.push_back(std::get<2>(e));
+    }
+    index->begin.push_back(index->landmark.size());
+    m_ = m;
+    landmarks_ = index;
+
+    // the landmark kernel matrix, a row of it per landmark
+    std::vector<double> K(m * m);
+    util::parallel_run(nthreads, [&](size_t t) {
+      std::vector<double> p(m);
+      for (size_t i = t; i < m; i += nthreads) {
+        products(d.get_x(rows[i]), p.data());
+        for (size_t c = 0; c < m; c++)
+          K[i * m + c] = kernel_.from_products(
+              p[c], index->norms[i], index->norms[c]);
+      }
+    });
+
+    double trace = 0.0;
+    for (size_t i = 0; i < m; i++)
+      trace += K[i * m + i];
+    if (!(trace > 0.0))
+      throw std::runtime_error("landmark kernel matrix is zero");
+    std::vector<double> L(m * m);
+    for (jitter_ = 1e-10 * trace / m; ; jitter_ *= 10.0) {
+      if (jitter_ > 1e-2 * trace / m)
+        throw std::runtime_error("landmark kernel matrix is not positive definite");
+      L = K;
+      for (size_t i = 0; i < m; i++)
+        L[i * m + i] += jitter_;
+      if (dense::cholesky(L.data(), m, ncpus))
+        break;
+    }
+    std::shared_ptr<std::vector<double>> whiten =
+      std::make_shared<std::vector<double>>(m * m);
+    dense::lower_inverse_transpose(L.data(), m, whiten->data(), ncpus);
+    whiten_ = whiten;
+  }
+
+  class transformer {
+  public:
+    transformer(const nystrom_linear_model *impl)
+      : impl_(impl) {}
+
+    inline vec_t
+    operator()(const vec_t &x) const
+    {
+      return impl_->transform(x);
+    }
+
+    inline size_t postdim() const { return impl_->m_; }
+
+  private:
+    const nystrom_linear_model *impl_;
+  };
+
+  inline transformer
+  get_transformer() const
+  {
+    return transformer(this);
+  }
+
+  // k(x) from the products of x with every landmark, gathered from the
+  // postings of x's nonzeros, then phi(x) = sum_c k(x)_c whiten_[c], the
+  // rows of whiten_ being the columns of L^{-1}
+  inline vec_t
+  transform(const vec_t &x) const
+  {
+    assert(whiten_);
+    const size_t m = m_;
+    const double * const norms = landmarks_->norms.data();
+    const double * const whiten = whiten_->data();
+    std::vector<double> &p = scratch();
+    p.resize(m);
+    double * const pp = p.data();
+    const double nn = products(x, pp);
+    for (size_t c = 0; c < m; c++)
+      pp[c] = kernel_.from_products(pp[c], nn, norms[c]);
+
+    vec_t ret;
+    standard_vec_t &sret = ret.as_standard_ref();
+    sret.resize(m);
+    double * const z = sret.data().data();
+    std::fill(z, z + m, 0.0);
+    for (size_t c = 0; c < m; c++)
+      dense::axpy(pp[c], whiten + c * m + c, z + c, m - c);
+    return ret;
+  }
+
+  // the risk of a dataset already mapped by transform()
+  inline double
+  transformed_empirical_risk(const dataset &transformed) const
+  {
+    return underlying_.empirical_risk(transformed);
+  }
+
+  inline double
+  empirical_risk(const dataset &d) const
+  {
+    dataset transformed(d, get_transformer());
+    if (transformed.get_parallel_materialize())
+      transformed.materialize();
+    return underlying_.empirical_risk(transformed);
+  }
+
+  inline standard_vec_t
+  grad_empirical_risk(const dataset &d) const
+  {
+    dataset transformed(d, get_transformer());
+    if (transformed.get_parallel_materialize())
+      transformed.materialize();
+    return underlying_.grad_empirical_risk(transformed);
+  }
+
+  inline double
+  norm_grad_empirical_risk(const dataset &d) const
+  {
+    return grad_empirical_risk(d).norm();
+  }
+
+  inline standard_vec_t
+  predict(const dataset &d) const
+  {
+    return predict_margin(d).sign();
+  }
+
+  inline standard_vec_t
+  predict_margin(const dataset &d) const
+  {
+    dataset transformed(d, get_transformer());
+    if (transformed.get_parallel_materialize())
+      transformed.materialize();
+    return underlying_.predict_margin(transformed);
+  }
+
+  inline dataset
+  transform(const dataset &d) const
+  {
+    return dataset(d, get_transformer());
+  }
+
+  inline double get_lambda() const { return underlying_.get_lambda(); }
+  inline standard_vec_t & weightvec() { return underlying_.weightvec(); }
+  inline const standard_vec_t & weightvec() const { return underlying_.weightvec(); }
+  inline const LossFunc & get_lossfn() const { return underlying_.get_lossfn(); }
+  inline const Kernel & get_kernel() const { return kernel_; }
+  // transformed rows are used as they are
+  inline const feature_maps::identity_map &
+  get_features() const { return underlying_.get_features(); }
+  inline size_t get_nlandmarks() const { return m_; }
+  inline double get_jitter() const { return jitter_; }
+
+  // copies share the landmarks and the whitening matrix
+  inline nystrom_linear_model<LossFunc, Kernel>
+  buildfrom(const standard_vec_t &w) const
+  {
+    nystrom_linear_model<LossFunc, Kernel> ret(*this);
+    ret.weightvec() = w;
+    return ret;
+  }
+
+  inline nystrom_linear_model<LossFunc, Kernel>
+  buildfrom(standard_vec_t &&w) const
+  {
+    nystrom_linear_model<LossFunc, Kernel> ret(*this);
+    ret.weightvec() = std::move(w);
+    return ret;
+  }
+
+  inline std::map<std::string, std::string>
+  mapconfig() const
+  {
+    std::map<std::string, std::string> m = underlying_.mapconfig();
+    m["model_type"] = "nystrom_linear";
+    m["model_kernel"] = Kernel::name();
+    m["model_kernel_sigma"] = std::to_string(kernel_.get_sigma());
+    m["model_kernel_dim"] = std::to_string(m_);
+    return m;
+  }
+
+private:
+  linear_model<LossFunc> underlying_;
+  Kernel kernel_;
+
+  // the landmarks' nonzeros by feature: the landmarks with feature
+  // features[f] are landmark[begin[f], begin[f+1]), with those values
+  struct landmark_index {
+    std::vector<size_t> features; // sorted
+    std::vector<size_t> begin;
+    std::vector<uint32_t> landmark;
+    std::vector<double> value;
+    std::vector<double> norms; // ||l_i||^2
+  };
+
+  // pp[c] = <x, l_c> for every landmark, returning ||x||^2; features no
+  // landmark has only count towards the norm
+  inline double
+  products(const vec_t &x, double *pp) const
+  {
+    const landmark_index &index = *landmarks_;
+    std::fill(pp, pp + m_, 0.0);
+    double nn = 0.0;
+    x.for_each_nonzero([&index, pp, &nn](size_t j, double v) {
+      nn += v * v;
+      auto it = std::lower_bound(index.features.begin(), index.features.end(), j);
+      if (it == index.features.end() || *it != j)
+        return;
+      const size_t f = it - index.features.begin();
+      for (size_t e = index.begin[f]; e < index.begin[f + 1]; e++)
+        pp[index.landmark[e]] += v * index.value[e];
+    });
+    return nn;
+  }
+
+  // k(x) of the row being transformed, reused across rows by each thread
+  static inline std::vector<double> &
+  scratch()
+  {
+    static thread_local std::vector<double> p;
+    return p;
+  }
+
+  size_t m_ = 0; // number of landmarks
+  double jitter_ = 0.0; // added to the diagonal of the landmark kernel matrix
+  std::shared_ptr<const landmark_index> landmarks_;
+  std::shared_ptr<const std::vector<double>> whiten_; // m_ x m_, upper
 };
 
 template <typename Model>
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include <util.hh>
+
+/**
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3"), a counter-based generator: the i-th output of a stream is a
+ * pure function of (key, stream, i). Each worker of a parallel loop can
+ * thus draw from its own stream, in any order and on any thread, and
+ * still get the same numbers every run.
+ */
+class philox {
+public:
+  typedef uint64_t result_type;
+
+  philox(uint64_t key, uint64_t stream)
+    : key_{uint32_t(key), uint32_t(key >> 32)},
+      ctr_{0, 0, uint32_t(stream), uint32_t(stream >> 32)},
+      buf_{0, 0, 0, 0}, pos_(4)
+  {}
+
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return std::numeric_limits<uint64_t>::max(); }
+
+  inline result_type
+  operator()()
+  {
+    const uint64_t lo = next32();
+    return (uint64_t(next32()) << 32) | lo;
+  }
+
+  // uniform in [0, n), without modulo bias (Lemire's multiply-shift)
+  inline uint64_t
+  uniform(uint64_t n)
+  {
+    unsigned __int128 m = (unsigned __int128)(*this)() * n;
+    uint64_t l = uint64_t(m);
+    if (l < n) {
+      const uint64_t t = -n % n;
+      while (l < t) {
+        m = (unsigned __int128)(*this)() * n;
+        l = uint64_t(m);
+      }
+    }
+    return uint64_t(m >> 64);
+  }
+
+  // uniform in [0, n) for n < 2^32, at half the draws of uniform()
+  inline uint32_t
+  uniform32(uint32_t n)
+  {
+    uint64_t m = uint64_t(next32()) * n;
+    uint32_t l = uint32_t(m);
+    if (l < n) {
+      const uint32_t t = -n % n;
+      while (l < t) {
+        m = uint64_t(next32()) * n;
+        l = uint32_t(m);
+      }
+    }
+    return uint32_t(m >> 32);
+  }
+
+  // the block for (key, ctr), exposed for testing against reference values
+  static inline void
+  block(const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4])
+  {
+    uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    for (int r = 0; r < 10; r++) {
+      const uint64_t p0 = uint64_t(M0) * c0;
+      const uint64_t p1 = uint64_t(M1) * c2;
+      const uint32_t n0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+      const uint32_t n2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+      c1 = uint32_t(p1);
+      c3 = uint32_t(p0);
+      c0 = n0;
+      c2 = n2;
+      k0 += W0;
+      k1 += W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+  }
+
+private:
+  static const uint32_t M0 = 0xD2511F53;
+  static const uint32_t M1 = 0xCD9E8D57;
+  static const uint32_t W0 = 0x9E3779B9;
+  static const uint32_t W1 = 0xBB67AE85;
+
+  inline uint32_t
+  next32()
+  {
+    if (pos_ == 4) {
+      block(key_, ctr_, buf_);
+      // the low half of the counter numbers the blocks of the stream
+      if (!++ctr_[0])
+        ++ctr_[1];
+      pos_ = 0;
+    }
+    return buf_[pos_++];
+  }
+
+  uint32_t key_[2];
+  uint32_t ctr_[4];
+  uint32_t buf_[4];
+  unsigned pos_;
+};
+
+// shuffles [first, last) with draws from g (Fisher-Yates)
+template <typename RandomIt>
+static inline void
+philox_shuffle(RandomIt first, RandomIt last, philox &g)
+{
+  const uint64_t n = last - first;
+  uint64_t i = n;
+  for (; i > std::numeric_limits<uint32_t>::max(); i--)
+    std::swap(first[i - 1], first[g.uniform(i)]);
+  for (; i > 1; i--)
+    std::swap(first[i - 1], first[g.uniform32(uint32_t(i))]);
+}
+
+/**
+ * A uniformly random permutation of [0, n), generated in parallel: every
+ * element draws one of nbuckets buckets, the elements are scattered to
+ * their buckets, and the buckets are shuffled independently (Sanders,
+ * "Random permutations on distributed, external and hierarchical memory",
+ * 1998). Each fixed-size chunk of elements, and each bucket, draws from
+ * its own philox stream of key. Chunk and bucket sizes depend only on n,
+ * so the result is a function of (n, key) whatever nthreads is.
+ */
+static inline std::vector<size_t>
+random_permutation(size_t n, uint64_t key, size_t nthreads)
+{
+  static const size_t BucketSize = 1 << 16;
+  static const size_t MaxBuckets = 1 << 12;
+  static const size_t MinChunk = 1 << 16;
+  static const size_t MaxChunks = 256;
+  static const uint64_t BucketStreams = uint64_t(1) << 32;
+
+  std::vector<size_t> pi(n);
+  if (n <= BucketSize) {
+    std::iota(pi.begin(), pi.end(), 0);
+    philox g(key, BucketStreams);
+    philox_shuffle(pi.begin(), pi.end(), g);
+    return pi;
+  }
+
+  const size_t nbuckets = std::min(MaxBuckets, (n + BucketSize - 1) / BucketSize);
+  const size_t chunk = std::max(MinChunk, (n + MaxChunks - 1) / MaxChunks);
+  const size_t nchunks = (n + chunk - 1) / chunk;
+  nthreads = std::max(size_t(1), std::min(nthreads, nchunks));
+
+  // counts[c * nbuckets + b] is how many elements of chunk c go to
+  // bucket b, and then where in pi the first of them goes
+  std::vector<uint16_t> bucket(n);
+  std::vector<size_t> counts(nchunks * nbuckets, 0);
+  util::parallel_run(nthreads, [&](size_t t) {
+    for (size_t c = t; c < nchunks; c += nthreads) {
+      philox g(key, c);
+      size_t * const cnt = &counts[c * nbuckets];
+      for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) {
+        const size_t b = g.uniform32(uint32_t(nbuckets));
+        bucket[i] = uint16_t(b);
+        cnt[b]++;
+      }
+    }
+  });
+  std::vector<size_t> bucket_begin(nbuckets + 1);
+  size_t sum = 0;
+  for (size_t b = 0; b < nbuckets; b++) {
+    bucket_begin[b] = sum;
+    for (size_t c = 0; c < nchunks; c++) {
+      const size_t cnt = counts[c * nbuckets + b];
+      counts[c * nbuckets + b] = sum;
+      sum += cnt;
+    }
+  }
+  bucket_begin[nbuckets] = n;
+
+  util::parallel_run(nthreads, [&](size_t t) {
+    for (size_t c = t; c < nchunks; c += nthreads) {
+      size_t * const pos = &counts[c * nbuckets];
+      for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++)
+        pi[pos[bucket[i]]++] = i;
+    }
+  });
+  util::parallel_run(nthreads, [&](size_t t) {
+    for (size_t b = t; b < nbuckets; b += nthreads) {
+      philox g(key, BucketStreams + b);
+      philox_shuffle(pi.begin() + bucket_begin[b],
+                     pi.begin() + bucket_begin[b + 1], g);
+    }
+  });
+  return pi;
+}
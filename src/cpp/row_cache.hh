@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <macros.hh>
+#include <util.hh>
+#include <vec.hh>
+
+/**
+ * A bounded cache of computed rows (e.g. the output of a dataset
+ * transform), keyed by row index. Rows are spread over shards by index,
+ * each with its own lock, byte budget and CLOCK replacement, so threads
+ * working on different rows rarely touch the same lock.
+ *
+ * Entries are immutable and reference counted: a lookup pins the entry in
+ * the caller's handle, so a row stays valid until the handle is reused
+ * even if the cache evicts it in the meantime.
+ *
+ * With store_float, dense rows are kept as floats (half the footprint) and
+ * widened into the handle on every hit; sparse rows are always kept as is.
+ */
+class row_cache {
+public:
+
+  class entry {
+    friend class row_cache;
+  public:
+    inline size_t bytes() const { return bytes_; }
+  private:
+    vec_t v_;
+    std::vector<float> f_; // dense payload, if stored as floats
+    bool is_float_;
+    size_t bytes_;
+  };
+
+  // per-thread view of the last row looked up
+  class handle {
+    friend class row_cache;
+  public:
+    handle() : v_(nullptr) {}
+    inline const vec_t & get() const { return *v_; }
+    // a row that bypasses the cache
+    inline vec_t & scratch() { return scratch_; }
+  private:
+    std::shared_ptr<const entry> pin_;
+    vec_t scratch_;
+    const vec_t *v_;
+  };
+
+  struct counters {
+    counters() : hits_(0), misses_(0), evictions_(0), entries_(0), bytes_(0) {}
+    size_t hits_;
+    size_t misses_;
+    size_t evictions_;
+    size_t entries_;
+    size_t bytes_;
+  };
+
+  row_cache(size_t nrows, size_t budget_bytes, bool store_float,
+            size_t nshards = default_nshards())
+    : nrows_(nrows), budget_bytes_(budget_bytes), store_float_(store_float),
+      shards_(std::max(nshards, size_t(1)))
+  {
+    const size_t per_shard = budget_bytes_ / shards_.size();
+    for (size_t i = 0; i < shards_.size(); i++) {
+      shards_[i].budget_ = per_shard;
+      shards_[i].where_.resize(nrows_ / shards_.size() + 1, 0);
+    }
+  }
+
+  row_cache(const row_cache &) = delete;
+  row_cache &operator=(const row_cache &) = delete;
+
+  // on a hit, points h at row idx and returns true
+  bool
+  lookup(size_t idx, handle &h)
+  {
+    shard &s = shard_of(idx);
+    std::shared_ptr<const entry> e;
+    s.lock();
+    const uint32_t w = s.where_[idx / shards_.size()];
+    if (w) {
+      s.ring_[w - 1].ref_ = true;
+      e = s.ring_[w - 1].e_;
+      s.hits_++;
+    } else {
+      s.misses_++;
+    }
+    s.unlock();
+    if (!e)
+      return false;
+    point(h, std::move(e));
+    return true;
+  }
+
+  /**
+   * Caches v as row idx (unless another thread got there first, in which
+   * case its entry wins) and points h at it. Rows larger than a shard's
+   * budget are handed back without being cached.
+   */
+  void
+  insert(size_t idx, vec_t &&v, handle &h)
+  {
+    std::shared_ptr<const entry> e = make_entry(std::move(v));
+    shard &s = shard_of(idx);
+    const size_t local = idx / shards_.size();
+    s.lock();
+    const uint32_t w = s.where_[local];
+    if (w) {
+      e = s.ring_[w - 1].e_;
+    } else if (e->bytes() <= s.budget_) {
+      while (s.bytes_ + e->bytes() > s.budget_)
+        s.evict_one(shards_.size());
+      s.ring_.emplace_back(idx, e);
+      s.where_[local] = s.ring_.size();
+      s.bytes_ += e->bytes();
+    }
+    s.unlock();
+    point(h, std::move(e));
+  }
+
+  // summed over shards; only a snapshot while other threads are active
+  counters
+  get_counters() const
+  {
+    counters c;
+    for (auto &s : shards_) {
+      s.lock();
+      c.hits_ += s.hits_;
+      c.misses_ += s.misses_;
+      c.evictions_ += s.evictions_;
+      c.entries_ += s.ring_.size();
+      c.bytes_ += s.bytes_;
+      s.unlock();
+    }
+    return c;
+  }
+
+  inline size_t budget_bytes() const { return budget_bytes_; }
+  inline bool store_float() const { return store_float_; }
+
+  static size_t
+  default_nshards()
+  {
+    size_t n = 16;
+    while (n < 4 * util::ncpus_online())
+      n *= 2;
+    return n;
+  }
+
+private:
+
+  struct slot {
+    slot(size_t idx, const std::shared_ptr<const entry> &e)
+      : idx_(idx), ref_(false), e_(e) {}
+    size_t idx_;
+    bool ref_;
+    std::shared_ptr<const entry> e_;
+  };
+
+  struct shard {
+    shard() : budget_(0), bytes_(0), hand_(0),
+              hits_(0), misses_(0), evictions_(0) {}
+
+    inline void
+    lock() const
+    {
+      while (lock_.test_and_set(std::memory_order_acquire))
+        ;
+    }
+
+    inline void
+    unlock() const
+    {
+      lock_.clear(std::memory_order_release);
+    }
+
+    // CLOCK: clear reference bits until an unreferenced slot comes up
+    void
+    evict_one(size_t nshards)
+    {
+      assert(!ring_.empty());
+      for (;;) {
+        if (hand_ >= ring_.size())
+          hand_ = 0;
+        slot &victim = ring_[hand_];
+        if (victim.ref_) {
+          victim.ref_ = false;
+          hand_++;
+          continue;
+        }
+        where_[victim.idx_ / nshards] = 0;
+        bytes_ -= victim.e_->bytes();
+        evictions_++;
+        if (hand_ + 1 != ring_.size()) {
+          victim = std::move(ring_.back());
+          where_[victim.idx_ / nshards] = hand_ + 1;
+        }
+        ring_.pop_back();
+        return;
+      }
+    }
+
+    size_t budget_;
+    size_t bytes_;
+    size_t hand_;
+    std::vector<slot> ring_;
+    std::vector<uint32_t> where_; // local row index -> ring index + 1
+    size_t hits_;
+    size_t misses_;
+    size_t evictions_;
+    mutable std::atomic_flag lock_ = ATOMIC_FLAG_INIT;
+    CACHE_PADOUT;
+  };
+
+  inline shard &
+  shard_of(size_t idx)
+  {
+    assert(idx < nrows_);
+    return shards_[idx % shards_.size()];
+  }
+
+  std::shared_ptr<const entry>
+  make_entry(vec_t &&v) const
+  {
+    std::shared_ptr<entry> e = std::make_shared<entry>();
+    e->is_float_ = store_float_ && v.is_standard();
+    if (e->is_float_) {
+      const standard_vec_t &sv = v.as_standard_ref();
+      e->f_.resize(sv.size());
+      for (size_t i = 0; i < sv.size(); i++)
+        e->f_[i] = float(sv[i]);
+      e->bytes_ = footprint(e->f_.capacity() * sizeof(float));
+    } else {
+      e->v_ = std::move(v);
+      e->bytes_ = footprint(e->v_.capacity_bytes());
+    }
+    return e;
+  }
+
+  // what an entry holding a payload of that many allocated bytes takes from
+  // the heap: the entry next to its shared_ptr control block (a vtable
+  // pointer and two counts), the payload, and a malloc chunk header for
+  // each of the two allocations
+  static inline size_t
+  footprint(size_t payload_bytes)
+  {
+    static const size_t ControlBytes = sizeof(void *) + 2 * sizeof(int);
+    static const size_t ChunkOverhead = 16;
+    return sizeof(entry) + ControlBytes + ChunkOverhead +
+      (payload_bytes ? payload_bytes + ChunkOverhead : 0);
+  }
+
+  static inline void
+  point(handle &h, std::shared_ptr<const entry> &&e)
+  {
+    if (e->is_float_) {
+      standard_vec_t &sv = h.scratch_.as_standard_ref();
+      sv.resize(e->f_.size());
+      for (size_t i = 0; i < e->f_.size(); i++)
+        sv[i] = e->f_[i];
+      h.v_ = &h.scratch_;
+    } else {
+      h.v_ = &e->v_;
+    }
+    h.pin_ = std::move(e);
+  }
+
+  const size_t nrows_;
+  const size_t budget_bytes_;
+  const bool store_float_;
+  std::vector<shard> shards_;
+};
+
+inline std::ostream &
+operator<<(std::ostream &o, const row_cache::counters &c)
+{
+  const size_t lookups = c.hits_ + c.misses_;
+  o << "{hits=" << c.hits_ << ", misses=" << c.misses_
+    << ", hit_rate=" << (lookups ? double(c.hits_) / double(lookups) : 0.0)
+    << ", evictions=" << c.evictions_ << ", entries=" << c.entries_
+    << ", bytes=" << c.bytes_ << "}";
+  return o;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+/**
+ * Stratified row sampling by label: keeps each negative row (y <= 0) with
+ * probability neg_rate and each positive row with probability pos_rate.
+ *
+ * Whether a row is kept depends only on the seed and the row's index in
+ * its file, never on which thread reads it, so loaders can sample inside
+ * their parallel parse and still produce the same rows every time. Kept
+ * rows weigh 1/rate, which makes weighted losses and metrics estimates of
+ * those over the full data.
+ */
+class stratified_sampler {
+public:
+  stratified_sampler(double neg_rate, double pos_rate, uint64_t seed)
+    : neg_rate_(neg_rate), pos_rate_(pos_rate), seed_(seed),
+      neg_threshold_(threshold(neg_rate)), pos_threshold_(threshold(pos_rate))
+  {}
+
+  inline bool
+  keep(uint64_t row, double y) const
+  {
+    const uint64_t t = (y > 0.0) ? pos_threshold_ : neg_threshold_;
+    return t == KeepAll || mix(seed_ + row * Golden) < t;
+  }
+
+  // the weight of a kept row
+  inline double
+  weight(double y) const
+  {
+    return 1.0 / ((y > 0.0) ? pos_rate_ : neg_rate_);
+  }
+
+  inline double get_neg_rate() const { return neg_rate_; }
+  inline double get_pos_rate() const { return pos_rate_; }
+  inline uint64_t get_seed() const { return seed_; }
+
+private:
+  static const uint64_t Golden = 0x9e3779b97f4a7c15ULL;
+  static const uint64_t KeepAll = std::numeric_limits<uint64_t>::max();
+
+  // rows whose hash is below the threshold are kept
+  static uint64_t
+  threshold(double rate)
+  {
+    if (!(rate > 0.0 && rate <= 1.0))
+      throw std::runtime_error("sampling rates must be in (0, 1]");
+    if (rate == 1.0)
+      return KeepAll;
+    return uint64_t(std::ldexp(rate, 64));
+  }
+
+  // splitmix64 finalizer
+  static inline uint64_t
+  mix(uint64_t z)
+  {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  double neg_rate_;
+  double pos_rate_;
+  uint64_t seed_;
+  uint64_t neg_threshold_;
+  uint64_t pos_threshold_;
+};
+
+inline std::ostream &
+operator<<(std::ostream &o, const stratified_sampler &s)
+{
+  o << "{neg_rate=" << s.get_neg_rate() << ", pos_rate=" << s.get_pos_rate()
+    << ", seed=" << s.get_seed() << "}";
+  return o;
+}
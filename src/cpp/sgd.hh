@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <vector>
 #include <random>
@@ -12,14 +13,20 @@
 #include <pretty_printers.hh>
 #include <loss_functions.hh>
 #include <dataset.hh>
+#include <dense.hh>
 #include <timer.hh>
 #include <model.hh>
 #include <classifier.hh>
 #include <lvec.hh>
 #include <task_executor.hh>
+#include <philox.hh>
+#include <util.hh>
 
 namespace opt {
 
+// parsgd prefetch distance: pick one from the average row nnz
+static const size_t PrefetchAuto = size_t(-1);
+
 template <typename Model, typename Generator>
 class parsgd : public classifier::base_iterative_clf<Model, Generator> {
 public:
@@ -34,12 +41,20 @@ public:
          bool do_locking,
          size_t t_offset = 0,
          double c0 = 1.0,
-         bool verbose = false)
+         bool verbose = false,
+         mem::page_mode weight_pages = mem::page_mode::NONE,
+         size_t prefetch = PrefetchAuto)
     : classifier::base_iterative_clf<Model, Generator>(model, nrounds, prng, verbose),
       t_offset_(t_offset),
       c0_(c0),
       nworkers_(nworkers),
-      do_locking_(do_locking)
+      do_locking_(do_locking),
+      weight_pages_(weight_pages),
+      prefetch_(prefetch),
+      prefetch_eff_(0),
+      time_updates_(false),
+      deterministic_(false),
+      dense_(nullptr)
   {
     ALWAYS_ASSERT(c0_ > 0.0);
     ALWAYS_ASSERT(nworkers_ > 0);
@@ -61,7 +76,46 @@ public:
 
     const auto shape = transformed.get_x_shape();
     this->training_sz_ = shape.first;
-    const auto feature_counts = transformed.feature_counts();
+    // the model's features of a row may be more than its nonzeros (see
+    // feature_maps.hh), so weights and counts are sized by the model
+    const auto &fmap = this->model_.get_features();
+    const size_t nfeatures = fmap.dim(shape.second);
+    const std::vector<size_t> feature_counts = fmap.feature_counts(transformed);
+    // rows of an unmaterialized transform (see dataset::set_transform_cache)
+    // only exist once computed, so there is nothing to prefetch; nor are a
+    // mapped row's features, which would be generated twice to prefetch them
+    prefetch_eff_ =
+      (transformed.computes_rows() || !Model::feature_map_type::is_identity) ?
+      0 : resolve_prefetch(transformed.stats());
+
+    // workers of a deterministic run update private copies of the weights,
+    // so there is nothing to lock
+    const bool locking = do_locking_ && !deterministic_;
+    // a feature map may emit an index twice in a row (colliding crosses),
+    // and locking a weight the worker already holds never returns
+    ALWAYS_ASSERT(!locking || Model::feature_map_type::is_identity);
+
+    // without locking, dense rows take work_dense(), which folds the
+    // per-feature regularization scale into one vector
+    dense_ = (locking || !Model::feature_map_type::is_identity) ?
+      nullptr : transformed.dense();
+    if (dense_) {
+      decay_.resize(shape.second);
+      for (size_t i = 0; i < shape.second; i++)
+        decay_[i] = feature_counts[i] ?
+          double(shape.first) / double(feature_counts[i]) : 0.0;
+    }
+
+    // rows are sampled uniformly, so row i's step is scaled by its weight
+    // relative to the mean weight to keep the gradient of the weighted
+    // objective unbiased
+    if (const standard_vec_t *sw = transformed.get_weights()) {
+      const double scale = double(shape.first) / transformed.weight_sum();
+      step_weights_.resize(shape.first);
+      for (size_t i = 0; i < shape.first; i++)
+        step_weights_[i] = (*sw)[i] * scale;
+    }
+    const bool weighted = !step_weights_.empty();
 
     //if (this->verbose_) {
     //  for (size_t i = 0; i < feature_counts.size(); i++)
@@ -69,7 +123,20 @@ public:
     //      std::cerr << "[WARN] feature idx " << i << " is never used!" << std::endl;
     //}
 
-    this->state_.reset(new standard_lvec<double>(shape.second));
+    // hugepage-backed weights start out unfaulted; fault them in with all
+    // cores now rather than from the first round's random writes
+    tt.lap();
+    this->state_.reset(new standard_lvec<double>(nfeatures, weight_pages_));
+    if (weight_pages_ != mem::page_mode::NONE)
+      state_->prefault(util::ncpus_online());
+    // per-example update latencies, when asked for, go to one histogram
+    // per worker thread
+    if (time_updates_)
+      update_latency_.reset(new latency_region);
+    if (this->verbose_)
+      std::cerr << "[INFO] weights: " << nfeatures * sizeof(double) / 1024
+                << " KB, pages=" << mem::page_mode_str(state_->page_mode())
+                << ", setup took " << tt.lap_ms() << " ms" << std::endl;
     this->w_history_.clear();
     if (keep_histories)
       this->w_history_.reserve(this->nrounds_);
@@ -81,6 +148,9 @@ public:
     if (this->verbose_) {
       std::cerr << "[INFO] keep_histories: " << keep_histories << std::endl;
       std::cerr << "[INFO] actual_nworkers: " << actual_nworkers << std::endl;
+      std::cerr << "[INFO] prefetch distance: " << prefetch_eff_ << std::endl;
+      std::cerr << "[INFO] dense rows: " << (dense_ ? "yes" : "no") << std::endl;
+      std::cerr << "[INFO] sample weights: " << (weighted ? "yes" : "no") << std::endl;
       std::cerr << "[INFO] starting eta_t: "
                 << c0_ / (this->model_.get_lambda() * (1 + this->t_offset_))
                 << std::endl;
@@ -90,11 +160,38 @@ public:
         workers.emplace_back(new task_executor_thread<bool>);
     const size_t nelems_per_worker =
       this->training_sz_ / actual_nworkers;
+
+    /**
+     * Deterministic mode: worker i always gets the same rows, the i-th
+     * slice of the dataset, visits them in an order drawn from its own
+     * philox stream for the round, and updates its own copy of the
+     * weights; the copies are averaged, in worker order, after every
+     * round. Hogwild's races go away, so a given seed and number of
+     * workers always produces the same model.
+     */
+    const uint64_t key = deterministic_ ?
+      std::uniform_int_distribution<uint64_t>()(*this->prng_) : 0;
+    if (deterministic_ && actual_nworkers > 1)
+      for (size_t i = 0; i < actual_nworkers; i++)
+        local_.emplace_back(
+            new standard_lvec<double>(nfeatures, weight_pages_));
+    uint64_t merge_usec = 0;
+    if (this->verbose_ && deterministic_)
+      std::cerr << "[INFO] deterministic: key=" << key << std::endl;
+
+    const auto workfn = locking ?
+      (weighted ? &parsgd::work<true, true> : &parsgd::work<true, false>) :
+      (weighted ? &parsgd::work<false, true> : &parsgd::work<false, false>);
     tt.lap();
     std::vector<std::future<bool>> futures;
-    timer tt1;
+    timer tt1(timer::T_CLK_MONOTONIC_RAW);
     for (size_t round = 0; round < this->nrounds_; round++) {
-      const auto permutation = transformed.permute(*this->prng_);
+      const auto permutation = deterministic_ ?
+        slice_permutation(transformed, key, round, actual_nworkers,
+                          nelems_per_worker) :
+        transformed.permute(
+            std::uniform_int_distribution<uint64_t>()(*this->prng_),
+            util::ncpus_online());
       const auto it_end = permutation.end();
       const auto it_beg = permutation.begin();
 
@@ -111,7 +208,7 @@ public:
           futures.emplace_back(
             workers[i]->enq(
               std::bind(
-                do_locking_ ? &parsgd::work<true> : &parsgd::work<false>,
+                workfn,
                 this,
                 i,
                 round+1,
@@ -124,10 +221,15 @@ public:
           f.wait();
         futures.clear();
       } else {
-        if (do_locking_)
-          work<true>(0, round+1, this->training_sz_, feature_counts, it_beg, it_end);
-        else
-          work<false>(0, round+1, this->training_sz_, feature_counts, it_beg, it_end);
+        (this->*workfn)(0, round+1, this->training_sz_, feature_counts, it_beg, it_end);
+      }
+      if (!local_.empty()) {
+        timer tm(timer::T_CLK_MONOTONIC_RAW);
+        merge_local();
+        const uint64_t usec = tm.lap();
+        merge_usec += usec;
+        if (this->telemetry_)
+          this->telemetry_->emit("merge_ms", round + 1, usec / 1000.0);
       }
 
       if (keep_histories) {
@@ -136,24 +238,63 @@ public:
             round + 1, tt.elapsed_usec(), this->model_.weightvec());
       }
 
-      if (this->verbose_) {
-        std::cerr << "[INFO] finished round " << (round+1) << " in "
-                  << tt1.lap_ms() << " ms" << std::endl;
+      const double round_ms = tt1.lap_ms();
+      if (this->verbose_ || this->telemetry_) {
         state_->unsafesnapshot(this->model_.weightvec());
-        std::cerr << "[INFO] current risk: "
-                  << this->model_.empirical_risk(transformed) << std::endl;
+        const double risk = this->model_.transformed_empirical_risk(transformed);
+        if (this->verbose_) {
+          std::cerr << "[INFO] finished round " << (round+1) << " in "
+                    << round_ms << " ms" << std::endl;
+          std::cerr << "[INFO] current risk: " << risk << std::endl;
+        }
+        this->emit_round(round + 1, round_ms, risk);
       }
     }
     state_->unsafesnapshot(this->model_.weightvec());
+    // the price of determinism, beyond giving up Hogwild's sharing: the
+    // time spent merging the workers' weights
+    if (!local_.empty() && this->verbose_)
+      std::cerr << "[INFO] deterministic merges took " << merge_usec / 1000.0
+                << " ms of " << tt.elapsed_usec() / 1000.0 << " ms training"
+                << std::endl;
+    local_.clear();
+    if (update_latency_) {
+      const latency_histogram h = update_latency_->summary();
+      if (this->verbose_)
+        std::cerr << "[INFO] per-example update latency: " << h
+                  << " (tsc=" << tsc_clock::uses_tsc() << ")" << std::endl;
+      if (this->telemetry_) {
+        this->telemetry_->emit("update_ns_p50", this->nrounds_, h.percentile(50));
+        this->telemetry_->emit("update_ns_p99", this->nrounds_, h.percentile(99));
+        this->telemetry_->emit("update_ns_max", this->nrounds_, h.max());
+      }
+      update_latency_.reset();
+    }
     for (auto &w : workers)
       w->shutdown();
-    ALWAYS_ASSERT( this->model_.weightvec().size() == shape.second );
+    dense_ = nullptr;
+    decay_.clear();
+    step_weights_.clear();
+    if (this->verbose_ && transformed.transform_cache())
+      std::cerr << "[INFO] transform cache: "
+                << transformed.transform_cache()->get_counters() << std::endl;
+    ALWAYS_ASSERT( this->model_.weightvec().size() == nfeatures );
   }
 
   inline size_t get_t_offset() const { return t_offset_; }
   inline double get_c0() const { return c0_; }
   inline size_t get_nworkers() const { return nworkers_; }
   inline bool get_do_locking() const { return do_locking_; }
+  inline mem::page_mode get_weight_pages() const { return weight_pages_; }
+  inline size_t get_prefetch() const { return prefetch_; }
+
+  // record how long each example's update takes (see latency_region)
+  inline void set_time_updates(bool t) { time_updates_ = t; }
+  inline bool get_time_updates() const { return time_updates_; }
+
+  // reproducible training, at some cost in throughput (see fit())
+  inline void set_deterministic(bool d) { deterministic_ = d; }
+  inline bool get_deterministic() const { return deterministic_; }
 
   std::string name() const OVERRIDE { return "parsgd"; }
 
@@ -167,29 +308,170 @@ public:
     m["clf_c0"]         = std::to_string(c0_);
     m["clf_nworkers"]   = std::to_string(nworkers_);
     m["clf_do_locking"] = std::to_string(do_locking_);
+    m["clf_deterministic"] = std::to_string(deterministic_);
+    m["clf_weight_pages"] = mem::page_mode_str(weight_pages_);
+    m["clf_prefetch"] = (prefetch_ == PrefetchAuto) ?
+      "auto(" + std::to_string(prefetch_eff_) + ")" :
+      std::to_string(prefetch_);
     return m;
   }
 
 private:
 
-  template <bool DoLocking>
+  // the weights worker i updates
+  inline standard_lvec<double> &
+  worker_state(size_t i)
+  {
+    return local_.empty() ? *state_ : *local_[i];
+  }
+
+  // each worker's slice of the rows, shuffled by its philox stream for
+  // the round; slices are cut as in fit()
+  static dataset::permutation
+  slice_permutation(const dataset &d, uint64_t key, size_t round,
+                    size_t nworkers, size_t nelems_per_worker)
+  {
+    const size_t n = d.get_x_shape().first;
+    std::vector<size_t> pi = util::range(n);
+    util::parallel_run(nworkers, [&](size_t i) {
+      const size_t lo = i * nelems_per_worker;
+      const size_t hi = (i + 1 == nworkers) ? n : lo + nelems_per_worker;
+      philox g(key, (uint64_t(round) << 32) | i);
+      philox_shuffle(pi.begin() + lo, pi.begin() + hi, g);
+    });
+    return d.reorder(std::move(pi));
+  }
+
+  // state_ = the mean of the workers' weights, summed in worker order so
+  // the result doesn't depend on the threads; every worker restarts from it
+  void
+  merge_local()
+  {
+    const size_t d = state_->size();
+    const size_t nw = local_.size();
+    std::vector<double *> ws(nw);
+    for (size_t i = 0; i < nw; i++)
+      ws[i] = local_[i]->unsafedata();
+    double * const w = state_->unsafedata();
+    util::parallel_run(nw, [&](size_t c) {
+      const size_t lo = d * c / nw, hi = d * (c + 1) / nw;
+      for (size_t j = lo; j < hi; j++) {
+        double sum = 0.0;
+        for (size_t i = 0; i < nw; i++)
+          sum += ws[i][j];
+        w[j] = sum / double(nw);
+        for (size_t i = 0; i < nw; i++)
+          ws[i][j] = w[j];
+      }
+    });
+  }
+
+  /**
+   * Enough rows in flight to cover roughly 32 outstanding weight misses;
+   * rows with many nonzeros already give the core plenty to overlap.
+   */
+  inline size_t
+  resolve_prefetch(const feature_stats &stats) const
+  {
+    if (prefetch_ != PrefetchAuto)
+      return prefetch_;
+    if (!stats.nrows())
+      return 0;
+    const double avg_nnz =
+      std::max(1.0, double(stats.nnz()) / double(stats.nrows()));
+    return std::min(size_t(16), std::max(size_t(1), size_t(32.0 / avg_nnz + 0.5)));
+  }
+
+  /**
+   * Software pipeline over the (randomly permuted) rows, k examples per
+   * stage: the row's vec_t 3k ahead, its payload 2k ahead (the vec_t has
+   * arrived by then), and the weights it touches k ahead (the payload has
+   * arrived by then). Rows are only addressed, never transformed, here:
+   * fit() materializes the dataset first, or turns prefetching off if the
+   * rows are computed on access. Packed rows skip the last stage: finding
+   * their weights means decoding every index, which is most of what the
+   * update itself costs, so only their bytes are prefetched.
+   */
+  template <typename FeatureMap>
+  static inline void
+  prefetch_ahead(const standard_lvec<double> &state,
+                 const FeatureMap &fmap,
+                 dataset::const_iterator begin,
+                 size_t j, size_t n, size_t k)
+  {
+    if (j + 3*k < n)
+      __builtin_prefetch(&*(begin + (j + 3*k)).first(), 0, 3);
+    if (j + 2*k < n)
+      (*(begin + (j + 2*k)).first()).prefetch();
+    if (j + k < n) {
+      const vec_t &x = *(begin + (j + k)).first();
+      if (!x.is_packed())
+        fmap.for_each(x, [&state](size_t feature_idx, double) {
+          state.prefetch(feature_idx);
+        });
+    }
+  }
+
+  template <bool DoLocking, typename FeatureMap>
   static inline double
-  dot(const vec_t &x, standard_lvec<double> &b)
+  dot(const FeatureMap &fmap, const vec_t &x, standard_lvec<double> &b)
   {
     double s = 0.0;
-    const auto inner_it_end = x.end();
-    for (auto inner_it = x.begin();
-         inner_it != inner_it_end; ++inner_it) {
-      const size_t feature_idx = inner_it.tell();
+    fmap.for_each(x, [&s, &b](size_t feature_idx, double value) {
       if (DoLocking)
-        s += (*inner_it) * b.lockandread(feature_idx);
+        s += value * b.lockandread(feature_idx);
       else
-        s += (*inner_it) * b.unsaferead(feature_idx);
-    }
+        s += value * b.unsaferead(feature_idx);
+    });
     return s;
   }
 
-  template <bool DoLocking>
+  // w = (1 - a * decay) .* w - b * x
+  static inline void
+  dense_step(double *__restrict__ w, const double *__restrict__ x,
+             const double *__restrict__ decay, double a, double b, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+      w[i] -= a * decay[i] * w[i] + b * x[i];
+  }
+
+  // work<false>() over the rows of dense_: same updates, with every row
+  // touching every weight, so they are done as vector kernels
+  template <bool Weighted>
+  bool
+  work_dense(standard_lvec<double> &state,
+             size_t round,
+             size_t dataset_size,
+             dataset::const_iterator begin,
+             dataset::const_iterator end)
+  {
+    const dense::block &b = *dense_;
+    const size_t d = b.cols_;
+    const size_t k = prefetch_eff_;
+    const size_t n = end - begin;
+    const double lambda = this->model_.get_lambda();
+    double * const w = state.unsafedata();
+    const double * const decay = decay_.data();
+    const double * const sw = step_weights_.data();
+    size_t i = 1;
+    for (auto it = begin; it != end; ++it, ++i) {
+      const scoped_latency l(update_latency_.get());
+      if (k && i - 1 + k < n)
+        dense::prefetch(b.row((begin + (i - 1 + k)).first().index()), d);
+      const size_t t_eff = (round-1)*dataset_size + i + t_offset_;
+      const double eta_t = c0_ / (lambda * t_eff);
+      const size_t row = it.first().index();
+      const double * const x = b.row(row);
+      double dloss =
+        this->model_.get_lossfn().dloss(*it.second(), dense::dot(x, w, d));
+      if (Weighted)
+        dloss *= sw[row];
+      dense_step(w, x, decay, eta_t * lambda, eta_t * dloss, d);
+    }
+    return false;
+  }
+
+  template <bool DoLocking, bool Weighted>
   bool
   work(size_t workerid,
        size_t round,
@@ -198,30 +480,42 @@ private:
        dataset::const_iterator begin,
        dataset::const_iterator end)
   {
+    const telemetry::scoped_work report(
+        this->telemetry_.get(), round, int(workerid), end - begin);
+    standard_lvec<double> &state = worker_state(workerid);
+    if (!DoLocking && dense_)
+      return work_dense<Weighted>(state, round, dataset_size, begin, end);
     const double dataset_sizef = double(dataset_size);
+    const size_t k = prefetch_eff_;
+    const size_t n = end - begin;
+    const double * const sw = step_weights_.data();
+    const auto &fmap = this->model_.get_features();
     size_t i = 1;
     //std::cerr << "[worker " << workerid << ", round " << round << ", elems" << size_t(end-begin) << "]" << std::endl;
     for (auto it = begin; it != end; ++it, ++i) {
+      const scoped_latency l(update_latency_.get());
+      if (k)
+        prefetch_ahead(state, fmap, begin, i - 1, n, k);
       const size_t t_eff = (round-1)*dataset_size + i + t_offset_;
       const double eta_t = c0_ / (this->model_.get_lambda() * t_eff);
       const auto &x = *it.first();
-      const double dloss = this->model_.get_lossfn().dloss(
-          *it.second(), dot<DoLocking>(x, *state_.get()));
-      const auto inner_it_end = x.end();
-      for (auto inner_it = x.begin();
-           inner_it != inner_it_end; ++inner_it) {
-        const size_t feature_idx = inner_it.tell();
-        const double w_old = state_->unsaferead(feature_idx);
+      double dloss = this->model_.get_lossfn().dloss(
+          *it.second(), dot<DoLocking>(fmap, x, state));
+      if (Weighted)
+        dloss *= sw[it.first().index()];
+      const double lambda = this->model_.get_lambda();
+      fmap.for_each(x, [&](size_t feature_idx, double value) {
+        const double w_old = state.unsaferead(feature_idx);
         assert(feature_counts[feature_idx]);
         const double w_new =
-          (1.0 - eta_t * this->model_.get_lambda() * dataset_sizef /
+          (1.0 - eta_t * lambda * dataset_sizef /
            double(feature_counts[feature_idx])) * w_old
-          - eta_t * dloss * (*inner_it);
+          - eta_t * dloss * value;
         if (DoLocking)
-          state_->writeandunlock(feature_idx, w_new);
+          state.writeandunlock(feature_idx, w_new);
         else
-          state_->unsafewrite(feature_idx, w_new);
-      }
+          state.unsafewrite(feature_idx, w_new);
+      });
       //std::cerr << "[worker " << workerid << ", round " << round << ", item " << i << "]" << std::endl;
     }
     return false;
@@ -231,6 +525,16 @@ private:
   double c0_;
   size_t nworkers_;
   bool do_locking_;
+  mem::page_mode weight_pages_;
+  size_t prefetch_;
+  size_t prefetch_eff_;
+  bool time_updates_;
+  std::unique_ptr<latency_region> update_latency_;
+  bool deterministic_;
+  std::vector<std::unique_ptr<standard_lvec<double>>> local_; // per worker
+  const dense::block *dense_;
+  std::vector<double> decay_;
+  std::vector<double> step_weights_; // empty if unweighted
   std::unique_ptr<standard_lvec<double>> state_;
 };
 
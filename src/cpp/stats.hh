@@ -0,0 +1,321 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <vector>
+
+#include <util.hh>
+#include <vec.hh>
+
+/**
+ * Summary statistics of a feature matrix and its labels, accumulated one
+ * row at a time. Partial results from disjoint sets of rows (e.g. one per
+ * thread) are combined with merge().
+ *
+ * Per-feature statistics are over the stored entries of each row, so a
+ * sparse row contributes only its nonzeros while a dense row contributes
+ * every coordinate (this matches what for_each_nonzero() visits). mean()
+ * and variance() treat entries that were not stored as zeros.
+ *
+ * Only counts are kept per feature unless moments are asked for: min,
+ * max, sum and sum of squares take another 32 bytes per feature, which
+ * adds up with a partial result per thread over millions of features.
+ *
+ * Labels are counted by value while there are few distinct ones (class
+ * labels); real-valued labels only keep their range, mean and variance.
+ */
+class feature_stats {
+public:
+
+  // bucket 0 holds empty rows, bucket b > 0 rows with nnz in [2^(b-1), 2^b)
+  static const size_t NnzBuckets = 65;
+  static const size_t MaxDistinctLabels = 64;
+
+  feature_stats()
+    : moments_(false), nrows_(0), max_row_nnz_(0), max_norm_(0.0),
+      label_min_(std::numeric_limits<double>::infinity()),
+      label_max_(-std::numeric_limits<double>::infinity()),
+      label_sum_(0.0), label_sumsq_(0.0), labels_overflow_(false),
+      row_nnz_hist_(NnzBuckets) {}
+
+  // moments says whether to keep min(), max(), mean() and variance()
+  feature_stats(size_t nfeatures, bool moments)
+    : feature_stats()
+  {
+    moments_ = moments;
+    grow(nfeatures);
+  }
+
+  void
+  add(const vec_t &x, double y)
+  {
+    size_t nnz = 0;
+    double sumsq = 0.0;
+    x.for_each_nonzero([this, &nnz, &sumsq](size_t idx, double value) {
+      if (unlikely(idx >= counts_.size()))
+        grow(idx + 1);
+      counts_[idx]++;
+      if (moments_) {
+        min_[idx] = std::min(min_[idx], value);
+        max_[idx] = std::max(max_[idx], value);
+        sum_[idx] += value;
+        sumsq_[idx] += value * value;
+      }
+      sumsq += value * value;
+      nnz++;
+    });
+    nrows_++;
+    add_label(y, 1);
+    label_min_ = std::min(label_min_, y);
+    label_max_ = std::max(label_max_, y);
+    label_sum_ += y;
+    label_sumsq_ += y * y;
+    row_nnz_hist_[nnz_bucket(nnz)]++;
+    max_row_nnz_ = std::max(max_row_nnz_, nnz);
+    max_norm_ = std::max(max_norm_, sqrt(sumsq));
+  }
+
+  // moments survive only if both sides kept them
+  void
+  merge(const feature_stats &that)
+  {
+    if (!that.moments_)
+      drop_moments();
+    if (that.nfeatures() > nfeatures())
+      grow(that.nfeatures());
+    merge_features(that, 0, that.nfeatures());
+    merge_rows(that);
+  }
+
+  /**
+   * Merges parts[1..] into parts[0]. The per-feature arrays are summed by
+   * feature range, one range per thread, so merging costs one pass over
+   * the features whatever the number of parts.
+   */
+  static void
+  merge_all(std::vector<feature_stats> &parts, size_t nthreads)
+  {
+    if (parts.empty())
+      return;
+    feature_stats &dst = parts[0];
+    size_t nf = 0;
+    for (auto &p : parts) {
+      nf = std::max(nf, p.nfeatures());
+      if (!p.moments_)
+        dst.drop_moments();
+    }
+    dst.grow(nf);
+    nthreads = std::max(size_t(1), std::min(nthreads, nf / 4096));
+    util::parallel_run(nthreads, [&parts, nf, nthreads](size_t t) {
+      const size_t lo = nf * t / nthreads, hi = nf * (t + 1) / nthreads;
+      for (size_t i = 1; i < parts.size(); i++)
+        parts[0].merge_features(
+            parts[i], lo, std::min(hi, parts[i].nfeatures()));
+    });
+    for (size_t i = 1; i < parts.size(); i++)
+      dst.merge_rows(parts[i]);
+  }
+
+  static inline size_t
+  nnz_bucket(size_t nnz)
+  {
+    size_t b = 0;
+    while (nnz) {
+      nnz >>= 1;
+      b++;
+    }
+    return b;
+  }
+
+  inline size_t nrows() const { return nrows_; }
+  inline size_t nfeatures() const { return counts_.size(); }
+  inline bool has_moments() const { return moments_; }
+
+  // number of rows storing feature idx
+  inline const std::vector<size_t> & counts() const { return counts_; }
+
+  // min/max over the stored entries; 0 if the feature never occurs, or
+  // moments weren't kept
+  inline double
+  min(size_t idx) const
+  {
+    return (moments_ && counts_[idx]) ? min_[idx] : 0.0;
+  }
+
+  inline double
+  max(size_t idx) const
+  {
+    return (moments_ && counts_[idx]) ? max_[idx] : 0.0;
+  }
+
+  inline double
+  mean(size_t idx) const
+  {
+    return (moments_ && nrows_) ? sum_[idx] / double(nrows_) : 0.0;
+  }
+
+  inline double
+  variance(size_t idx) const
+  {
+    if (!moments_ || !nrows_)
+      return 0.0;
+    const double m = mean(idx);
+    return std::max(0.0, sumsq_[idx] / double(nrows_) - m * m);
+  }
+
+  // label -> number of rows with that label; empty once there are more
+  // than MaxDistinctLabels distinct labels
+  inline const std::map<double, size_t> & labels() const { return labels_; }
+  inline bool real_labels() const { return labels_overflow_; }
+
+  // over all labels; 0 if there are no rows
+  inline double label_min() const { return nrows_ ? label_min_ : 0.0; }
+  inline double label_max() const { return nrows_ ? label_max_ : 0.0; }
+
+  inline double
+  label_mean() const
+  {
+    return nrows_ ? label_sum_ / double(nrows_) : 0.0;
+  }
+
+  inline double
+  label_variance() const
+  {
+    if (!nrows_)
+      return 0.0;
+    const double m = label_mean();
+    return std::max(0.0, label_sumsq_ / double(nrows_) - m * m);
+  }
+
+  inline const std::vector<size_t> & row_nnz_hist() const { return row_nnz_hist_; }
+  inline size_t max_row_nnz() const { return max_row_nnz_; }
+  inline double max_norm() const { return max_norm_; }
+
+  inline size_t
+  nnz() const
+  {
+    size_t ret = 0;
+    for (auto c : counts_)
+      ret += c;
+    return ret;
+  }
+
+private:
+
+  // features [lo, hi) of that, which this must have room for
+  inline void
+  merge_features(const feature_stats &that, size_t lo, size_t hi)
+  {
+    for (size_t i = lo; i < hi; i++)
+      counts_[i] += that.counts_[i];
+    if (!moments_)
+      return;
+    for (size_t i = lo; i < hi; i++) {
+      min_[i] = std::min(min_[i], that.min_[i]);
+      max_[i] = std::max(max_[i], that.max_[i]);
+      sum_[i] += that.sum_[i];
+      sumsq_[i] += that.sumsq_[i];
+    }
+  }
+
+  // everything but the per-feature arrays
+  void
+  merge_rows(const feature_stats &that)
+  {
+    nrows_ += that.nrows_;
+    for (auto &p : that.labels_)
+      add_label(p.first, p.second);
+    if (that.labels_overflow_) {
+      labels_.clear();
+      labels_overflow_ = true;
+    }
+    label_min_ = std::min(label_min_, that.label_min_);
+    label_max_ = std::max(label_max_, that.label_max_);
+    label_sum_ += that.label_sum_;
+    label_sumsq_ += that.label_sumsq_;
+    for (size_t b = 0; b < NnzBuckets; b++)
+      row_nnz_hist_[b] += that.row_nnz_hist_[b];
+    max_row_nnz_ = std::max(max_row_nnz_, that.max_row_nnz_);
+    max_norm_ = std::max(max_norm_, that.max_norm_);
+  }
+
+  inline void
+  add_label(double y, size_t count)
+  {
+    if (labels_overflow_)
+      return;
+    labels_[y] += count;
+    if (labels_.size() > MaxDistinctLabels) {
+      labels_.clear();
+      labels_overflow_ = true;
+    }
+  }
+
+  inline void
+  drop_moments()
+  {
+    moments_ = false;
+    std::vector<double>().swap(min_);
+    std::vector<double>().swap(max_);
+    std::vector<double>().swap(sum_);
+    std::vector<double>().swap(sumsq_);
+  }
+
+  void
+  grow(size_t nfeatures)
+  {
+    counts_.resize(nfeatures);
+    if (!moments_)
+      return;
+    min_.resize(nfeatures, std::numeric_limits<double>::infinity());
+    max_.resize(nfeatures, -std::numeric_limits<double>::infinity());
+    sum_.resize(nfeatures);
+    sumsq_.resize(nfeatures);
+  }
+
+  bool moments_;
+  size_t nrows_;
+  size_t max_row_nnz_;
+  double max_norm_;
+  std::vector<size_t> counts_;
+  std::vector<double> min_;
+  std::vector<double> max_;
+  std::vector<double> sum_;
+  std::vector<double> sumsq_;
+  double label_min_;
+  double label_max_;
+  double label_sum_;
+  double label_sumsq_;
+  std::map<double, size_t> labels_;
+  bool labels_overflow_;
+  std::vector<size_t> row_nnz_hist_;
+};
+
+static inline std::ostream &
+operator<<(std::ostream &o, const feature_stats &s)
+{
+  o << "{nrows:" << s.nrows()
+    << ", nfeatures:" << s.nfeatures()
+    << ", nnz:" << s.nnz()
+    << ", max_row_nnz:" << s.max_row_nnz()
+    << ", max_norm:" << s.max_norm()
+    << ", labels:";
+  if (s.real_labels()) {
+    o << "{min:" << s.label_min() << ", max:" << s.label_max()
+      << ", mean:" << s.label_mean() << "}}";
+    return o;
+  }
+  o << "[";
+  bool first = true;
+  for (auto &p : s.labels()) {
+    if (!first)
+      o << ", ";
+    first = false;
+    o << "{" << p.first << ":" << p.second << "}";
+  }
+  o << "]}";
+  return o;
+}
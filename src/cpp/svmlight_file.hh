@@ -1,72 +1,119 @@
 #pragma once
 
-#include <fstream>
+#include <cctype>
+#include <cstdlib>
 #include <vector>
 #include <string>
-#include <sstream>
 
 #include <vec.hh>
+#include <line_reader.hh>
+#include <loader.hh>
 
 struct svmlight_file {
 
-// not efficient, and not flexible (doesn't fully support
-// the svmlight format)
+static inline const char *
+skip_blanks(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+// parses a single line [begin, end) (no newline) of the form
+//   label idx:value idx:value ...
+// with 1-based indices. returns false if the line is malformed. a sparse
+// xv is reused in place, so a scratch row keeps its capacity across lines.
+// the label must be 0 (read as -1), -1 or 1 unless real_labels
+//
+// NOTE: the namespaces found in VW-style modified svmlight files are not
+// supported.
+static bool
+parse_line(const char *begin, const char *end, vec_t &xv, double &y,
+           bool real_labels = false)
+{
+  char *q;
+  const char *p = skip_blanks(begin, end);
+  y = strtod(p, &q);
+  if (q == p || q > end)
+    return false;
+  if (!real_labels) {
+    ALWAYS_ASSERT(y == 0.0 || y == 1.0 || y == -1.0);
+    if (y == 0.0)
+      y = -1.0;
+  }
+
+  if (xv.is_sparse())
+    xv.as_sparse_ref().data().clear();
+  else
+    xv = vec_t((vec_t::sparse_tag_t()));
+  p = q;
+  for (;;) {
+    p = skip_blanks(p, end);
+    if (p == end)
+      return true;
+    if (!isdigit(*p))
+      return false;
+    const unsigned long i = strtoul(p, &q, 10);
+    if (q >= end || *q != ':')
+      return false;
+    ALWAYS_ASSERT(i >= 1); // 1-based
+    p = q + 1;
+    const double x = strtod(p, &q);
+    if (q == p || q > end)
+      return false;
+    xv.ensureref(i-1) = x;
+    p = q;
+  }
+}
+
+// not flexible (doesn't fully support the svmlight format)
 //
 // returns 0 on success, -1 on failure
 //
-// also currently loads in *sparse* format
+// also currently loads in *sparse* format. with a sampler in ctx, lines are
+// still parsed in full (to find their label), but only sampled rows are kept
 int
 read_feature_file(
     const std::string &filename,
-    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n) const
+    std::vector<vec_t> &xs, standard_vec_t &ys, unsigned int &n,
+    const load_context &ctx = load_context()) const
 {
-  std::ifstream ifs(filename);
-  std::string line, ns, ns0;
-  std::vector<std::string> toks0, toks1;
+  line_chunk_reader r(filename);
+  std::string chunk;
+  mem::arena * const a = ctx.make_arena();
+  const size_t off = xs.size();
+  std::vector<double> ws;
+  bool ok = true;
   n = 0;
-  while (std::getline(ifs, line)) {
-		std::istringstream l(line);
-
-    // class
-    double y;
-    l >> y;
-    ALWAYS_ASSERT(y == 0.0 || y == 1.0 || y == -1.0);
-
-    // NOTE: this namespace crap is only found in the VW-style modified
-    // svmlight files, so let's just ignore it for now.
-    //
-    //// namespace
-    //if (ns.empty()) {
-    //  l >> ns;
-    //} else {
-    //  l >> ns0;
-    //  if (ns != ns0)
-    //    return -1;
-    //}
-
-    // features
-    vec_t xv((vec_t::sparse_tag_t()));
-    while (l.good()) {
-      int c = l.get();
-      if (isspace(c))
-        continue;
-      unsigned int i;
-      l.unget();
-      l >> std::skipws >> i >> std::ws;
-      if (l.get() != ':')
-        return -1;
-      ALWAYS_ASSERT(i >= 1); // 1-based
-      double x;
-      l >> std::skipws >> x;
-      xv.ensureref(i-1) = x;
-      n = std::max(n, i);
-    }
-
-    xs.push_back(std::move(xv));
-    ys.push_back(y == 0.0 ? -1.0 : y);
+  size_t line = 0;
+  vec_t xv;
+  double y;
+  while (ok && r.next(chunk)) {
+    for_each_line(chunk.data(), chunk.data() + chunk.size(),
+        [&](const char *begin, const char *end) {
+      if (!ok)
+        return;
+      if (!parse_line(begin, end, xv, y, ctx.real_labels)) {
+        ok = false;
+        return;
+      }
+      if (!ctx.keep(line++, y))
+        return;
+      if (ctx.sampler && ctx.weights)
+        ws.push_back(ctx.sampler->weight(y));
+      n = std::max(size_t(n), xv.highest_nonzero_dim());
+      if (ctx.stats)
+        ctx.stats->add(xv, y);
+      if (a)
+        xs.emplace_back(xv, a);
+      else
+        xs.push_back(std::move(xv));
+      ys.push_back(y);
+    });
   }
-
-  return 0;
+  if (ok && ctx.sampler && ctx.weights)
+    ctx.set_weights(off, ws);
+  return ok ? 0 : -1;
 }
 
 };
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <macros.hh>
+#include <timer.hh>
+#include <util.hh>
+
+/**
+ * Structured telemetry of training runs.
+ *
+ * Optimizers emit() fixed-size records (a metric name, round, worker and
+ * value) into a collector, which queues them in a bounded lock-free ring.
+ * A background thread drains the ring periodically and hands the records
+ * to the sinks: a JSON-lines file, and/or a Prometheus-style text
+ * exposition of the latest values served on a local port. emit() neither
+ * blocks nor allocates; when the ring is full the record is dropped and
+ * counted instead.
+ */
+namespace telemetry {
+
+static const int NoWorker = -1;
+
+struct record {
+  uint64_t ts_usec;
+  const char *name; // must outlive the collector, e.g. a string literal
+  uint64_t round;
+  int worker;
+  double value;
+};
+
+class sink {
+public:
+  virtual ~sink() {}
+  virtual void write(const record *rs, size_t n) = 0;
+  virtual void flush() {}
+};
+
+// one JSON object per record and line
+class jsonl_sink : public sink {
+public:
+  jsonl_sink(const std::string &path)
+    : out_(path)
+  {
+    if (!out_)
+      throw std::runtime_error("could not open telemetry file: " + path);
+    out_.precision(10);
+  }
+
+  void
+  write(const record *rs, size_t n) OVERRIDE
+  {
+    for (size_t i = 0; i < n; i++) {
+      const record &r = rs[i];
+      out_ << "{\"ts_usec\":" << r.ts_usec
+           << ",\"name\":\"" << r.name << "\""
+           << ",\"round\":" << r.round;
+      if (r.worker != NoWorker)
+        out_ << ",\"worker\":" << r.worker;
+      out_ << ",\"value\":";
+      if (util::finite_bits(r.value))
+        out_ << r.value;
+      else
+        out_ << "null";
+      out_ << "}\n";
+    }
+  }
+
+  void flush() OVERRIDE { out_.flush(); }
+
+private:
+  std::ofstream out_;
+};
+
+/**
+ * Serves the latest value of every (metric, worker) as a gauge, in the
+ * Prometheus text format, to any connection on 127.0.0.1:port.
+ */
+class exposition_sink : public sink {
+public:
+  exposition_sink(uint16_t port, const std::string &prefix = "tlearn")
+    : prefix_(prefix), stop_(false)
+  {
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0)
+      throw std::runtime_error("telemetry: socket() failed");
+    const int one = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ||
+        listen(fd_, 8)) {
+      close(fd_);
+      throw std::runtime_error(
+          "telemetry: cannot listen on port " + std::to_string(port));
+    }
+    server_ = std::thread(&exposition_sink::serve, this);
+  }
+
+  ~exposition_sink()
+  {
+    stop_.store(true);
+    server_.join();
+    close(fd_);
+  }
+
+  void
+  write(const record *rs, size_t n) OVERRIDE
+  {
+    std::lock_guard<std::mutex> l(mutex_);
+    for (size_t i = 0; i < n; i++)
+      latest_[std::make_pair(std::string(rs[i].name), rs[i].worker)] =
+        rs[i].value;
+  }
+
+private:
+  std::string
+  render() const
+  {
+    std::ostringstream o;
+    o.precision(12);
+    std::lock_guard<std::mutex> l(mutex_);
+    const std::string *last = nullptr;
+    for (const auto &kv : latest_) {
+      const std::string name = prefix_ + "_" + kv.first.first;
+      if (!last || *last != kv.first.first)
+        o << "# TYPE " << name << " gauge\n";
+      last = &kv.first.first;
+      o << name;
+      if (kv.first.second != NoWorker)
+        o << "{worker=\"" << kv.first.second << "\"}";
+      o << " ";
+      // the text format spells non-finite values NaN, +Inf and -Inf
+      if (util::finite_bits(kv.second))
+        o << kv.second;
+      else if (util::nan_bits(kv.second))
+        o << "NaN";
+      else
+        o << (kv.second > 0.0 ? "+Inf" : "-Inf");
+      o << "\n";
+    }
+    return o.str();
+  }
+
+  void
+  serve()
+  {
+    while (!stop_.load()) {
+      struct pollfd p;
+      p.fd = fd_;
+      p.events = POLLIN;
+      p.revents = 0;
+      if (poll(&p, 1, PollMs) <= 0)
+        continue;
+      const int c = accept(fd_, nullptr, nullptr);
+      if (c < 0)
+        continue;
+      // a client that sends nothing, or stops reading, must not hold up
+      // the server, nor its shutdown
+      struct timeval tv;
+      tv.tv_sec = ClientTimeoutMs / 1000;
+      tv.tv_usec = (ClientTimeoutMs % 1000) * 1000;
+      setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      if (!wait_readable(c)) {
+        close(c);
+        continue;
+      }
+      // the request itself doesn't matter, every path gets the metrics
+      char buf[1024];
+      if (recv(c, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+        const std::string body = render();
+        const std::string resp =
+          "HTTP/1.0 200 OK\r\n"
+          "Content-Type: text/plain; version=0.0.4\r\n"
+          "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" +
+          body;
+        for (size_t off = 0; off < resp.size(); ) {
+          const ssize_t r =
+            send(c, resp.data() + off, resp.size() - off, MSG_NOSIGNAL);
+          if (r <= 0)
+            break;
+          off += r;
+        }
+      }
+      close(c);
+    }
+  }
+
+  // whether c has data within ClientTimeoutMs, polling in slices that
+  // check stop_
+  bool
+  wait_readable(int c) const
+  {
+    for (uint64_t waited = 0; waited < ClientTimeoutMs && !stop_.load();
+         waited += PollMs) {
+      struct pollfd p;
+      p.fd = c;
+      p.events = POLLIN;
+      p.revents = 0;
+      if (poll(&p, 1, PollMs) > 0)
+        return true;
+    }
+    return false;
+  }
+
+  static const uint64_t ClientTimeoutMs = 1000;
+  static const int PollMs = 100;
+
+  std::string prefix_;
+  int fd_;
+  std::atomic<bool> stop_;
+  std::thread server_;
+  mutable std::mutex mutex_;
+  std::map<std::pair<std::string, int>, double> latest_;
+};
+
+class collector {
+public:
+  collector(std::vector<std::unique_ptr<sink>> &&sinks,
+            size_t capacity = 1 << 16,
+            uint64_t period_ms = 100)
+    : sinks_(std::move(sinks)),
+      mask_(round_up_pow2(capacity) - 1),
+      cells_(new cell[mask_ + 1]),
+      head_(0), tail_(0), dropped_(0),
+      period_ms_(period_ms), stop_(false)
+  {
+    for (size_t i = 0; i <= mask_; i++)
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    drainer_ = std::thread(&collector::drain_loop, this);
+  }
+
+  collector(const collector &) = delete;
+  collector &operator=(const collector &) = delete;
+
+  // drains and flushes whatever was emitted before
+  ~collector()
+  {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    drainer_.join();
+    if (const uint64_t n = dropped()) {
+      const record r{now_usec(), "telemetry_dropped", 0, NoWorker, double(n)};
+      for (auto &s : sinks_) {
+        s->write(&r, 1);
+        s->flush();
+      }
+    }
+  }
+
+  // safe from any thread; returns false if the record had to be dropped
+  inline bool
+  emit(const char *name, uint64_t round, double value,
+       int worker = NoWorker)
+  {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    cell *c;
+    for (;;) {
+      c = &cells_[pos & mask_];
+      const size_t seq = c->seq.load(std::memory_order_acquire);
+      const intptr_t dif = intptr_t(seq) - intptr_t(pos);
+      if (dif == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+    c->r = record{now_usec(), name, round, worker, value};
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline uint64_t
+  dropped() const
+  {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  static inline uint64_t
+  now_usec()
+  {
+    return timer::cur_usec(timer::T_CLK_GETTIMEOFDAY);
+  }
+
+private:
+  struct cell {
+    std::atomic<size_t> seq;
+    record r;
+  };
+
+  static size_t
+  round_up_pow2(size_t n)
+  {
+    size_t p = 1;
+    while (p < n)
+      p <<= 1;
+    return p;
+  }
+
+  // only ever called from the drainer
+  void
+  drain()
+  {
+    batch_.clear();
+    for (;;) {
+      cell &c = cells_[tail_ & mask_];
+      if (c.seq.load(std::memory_order_acquire) != tail_ + 1)
+        break;
+      batch_.push_back(c.r);
+      c.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+      tail_++;
+    }
+    if (batch_.empty())
+      return;
+    for (auto &s : sinks_) {
+      s->write(batch_.data(), batch_.size());
+      s->flush();
+    }
+  }
+
+  void
+  drain_loop()
+  {
+    std::unique_lock<std::mutex> l(mutex_);
+    for (;;) {
+      const bool stop = cv_.wait_for(l,
+          std::chrono::milliseconds(period_ms_), [this] { return stop_; });
+      l.unlock();
+      drain();
+      if (stop)
+        return;
+      l.lock();
+    }
+  }
+
+  std::vector<std::unique_ptr<sink>> sinks_;
+  const size_t mask_;
+  std::unique_ptr<cell[]> cells_;
+  CACHE_PADOUT;
+  std::atomic<size_t> head_;
+  CACHE_PADOUT;
+  size_t tail_;
+  std::atomic<uint64_t> dropped_;
+  std::vector<record> batch_;
+  uint64_t period_ms_;
+  bool stop_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread drainer_;
+};
+
+// the resident set size of the process, 0 where unknown
+static inline uint64_t
+rss_bytes()
+{
+#ifdef __linux__
+  std::ifstream f("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+  if (f >> size >> resident)
+    return resident * uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+  return 0;
+}
+
+// emits the time a worker spent on a round, and its rate, when it goes
+// out of scope; does nothing without a collector
+class scoped_work {
+public:
+  scoped_work(collector *c, uint64_t round, int worker, size_t nrows)
+    : c_(c), round_(round), worker_(worker), nrows_(nrows),
+      start_(c ? collector::now_usec() : 0)
+  {}
+
+  ~scoped_work()
+  {
+    if (!c_)
+      return;
+    const double ms = (collector::now_usec() - start_) / 1000.0;
+    c_->emit("worker_ms", round_, ms, worker_);
+    if (ms > 0.0)
+      c_->emit("worker_rows_per_sec", round_, nrows_ / (ms / 1000.0), worker_);
+  }
+
+private:
+  collector *c_;
+  uint64_t round_;
+  int worker_;
+  size_t nrows_;
+  uint64_t start_;
+};
+
+} // namespace telemetry
@@ -1,18 +1,111 @@
 #pragma once
 
 #include <sys/time.h>
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
 #include <ctime>
 #include <cstdint>
 #include <string>
 #include <iostream>
 #include <macros.hh>
+#include <util.hh>
 
 #if defined(__APPLE__) && defined(__MACH__)
 #include <mach/clock.h>
 #include <mach/mach.h>
 #endif
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <amd64.hh>
+#define HAVE_TSC 1
+#endif
+
+#ifndef CLOCK_MONOTONIC_RAW
+#define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
+#endif
+
+/**
+ * A cheap nanosecond clock for timing short regions: the TSC, calibrated
+ * once against CLOCK_MONOTONIC_RAW, where the CPU advertises an invariant
+ * one (constant rate across frequency changes and synchronized between
+ * cores); otherwise CLOCK_MONOTONIC_RAW itself, which is served by the
+ * vDSO on Linux. Differences of ticks() scale to nanoseconds by
+ * nsec_per_tick().
+ */
+class tsc_clock {
+public:
+  static inline uint64_t
+  raw_nsec()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+  }
+
+  static inline uint64_t
+  ticks()
+  {
+#ifdef HAVE_TSC
+    if (likely(get().invariant_))
+      return rdtsc();
+#endif
+    return raw_nsec();
+  }
+
+  static inline double nsec_per_tick() { return get().nsec_per_tick_; }
+  static inline bool uses_tsc() { return get().invariant_; }
+
+  static inline uint64_t
+  nsec()
+  {
+    const calibration &c = get();
+    if (!c.invariant_)
+      return raw_nsec();
+    return c.base_nsec_ + uint64_t(double(ticks() - c.base_ticks_) * c.nsec_per_tick_);
+  }
+
+private:
+  struct calibration {
+    calibration()
+      : invariant_(false), nsec_per_tick_(1.0), base_ticks_(0), base_nsec_(0)
+    {
+#ifdef HAVE_TSC
+      unsigned eax, ebx, ecx, edx;
+      if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8)))
+        return;
+      // 10ms against the raw clock bounds the rate's error to ~1e-5
+      const uint64_t t0 = raw_nsec(), c0 = rdtsc();
+      uint64_t t1, c1;
+      do {
+        t1 = raw_nsec();
+        c1 = rdtsc();
+      } while (t1 - t0 < 10000000);
+      if (c1 <= c0)
+        return;
+      invariant_ = true;
+      nsec_per_tick_ = double(t1 - t0) / double(c1 - c0);
+      base_ticks_ = c1;
+      base_nsec_ = t1;
+#endif
+    }
+
+    bool invariant_;
+    double nsec_per_tick_;
+    uint64_t base_ticks_;
+    uint64_t base_nsec_;
+  };
+
+  static inline const calibration &
+  get()
+  {
+    static const calibration c;
+    return c;
+  }
+};
+
 class timer {
 private:
   timer(const timer &) = delete;
@@ -21,7 +114,10 @@ private:
 
 public:
 
-  enum Mode { T_CLK_GETTIMEOFDAY, T_CLK_REALTIME };
+  // T_CLK_REALTIME is the wall clock, which can jump; the other modes are
+  // monotonic, and T_CLK_MONOTONIC_RAW and T_CLK_TSC have nanosecond
+  // resolution (see tsc_clock)
+  enum Mode { T_CLK_GETTIMEOFDAY, T_CLK_REALTIME, T_CLK_MONOTONIC_RAW, T_CLK_TSC };
 
   timer(Mode m = T_CLK_GETTIMEOFDAY)
     : m_(m)
@@ -31,20 +127,32 @@ public:
 
   inline uint64_t
   elapsed_usec() const
+  {
+    return elapsed_nsec() / 1000;
+  }
+
+  inline uint64_t
+  elapsed_nsec() const
   {
     compiler_barrier();
     const uint64_t t0 = start_;
-    const uint64_t t1 = cur_usec(m_);
+    const uint64_t t1 = cur_nsec(m_);
     compiler_barrier();
     return t1 - t0;
   }
 
   inline uint64_t
   lap()
+  {
+    return lap_nsec() / 1000;
+  }
+
+  inline uint64_t
+  lap_nsec()
   {
     compiler_barrier();
     const uint64_t t0 = start_;
-    const uint64_t t1 = cur_usec(m_);
+    const uint64_t t1 = cur_nsec(m_);
     start_ = t1;
     compiler_barrier();
     return t1 - t0;
@@ -59,21 +167,36 @@ public:
   inline double
   lap_ms()
   {
-    return lap() / 1000.0;
+    return lap_nsec() / 1000000.0;
   }
 
   static inline uint64_t
   cur_usec(Mode m)
   {
-    if (m == T_CLK_GETTIMEOFDAY) {
-      struct timeval tv;
-      gettimeofday(&tv, 0);
-      return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
-    } else {
-      assert(m == T_CLK_REALTIME);
-      struct timespec ts;
-      current_utc_time(&ts);
-      return ((uint64_t)ts.tv_sec) * 1000000 + (((uint64_t)ts.tv_nsec) / 1000);
+    return cur_nsec(m) / 1000;
+  }
+
+  static inline uint64_t
+  cur_nsec(Mode m)
+  {
+    switch (m) {
+    case T_CLK_GETTIMEOFDAY:
+      {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return (((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec) * 1000;
+      }
+    case T_CLK_REALTIME:
+      {
+        struct timespec ts;
+        current_utc_time(&ts);
+        return ((uint64_t)ts.tv_sec) * 1000000000 + (uint64_t)ts.tv_nsec;
+      }
+    case T_CLK_MONOTONIC_RAW:
+      return tsc_clock::raw_nsec();
+    default:
+      assert(m == T_CLK_TSC);
+      return tsc_clock::nsec();
     }
   }
 
@@ -120,3 +243,145 @@ public:
     }
   }
 };
+
+/**
+ * A histogram of latencies in nanoseconds, log-linear: exact below 16ns,
+ * then 16 buckets per power of two, so percentiles are within 1/16 of the
+ * true value. Fixed size, so add() never allocates.
+ */
+class latency_histogram {
+public:
+  static const size_t SubBits = 4;
+  static const size_t NBuckets = (64 - SubBits + 1) << SubBits;
+
+  latency_histogram()
+    : count_(0), sum_(0), min_(UINT64_MAX), max_(0)
+  {
+    buckets_.fill(0);
+  }
+
+  inline void
+  add(uint64_t nsec)
+  {
+    buckets_[bucket(nsec)]++;
+    count_++;
+    sum_ += nsec;
+    min_ = std::min(min_, nsec);
+    max_ = std::max(max_, nsec);
+  }
+
+  void
+  merge(const latency_histogram &o)
+  {
+    for (size_t i = 0; i < NBuckets; i++)
+      buckets_[i] += o.buckets_[i];
+    count_ += o.count_;
+    sum_ += o.sum_;
+    min_ = std::min(min_, o.min_);
+    max_ = std::max(max_, o.max_);
+  }
+
+  inline uint64_t count() const { return count_; }
+  inline uint64_t min() const { return count_ ? min_ : 0; }
+  inline uint64_t max() const { return max_; }
+  inline double mean() const { return count_ ? double(sum_) / double(count_) : 0.0; }
+
+  // the smallest bucket bound with at least p percent of the samples
+  // at or below it, clamped to the samples seen
+  uint64_t
+  percentile(double p) const
+  {
+    if (!count_)
+      return 0;
+    const uint64_t rank =
+      std::max(uint64_t(1), uint64_t(std::ceil(p / 100.0 * double(count_))));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NBuckets; i++) {
+      seen += buckets_[i];
+      if (seen >= rank)
+        return std::max(min(), std::min(max(), upper_bound(i)));
+    }
+    return max();
+  }
+
+private:
+  static inline size_t
+  bucket(uint64_t v)
+  {
+    if (v < (1u << SubBits))
+      return v;
+    const size_t e = 63 - __builtin_clzll(v);
+    const size_t sub = (v >> (e - SubBits)) & ((1u << SubBits) - 1);
+    return ((e - SubBits + 1) << SubBits) + sub;
+  }
+
+  // the largest value falling in bucket i
+  static inline uint64_t
+  upper_bound(size_t i)
+  {
+    if (i < (1u << SubBits))
+      return i;
+    const size_t e = (i >> SubBits) + SubBits - 1;
+    const uint64_t sub = i & ((1u << SubBits) - 1);
+    const uint64_t lo = ((uint64_t(1) << SubBits) + sub) << (e - SubBits);
+    return lo + (uint64_t(1) << (e - SubBits)) - 1;
+  }
+
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+  std::array<uint64_t, NBuckets> buckets_;
+};
+
+inline std::ostream &
+operator<<(std::ostream &o, const latency_histogram &h)
+{
+  o << "{count=" << h.count() << ", mean_ns=" << h.mean()
+    << ", p50_ns=" << h.percentile(50) << ", p90_ns=" << h.percentile(90)
+    << ", p99_ns=" << h.percentile(99) << ", max_ns=" << h.max() << "}";
+  return o;
+}
+
+/**
+ * Latencies of a region of code, kept in one histogram per thread so that
+ * recording is a couple of TSC reads and an uncontended increment; see
+ * scoped_latency. summary() must not race with the recording threads.
+ */
+class latency_region {
+public:
+  inline void
+  add_ticks(uint64_t ticks)
+  {
+    hists_.my().add(uint64_t(double(ticks) * tsc_clock::nsec_per_tick()));
+  }
+
+  latency_histogram
+  summary()
+  {
+    latency_histogram ret;
+    hists_.for_each([&ret](latency_histogram &h) { ret.merge(h); });
+    return ret;
+  }
+
+private:
+  util::per_thread<latency_histogram> hists_;
+};
+
+// times its own scope into region, if not null
+class scoped_latency {
+public:
+  scoped_latency(latency_region *region)
+    : region_(region), start_(region ? tsc_clock::ticks() : 0)
+  {}
+
+  ~scoped_latency()
+  {
+    if (region_)
+      region_->add_ticks(tsc_clock::ticks() - start_);
+  }
+
+private:
+  latency_region *region_;
+  uint64_t start_;
+};
@@ -12,11 +12,16 @@
 #include <ascii_file.hh>
 #include <binary_file.hh>
 #include <svmlight_file.hh>
+#include <loader.hh>
+#include <sampling.hh>
 #include <dataset.hh>
 #include <vec.hh>
 #include <pretty_printers.hh>
 #include <loss_functions.hh>
 #include <metrics.hh>
+#include <kernels.hh>
+#include <feature_maps.hh>
+#include <telemetry.hh>
 #include <timer.hh>
 #include <gd.hh>
 #include <sgd.hh>
@@ -29,18 +34,19 @@ using namespace loss_functions;
 typedef default_random_engine PRNG;
 typedef vector<vec_t> matrix_t;
 
+// regression models are scored on their raw margins, classifiers on the
+// sign of them and on how well the margins rank and fit the labels; both
+// from a single prediction pass over each dataset
 template <typename Clf>
 static void
 evalclf(const Clf &clf,
         const dataset &training,
-        const dataset &testing)
+        const dataset &testing,
+        bool regression,
+        size_t at_k)
 {
-  const auto train_predictions = clf.get_model().predict(training);
-  const auto test_predictions  = clf.get_model().predict(testing);
-
-  metrics::accuracy eval;
-  const double train_acc = eval.score(training.get_y(), train_predictions);
-  const double test_acc  = eval.score(testing.get_y(), test_predictions);
+  const auto train_margins = clf.get_model().predict_margin(training);
+  const auto test_margins = clf.get_model().predict_margin(testing);
 
   if (clf.get_model().weightvec().size() <= 100)
     cout << "[INFO] w: " << clf.get_model().weightvec() << endl;
@@ -51,20 +57,43 @@ evalclf(const Clf &clf,
   cout << "[INFO] empirical risk: " << clf.get_model().empirical_risk(training) << endl;
   cout << "[INFO] norm gradient: " << clf.get_model().norm_grad_empirical_risk(training) << endl;
   cout << "[INFO] classifier: " << clf.jsonconfig() << endl;
-  cout << "[INFO] acc on train: " << train_acc << endl;
-  cout << "[INFO] acc on test: " << test_acc << endl;
+  if (regression) {
+    metrics::rmse rmse;
+    metrics::mae mae;
+    cout << "[INFO] rmse on train: " << rmse.score(
+        training.get_y(), train_margins, training.get_weights()) << endl;
+    cout << "[INFO] rmse on test: " << rmse.score(
+        testing.get_y(), test_margins, testing.get_weights()) << endl;
+    cout << "[INFO] mae on train: " << mae.score(
+        training.get_y(), train_margins, training.get_weights()) << endl;
+    cout << "[INFO] mae on test: " << mae.score(
+        testing.get_y(), test_margins, testing.get_weights()) << endl;
+    return;
+  }
+  metrics::accuracy eval;
+  cout << "[INFO] acc on train: " << eval.score(
+      training.get_y(), train_margins.sign(), training.get_weights()) << endl;
+  cout << "[INFO] acc on test: " << eval.score(
+      testing.get_y(), test_margins.sign(), testing.get_weights()) << endl;
+  const metrics::binary_report train_report(
+      training.get_y(), train_margins, training.get_weights(), at_k);
+  const metrics::binary_report test_report(
+      testing.get_y(), test_margins, testing.get_weights(), at_k);
+  cout << "[INFO] metrics on train: " << train_report << endl;
+  cout << "[INFO] metrics on test: " << test_report << endl;
 }
 
 template <typename Clf>
 static void
-execclf(Clf &clf, const dataset &training, const dataset &testing)
+execclf(Clf &clf, const dataset &training, const dataset &testing,
+        bool regression, size_t at_k)
 {
   {
     scoped_timer t("training phase");
     clf.fit(training);
   }
   cerr << "evalution phase..." << endl;
-  evalclf(clf, training, testing);
+  evalclf(clf, training, testing, regression, at_k);
 }
 
 enum class ClfType { CLF_GD, CLF_SGD_NOLOCK, CLF_SGD_LOCK };
@@ -81,32 +110,118 @@ clftype_str(ClfType t)
   }
 }
 
-template <typename LossFn>
+// how go() trains and evaluates
+struct train_options {
+  ClfType clftype;
+  double lambda;
+  size_t nrounds;
+  size_t nworkers;
+  size_t offset;
+  mem::page_mode weight_pages;
+  size_t prefetch;
+  bool regression;
+  size_t at_k;
+  shared_ptr<telemetry::collector> telemetry;
+  bool time_updates;
+  uint64_t seed;
+  bool deterministic;
+  string kernel; // empty for a linear model
+  double kernel_sigma;
+  size_t kernel_dim; // fourier features, or nystrom landmarks
+  unsigned kernel_degree;
+  double kernel_offset;
+  unsigned interaction_bits; // 0 for no feature crosses
+};
+
+template <typename Model>
 static void
-go(const dataset &training, const dataset &testing,
-   ClfType clftype, double lambda,
-   size_t nrounds, size_t nworkers, size_t offset)
+run(const Model &model, const shared_ptr<PRNG> &prng,
+    const dataset &training, const dataset &testing,
+    const train_options &o)
 {
-  const unsigned seed =
-    chrono::system_clock::now().time_since_epoch().count();
-  shared_ptr<PRNG> prng(new PRNG(seed));
-
-  typedef linear_model<LossFn> Model;
-  Model model(lambda);
-
-  if (clftype == ClfType::CLF_GD) {
+  if (o.clftype == ClfType::CLF_GD) {
     opt::gd<Model, PRNG> clf(
-        model, nrounds, prng, offset, 1.0, true);
-    execclf(clf, training, testing);
-  } else if (clftype == ClfType::CLF_SGD_NOLOCK) {
-    opt::parsgd<Model, PRNG> clf(
-        model, nrounds, prng, nworkers, false, offset, 1.0, true);
-    execclf(clf, training, testing);
-  } else /* if (clftype == ClfType::CLF_SGD_LOCK) */ {
+        model, o.nrounds, prng, o.offset, 1.0, true);
+    clf.set_telemetry(o.telemetry);
+    execclf(clf, training, testing, o.regression, o.at_k);
+  } else {
     opt::parsgd<Model, PRNG> clf(
-        model, nrounds, prng, nworkers, true, offset, 1.0, true);
-    execclf(clf, training, testing);
+        model, o.nrounds, prng, o.nworkers,
+        o.clftype == ClfType::CLF_SGD_LOCK, o.offset, 1.0, true,
+        o.weight_pages, o.prefetch);
+    clf.set_telemetry(o.telemetry);
+    clf.set_time_updates(o.time_updates);
+    clf.set_deterministic(o.deterministic);
+    execclf(clf, training, testing, o.regression, o.at_k);
+  }
+}
+
+// random Fourier features of a kernel over the input dimension of both
+// datasets, sampled in parallel
+template <typename LossFn, typename Kernel>
+static void
+run_kernelized(const shared_ptr<PRNG> &prng,
+               const dataset &training, const dataset &testing,
+               const train_options &o)
+{
+  kernelized_linear_model<LossFn, Kernel> model(
+      o.lambda, LossFn(), Kernel(o.kernel_sigma));
+  const size_t xdim = max(training.get_x_shape().second,
+                          testing.get_x_shape().second);
+  {
+    scoped_timer t("sampling fourier features");
+    model.initialize(*prng, xdim, o.kernel_dim);
+  }
+  run(model, prng, training, testing, o);
+}
+
+// the nystrom approximation of a kernel, with landmarks sampled from the
+// training rows
+template <typename LossFn, typename Kernel>
+static void
+run_nystrom(const Kernel &kernel, const shared_ptr<PRNG> &prng,
+            const dataset &training, const dataset &testing,
+            const train_options &o)
+{
+  nystrom_linear_model<LossFn, Kernel> model(o.lambda, LossFn(), kernel);
+  {
+    scoped_timer t("factoring nystrom landmarks");
+    model.initialize(*prng, training, o.kernel_dim);
   }
+  cerr << "[INFO] nystrom landmarks=" << model.get_nlandmarks()
+       << ", jitter=" << model.get_jitter() << endl;
+  run(model, prng, training, testing, o);
+}
+
+template <typename LossFn>
+static void
+go(const dataset &training, const dataset &testing, const train_options &o)
+{
+  shared_ptr<PRNG> prng(new PRNG(o.seed));
+  if (o.kernel.empty() && o.interaction_bits) {
+    // pairwise crosses of the features of both datasets, hashed on the fly
+    const size_t xdim = max(training.get_x_shape().second,
+                            testing.get_x_shape().second);
+    run(linear_model<LossFn, feature_maps::interaction_map>(
+          o.lambda, LossFn(),
+          feature_maps::interaction_map(xdim, o.interaction_bits)),
+        prng, training, testing, o);
+  } else if (o.kernel.empty())
+    run(linear_model<LossFn>(o.lambda), prng, training, testing, o);
+  else if (o.kernel == "rbf")
+    run_kernelized<LossFn, kernels::rbf_kernel>(prng, training, testing, o);
+  else if (o.kernel == "laplacian")
+    run_kernelized<LossFn, kernels::laplacian_kernel>(prng, training, testing, o);
+  else if (o.kernel == "cauchy")
+    run_kernelized<LossFn, kernels::cauchy_kernel>(prng, training, testing, o);
+  else if (o.kernel == "poly")
+    run_nystrom<LossFn>(
+        kernels::polynomial_kernel(o.kernel_sigma, o.kernel_degree, o.kernel_offset),
+        prng, training, testing, o);
+  else /* if (o.kernel == "arccos") */
+    run_nystrom<LossFn>(
+        kernels::arccos_kernel(o.kernel_sigma, o.kernel_degree),
+        prng, training, testing, o);
 }
 
 template <typename Loader>
@@ -114,21 +229,41 @@ static void
 load(const string &training_file, const string &testing_file,
      matrix_t &xtrain, standard_vec_t &ytrain,
      matrix_t &xtest, standard_vec_t &ytest,
+     standard_vec_t &wtrain, standard_vec_t &wtest,
+     feature_stats &stats_train, feature_stats &stats_test,
+     shared_ptr<mem::arena_pool> &arenas_train,
+     shared_ptr<mem::arena_pool> &arenas_test,
+     const stratified_sampler *sampler,
+     bool real_labels,
      Loader loader = Loader())
 {
   unsigned int nfeatures_train, nfeatures_test;
+  load_context ctx;
+  ctx.real_labels = real_labels;
   {
     scoped_timer t("load training");
-    if (loader.read_feature_file(training_file, xtrain, ytrain, nfeatures_train))
+    ctx.stats = &stats_train;
+    ctx.weights = &wtrain;
+    ctx.sampler = sampler;
+    ctx.arenas = arenas_train = make_shared<mem::arena_pool>();
+    if (loader.read_feature_file(training_file, xtrain, ytrain, nfeatures_train, ctx))
       throw runtime_error("could not read training file");
   }
   cout << "[INFO] training set n=" << xtrain.size() << endl;
   {
     scoped_timer t("load testing");
-    if (loader.read_feature_file(testing_file, xtest, ytest, nfeatures_test))
+    ctx.stats = &stats_test;
+    ctx.weights = &wtest;
+    ctx.sampler = nullptr;
+    ctx.arenas = arenas_test = make_shared<mem::arena_pool>();
+    if (loader.read_feature_file(testing_file, xtest, ytest, nfeatures_test, ctx))
       throw runtime_error("could not read testing file");
   }
   cout << "[INFO] testing set n=" << xtest.size() << endl;
+  cout << "[INFO] row arenas: "
+       << (arenas_train->reserved() + arenas_test->reserved()) / (1 << 20)
+       << " MB in " << (arenas_train->size() + arenas_test->size())
+       << " arenas" << endl;
 }
 
 int
@@ -143,6 +278,27 @@ main(int argc, char **argv)
   size_t nrounds = 1;
   size_t offset = 0;
   size_t nworkers = 1;
+  bool packed_rows = false;
+  mem::page_mode weight_pages = mem::page_mode::NONE;
+  size_t prefetch = opt::PrefetchAuto;
+  double sample_neg = 1.0, sample_pos = 1.0;
+  uint64_t sample_seed = 0;
+  bool regression = false;
+  size_t at_k = 1000;
+  string telemetry_file;
+  int telemetry_port = -1;
+  bool time_updates = false;
+  bool seeded = false, sample_seeded = false;
+  uint64_t seed = 0;
+  bool deterministic = false;
+  string kernel;
+  double kernel_sigma = 1.0;
+  size_t kernel_dim = 1000;
+  unsigned kernel_degree = 2;
+  double kernel_offset = 1.0;
+  unsigned interaction_bits = 0;
+  size_t transform_cache_mb = 0;
+  bool transform_cache_float = false;
   while (1) {
     static struct option long_options[] =
     {
@@ -158,10 +314,31 @@ main(int argc, char **argv)
       {"threads"                , required_argument , 0 , 'w'} ,
       {"loss"                   , required_argument , 0 , 'f'} ,
       {"clf"                    , required_argument , 0 , 'g'} ,
+      {"packed-rows"            , no_argument       , 0 , 'p'} ,
+      {"weight-pages"           , required_argument , 0 , 'H'} ,
+      {"prefetch"               , required_argument , 0 , 'P'} ,
+      {"sample-neg"             , required_argument , 0 , 'N'} ,
+      {"sample-pos"             , required_argument , 0 , 'S'} ,
+      {"sample-seed"            , required_argument , 0 , 's'} ,
+      {"regression"             , no_argument       , 0 , 'R'} ,
+      {"at-k"                   , required_argument , 0 , 'k'} ,
+      {"telemetry-file"         , required_argument , 0 , 'T'} ,
+      {"telemetry-port"         , required_argument , 0 , 'e'} ,
+      {"time-updates"           , no_argument       , 0 , 'L'} ,
+      {"seed"                   , required_argument , 0 , 'Z'} ,
+      {"deterministic"          , no_argument       , 0 , 'D'} ,
+      {"kernel"                 , required_argument , 0 , 'K'} ,
+      {"bandwidth"              , required_argument , 0 , 'B'} ,
+      {"kernel-dim"             , required_argument , 0 , 'F'} ,
+      {"kernel-degree"          , required_argument , 0 , 'Q'} ,
+      {"kernel-offset"          , required_argument , 0 , 'O'} ,
+      {"transform-cache"        , required_argument , 0 , 'C'} ,
+      {"transform-cache-float"  , no_argument       , 0 , 'A'} ,
+      {"interaction-bits"       , required_argument , 0 , 'X'} ,
       {0, 0, 0, 0}
     };
     int option_index = 0;
-    int c = getopt_long(argc, argv, "r:t:a:b:c:d:l:n:o:w:f:g:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "r:t:a:b:c:d:l:n:o:w:f:g:pH:P:N:S:s:Rk:T:e:LZ:DK:B:F:Q:O:C:AX:", long_options, &option_index);
     if (c == -1)
       break;
 
@@ -230,6 +407,93 @@ main(int argc, char **argv)
       }
       break;
 
+    case 'p':
+      packed_rows = true;
+      break;
+
+    case 'H':
+      weight_pages = mem::page_mode_from_str(optarg);
+      break;
+
+    case 'P':
+      if (string(optarg) != "auto")
+        prefetch = strtoul(optarg, nullptr, 10);
+      break;
+
+    case 'N':
+      sample_neg = strtod(optarg, nullptr);
+      break;
+
+    case 'S':
+      sample_pos = strtod(optarg, nullptr);
+      break;
+
+    case 's':
+      sample_seed = strtoull(optarg, nullptr, 10);
+      sample_seeded = true;
+      break;
+
+    case 'R':
+      regression = true;
+      break;
+
+    case 'k':
+      at_k = strtoull(optarg, nullptr, 10);
+      break;
+
+    case 'T':
+      telemetry_file = optarg;
+      break;
+
+    case 'e':
+      telemetry_port = strtol(optarg, nullptr, 10);
+      break;
+
+    case 'L':
+      time_updates = true;
+      break;
+
+    case 'Z':
+      seed = strtoull(optarg, nullptr, 10);
+      seeded = true;
+      break;
+
+    case 'D':
+      deterministic = true;
+      break;
+
+    case 'K':
+      kernel = optarg;
+      break;
+
+    case 'B':
+      kernel_sigma = strtod(optarg, nullptr);
+      break;
+
+    case 'F':
+      kernel_dim = strtoull(optarg, nullptr, 10);
+      break;
+
+    case 'Q':
+      kernel_degree = strtoul(optarg, nullptr, 10);
+      break;
+
+    case 'O':
+      kernel_offset = strtod(optarg, nullptr);
+      break;
+
+    case 'C':
+      transform_cache_mb = strtoull(optarg, nullptr, 10);
+      break;
+
+    case 'A':
+      transform_cache_float = true;
+      break;
+
+    case 'X':
+      interaction_bits = strtoul(optarg, nullptr, 10);
+      break;
+
     default:
       abort();
     }
@@ -258,9 +522,35 @@ main(int argc, char **argv)
   if (nworkers <= 0)
     throw runtime_error("need nworkers > 0");
 
+  // an unseeded run still logs the seed it drew, so it can be repeated
+  if (!seeded)
+    seed = chrono::system_clock::now().time_since_epoch().count();
+  if (seeded && !sample_seeded)
+    sample_seed = seed;
+
+  // only the training rows are sampled; kept rows are weighted by the
+  // inverse of their rate, so the evaluation stays unbiased
+  unique_ptr<stratified_sampler> sampler;
+  if (sample_neg != 1.0 || sample_pos != 1.0)
+    sampler.reset(new stratified_sampler(sample_neg, sample_pos, sample_seed));
+
   if (lossfn != "logistic" && lossfn != "square" &&
       lossfn != "hinge" && lossfn != "ramp")
     throw runtime_error("invalid loss function: " + lossfn);
+  if (regression && lossfn != "square")
+    throw runtime_error("--regression needs the square loss");
+  if (!kernel.empty() && kernel != "rbf" && kernel != "laplacian" &&
+      kernel != "cauchy" && kernel != "poly" && kernel != "arccos")
+    throw runtime_error("invalid kernel: " + kernel);
+  if (!kernel.empty() && (!(kernel_sigma > 0.0) || !kernel_dim))
+    throw runtime_error("need bandwidth > 0 and kernel-dim > 0");
+  if (interaction_bits > feature_maps::interaction_map::MaxBits)
+    throw runtime_error("need interaction-bits <= " +
+        to_string(feature_maps::interaction_map::MaxBits));
+  if (interaction_bits && !kernel.empty())
+    throw runtime_error("limitation: feature crosses only work with linear models");
+  if (interaction_bits && clftype == ClfType::CLF_SGD_LOCK)
+    throw runtime_error("limitation: feature crosses do not work with sgd-lock");
 
   cerr << "[INFO] PID=" << getpid() << endl;
   cerr << "[INFO] lambda=" << lambda
@@ -269,36 +559,132 @@ main(int argc, char **argv)
        << ", nworkers=" << nworkers
        << ", lossfn=" << lossfn
        << ", clf=" << clftype_str(clftype)
+       << ", packed_rows=" << packed_rows
+       << ", regression=" << regression
+       << ", at_k=" << at_k
+       << ", time_updates=" << time_updates
+       << ", seed=" << seed
+       << ", deterministic=" << deterministic
+       << ", kernel=" << (kernel.empty() ? string("none") : kernel)
+       << ", bandwidth=" << kernel_sigma
+       << ", kernel_dim=" << kernel_dim
+       << ", kernel_degree=" << kernel_degree
+       << ", kernel_offset=" << kernel_offset
+       << ", interaction_bits=" << interaction_bits
+       << ", transform_cache_mb=" << transform_cache_mb
+       << ", transform_cache_float=" << transform_cache_float
+       << ", weight_pages=" << mem::page_mode_str(weight_pages)
+       << ", prefetch=" << (prefetch == opt::PrefetchAuto ?
+                              string("auto") : to_string(prefetch))
        << endl;
+  if (sampler)
+    cerr << "[INFO] sampling training rows: " << *sampler << endl;
 
-  // load the dataset
+  // optimizers push per-round metrics to the sinks asked for
+  if (telemetry_port != -1 && (telemetry_port <= 0 || telemetry_port > 65535))
+    throw runtime_error("invalid telemetry port");
+  shared_ptr<telemetry::collector> telemetry;
+  {
+    vector<unique_ptr<telemetry::sink>> sinks;
+    if (!telemetry_file.empty())
+      sinks.emplace_back(new telemetry::jsonl_sink(telemetry_file));
+    if (telemetry_port != -1)
+      sinks.emplace_back(new telemetry::exposition_sink(telemetry_port));
+    if (!sinks.empty()) {
+      telemetry = make_shared<telemetry::collector>(move(sinks));
+      cerr << "[INFO] telemetry: file=" << telemetry_file
+           << ", port=" << telemetry_port << endl;
+    }
+  }
+
+  // load the dataset. the arenas are declared first so that rows still
+  // held here (e.g. when loading throws) are destroyed before them
+  shared_ptr<mem::arena_pool> arenas_train, arenas_test;
   matrix_t xtrain, xtest;
-  standard_vec_t ytrain, ytest;
+  standard_vec_t ytrain, ytest, wtrain, wtest;
+  feature_stats stats_train, stats_test;
   if (!ascii_training_file.empty())
     load<ascii_file>(ascii_training_file, ascii_testing_file,
-                     xtrain, ytrain, xtest, ytest);
+                     xtrain, ytrain, xtest, ytest, wtrain, wtest,
+                     stats_train, stats_test,
+                     arenas_train, arenas_test, sampler.get(),
+                     regression);
   else if (!binary_training_file.empty())
     load<binary_file>(binary_training_file, binary_testing_file,
-                      xtrain, ytrain, xtest, ytest);
+                      xtrain, ytrain, xtest, ytest, wtrain, wtest,
+                      stats_train, stats_test,
+                      arenas_train, arenas_test, sampler.get(),
+                      regression);
   else /* if (!svmlight_training_file.empty()) */
     load<svmlight_file>(svmlight_training_file, svmlight_testing_file,
-                        xtrain, ytrain, xtest, ytest);
-
-  dataset training(move(xtrain), move(ytrain));
-  dataset testing(move(xtest), move(ytest));
+                        xtrain, ytrain, xtest, ytest, wtrain, wtest,
+                        stats_train, stats_test,
+                        arenas_train, arenas_test, sampler.get(),
+                        regression);
+
+  dataset training(move(xtrain), move(ytrain), move(stats_train), arenas_train);
+  dataset testing(move(xtest), move(ytest), move(stats_test), arenas_test);
+  // blocked binary files may carry sample weights
+  if (wtrain.size())
+    training.set_weights(move(wtrain));
+  if (wtest.size())
+    testing.set_weights(move(wtest));
+  cout << "[INFO] sample weights: training=" << bool(training.get_weights())
+       << ", testing=" << bool(testing.get_weights()) << endl;
   training.set_parallel_materialize(true);
   testing.set_parallel_materialize(true);
+  // kernel features are then computed on access, keeping what fits in the
+  // cache (dense ones as floats, if asked), rather than materialized up front
+  if (transform_cache_mb) {
+    const size_t bytes = transform_cache_mb << 20;
+    training.set_transform_cache(bytes, transform_cache_float);
+    testing.set_transform_cache(bytes, transform_cache_float);
+  }
+  if (packed_rows) {
+    scoped_timer t("packing rows");
+    training.pack_rows();
+    testing.pack_rows();
+  }
+  {
+    // all-dense inputs (e.g. ascii files) get one contiguous block each,
+    // which lets the models use their dense kernels
+    scoped_timer t("dense layout");
+    const bool dense_train = training.make_dense();
+    const bool dense_test = testing.make_dense();
+    cout << "[INFO] dense rows: training=" << dense_train
+         << ", testing=" << dense_test << endl;
+  }
   cout << "[INFO] training max norm " << training.max_x_norm() << endl;
 
   // build the model
+  train_options opts;
+  opts.clftype = clftype;
+  opts.lambda = lambda;
+  opts.nrounds = nrounds;
+  opts.nworkers = nworkers;
+  opts.offset = offset;
+  opts.weight_pages = weight_pages;
+  opts.prefetch = prefetch;
+  opts.regression = regression;
+  opts.at_k = at_k;
+  opts.telemetry = telemetry;
+  opts.time_updates = time_updates;
+  opts.seed = seed;
+  opts.deterministic = deterministic;
+  opts.kernel = kernel;
+  opts.kernel_sigma = kernel_sigma;
+  opts.kernel_dim = kernel_dim;
+  opts.kernel_degree = kernel_degree;
+  opts.kernel_offset = kernel_offset;
+  opts.interaction_bits = interaction_bits;
   if (lossfn == "logistic")
-    go<logistic_loss>(training, testing, clftype, lambda, nrounds, nworkers, offset);
+    go<logistic_loss>(training, testing, opts);
   else if (lossfn == "square")
-    go<square_loss>(training, testing, clftype, lambda, nrounds, nworkers, offset);
+    go<square_loss>(training, testing, opts);
   else if (lossfn == "hinge")
-    go<hinge_loss>(training, testing, clftype, lambda, nrounds, nworkers, offset);
+    go<hinge_loss>(training, testing, opts);
   else /* if (lossfn == "ramp") */
-    go<ramp_loss>(training, testing, clftype, lambda, nrounds, nworkers, offset);
+    go<ramp_loss>(training, testing, opts);
 
   return 0;
 }
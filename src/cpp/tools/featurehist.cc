@@ -1,46 +1,144 @@
+/**
+ * featurehist.cc - per-feature statistics of a binary file
+ *
+ * The input is streamed one row run at a time and accumulated by a pool of
+ * threads, each with its own feature_stats, which are merged at the end
+ * (per-feature moments are only kept with --full).
+ * By default writes one count per feature to output_file; with --full each
+ * line is "count min max mean variance". A summary (row count, label and
+ * row nnz distributions) is printed to stderr.
+ */
+
+#include <getopt.h>
+
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
-#include <fstream>
 
-#include <dataset.hh>
 #include <binary_file.hh>
+#include <stats.hh>
+#include <task_executor.hh>
+#include <util.hh>
+#include <vec.hh>
 
 using namespace std;
 
+struct row_run {
+  vector<vec_t> xs_;
+  standard_vec_t ys_;
+};
+
+static feature_stats
+stream_stats(const string &filename, size_t nthreads, bool moments)
+{
+  vector<feature_stats> partials(nthreads, feature_stats(0, moments));
+  vector<unique_ptr<task_executor_thread<bool>>> workers;
+  for (size_t i = 0; i < nthreads; i++)
+    workers.emplace_back(new task_executor_thread<bool>);
+
+  // each worker owns partials[i], so runs given to the same worker are
+  // accumulated serially
+  const size_t max_inflight = 2 * nthreads;
+  deque<future<bool>> inflight;
+  size_t nruns = 0;
+  auto shutdown = [&]() {
+    for (auto &f : inflight)
+      f.wait();
+    for (auto &w : workers)
+      w->shutdown();
+  };
+  try {
+    binary_file::stream_feature_file(filename,
+        [&](vector<vec_t> &xs, standard_vec_t &ys, const standard_vec_t &) {
+      shared_ptr<row_run> run = make_shared<row_run>();
+      run->xs_.swap(xs);
+      run->ys_ = move(ys);
+      feature_stats *s = &partials[nruns % nthreads];
+      inflight.push_back(workers[nruns++ % nthreads]->enq([run, s]() {
+        for (size_t i = 0; i < run->xs_.size(); i++)
+          s->add(run->xs_[i], run->ys_[i]);
+        return true;
+      }));
+      if (inflight.size() >= max_inflight) {
+        inflight.front().wait();
+        inflight.pop_front();
+      }
+    });
+  } catch (...) {
+    shutdown();
+    throw;
+  }
+  shutdown();
+
+  feature_stats::merge_all(partials, nthreads);
+  return move(partials[0]);
+}
+
 int
 main(int argc, char **argv)
 {
-  if (argc != 3) {
-    cerr << "[usage] " << argv[0] << " binary_file output_file" << endl;
+  bool full = false;
+  size_t nthreads = util::ncpus_online();
+  while (1) {
+    static struct option long_options[] =
+    {
+      {"full"    , no_argument       , 0 , 'f'} ,
+      {"threads" , required_argument , 0 , 't'} ,
+      {0, 0, 0, 0}
+    };
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "ft:", long_options, &option_index);
+    if (c == -1)
+      break;
+    switch (c) {
+    case 'f':
+      full = true;
+      break;
+    case 't':
+      nthreads = strtoul(optarg, nullptr, 10);
+      break;
+    default:
+      argc = 0;
+      break;
+    }
+  }
+  if (argc - optind != 2) {
+    cerr << "[usage] " << argv[0]
+         << " [--full] [--threads N] binary_file output_file" << endl;
     return 1;
   }
+  nthreads = max(nthreads, size_t(1));
 
-  vector<vec_t> xs;
-  standard_vec_t ys;
-  unsigned int n;
-  if (binary_file().read_feature_file(argv[1], xs, ys, n)) {
-    cerr << "[ERROR] could not read binary_file" << endl;
+  feature_stats stats;
+  try {
+    stats = stream_stats(argv[optind], nthreads, full);
+  } catch (exception &e) {
+    cerr << "[ERROR] could not read binary_file: " << e.what() << endl;
     return 1;
   }
 
-  dataset d(move(xs), move(ys));
-  d.set_parallel_materialize(true);
-  const auto shape = d.get_x_shape();
-
-  vector<size_t> counts(shape.second);
-  const auto it_end = d.x_end();
-  for (auto it = d.x_begin(); it != it_end; ++it) {
-    const auto &x = *it;
-    const auto inner_it_end = x.end();
-    for (auto inner_it = x.begin(); inner_it != inner_it_end; ++inner_it)
-      counts[inner_it.tell()]++;
+  cerr << "[INFO] stats: " << stats << endl;
+  const auto &hist = stats.row_nnz_hist();
+  for (size_t b = 0; b < hist.size(); b++) {
+    if (!hist[b])
+      continue;
+    cerr << "[INFO] rows with nnz in [" << (b ? (size_t(1) << (b-1)) : 0)
+         << ", " << (b ? (size_t(1) << (b-1)) * 2 : 1) << "): "
+         << hist[b] << endl;
   }
 
-  ofstream ofs(argv[2]);
-  for (auto c : counts)
-    ofs << c << endl;
+  ofstream ofs(argv[optind + 1]);
+  for (size_t i = 0; i < stats.nfeatures(); i++) {
+    ofs << stats.counts()[i];
+    if (full)
+      ofs << " " << stats.min(i) << " " << stats.max(i)
+          << " " << stats.mean(i) << " " << stats.variance(i);
+    ofs << endl;
+  }
 
   return 0;
 }
-
@@ -1,11 +1,20 @@
 #pragma once
 
+#include <exception>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <vector>
 #include <atomic>
 #include <map>
+#include <mutex>
+#include <new>
+#include <queue>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <type_traits>
 #include <macros.hh>
 #include <unistd.h>
@@ -18,12 +27,54 @@ almost_eq(double a, double b)
   return fabs(a - b) <= 1e-5;
 }
 
+// by the bits, since -ffast-math lets the compiler assume std::isfinite()
+// and std::isnan() hold for every value
+static inline bool
+finite_bits(double x)
+{
+  uint64_t b;
+  std::memcpy(&b, &x, sizeof(b));
+  return (b & 0x7ff0000000000000ULL) != 0x7ff0000000000000ULL;
+}
+
+static inline bool
+nan_bits(double x)
+{
+  uint64_t b;
+  std::memcpy(&b, &x, sizeof(b));
+  return (b & 0x7fffffffffffffffULL) > 0x7ff0000000000000ULL;
+}
+
 static inline unsigned
 ncpus_online()
 {
   return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+// runs fn(i) for i in [0, nthreads) on separate threads, rethrowing the
+// first exception raised by any of them
+template <typename Fn>
+static inline void
+parallel_run(size_t nthreads, Fn fn)
+{
+  std::vector<std::thread> workers;
+  std::vector<std::exception_ptr> errors(nthreads);
+  for (size_t i = 0; i < nthreads; i++) {
+    workers.emplace_back([&fn, &errors, i]() {
+      try {
+        fn(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto &w : workers)
+    w.join();
+  for (auto &e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
+
 // RR nelems amongst nthreads, returns vector of indices
 static inline std::vector<std::vector<size_t>>
 round_robin(size_t nelems, size_t nthreads)
@@ -170,31 +221,76 @@ smap_to_json(const std::map<std::string, std::string> &m)
 }
 
 /**
- * XXX: CoreIDs are not recyclable for now, so NMAXCORES is really the number
- * of threads which can ever be spawned in the system
+ * Small integer ids for the live threads of the process. A thread gets the
+ * smallest free id the first time it asks for one and gives it back when it
+ * exits, so ids stay dense (bounded by the peak number of live threads) no
+ * matter how many thread pools come and go.
+ *
+ * Every thread also gets an epoch, which is never reused; it tells a new
+ * owner of a recycled id apart from the previous one.
  */
-class core {
+class thread_slot {
 public:
-  static const unsigned NMaxCores = 512;
-
   static inline unsigned
   id()
   {
-    if (unlikely(tl_core_id == -1)) {
-      // initialize per-core data structures
-      tl_core_id = g_core_count.fetch_add(1, std::memory_order_acq_rel);
-      // did we exceed max cores?
-      ALWAYS_ASSERT(unsigned(tl_core_id) < NMaxCores);
-    }
-    return tl_core_id;
+    return holder().id_;
+  }
+
+  static inline uint64_t
+  epoch()
+  {
+    return holder().epoch_;
   }
 
 private:
-  // the core ID of this core: -1 if not set
-  static __thread int tl_core_id;
+  struct registry {
+    registry() : next_(0), epochs_(0) {}
+    std::mutex mu_;
+    std::priority_queue<
+      unsigned, std::vector<unsigned>, std::greater<unsigned>> free_;
+    unsigned next_;
+    std::atomic<uint64_t> epochs_;
+  };
+
+  static inline registry &
+  get_registry()
+  {
+    static registry r;
+    return r;
+  }
+
+  struct holder_t {
+    holder_t()
+    {
+      registry &r = get_registry();
+      epoch_ = r.epochs_.fetch_add(1, std::memory_order_relaxed) + 1;
+      std::lock_guard<std::mutex> l(r.mu_);
+      if (r.free_.empty()) {
+        id_ = r.next_++;
+      } else {
+        id_ = r.free_.top();
+        r.free_.pop();
+      }
+    }
+
+    ~holder_t()
+    {
+      registry &r = get_registry();
+      std::lock_guard<std::mutex> l(r.mu_);
+      r.free_.push(id_);
+    }
 
-  // contains a running count of all the cores
-  static std::atomic<unsigned> g_core_count;
+    unsigned id_;
+    uint64_t epoch_;
+  };
+
+  static inline holder_t &
+  holder()
+  {
+    static thread_local holder_t h;
+    return h;
+  }
 };
 
 template <typename T>
@@ -218,68 +314,131 @@ private:
   CACHE_PADOUT;
 };
 
-// requires T to have no-arg ctor
+/**
+ * One T per live thread, indexed by thread_slot. Storage grows in segments
+ * of doubling size as higher slot ids show up, so it is sized by the peak
+ * number of threads that actually used it. A thread whose slot was last
+ * used by a thread that has since exited starts from a fresh T().
+ *
+ * Requires T to have a no-arg ctor. my() may be called concurrently from
+ * any threads; for_each() must not race with my().
+ */
 template <typename T>
-class percore {
+class per_thread {
 public:
-
-  percore()
+  per_thread()
   {
-    for (size_t i = 0; i < size(); i++)
-      new (&(elems()[i])) padded<T>();
+    for (auto &s : segs_)
+      s.store(nullptr, std::memory_order_relaxed);
   }
 
-  ~percore()
+  ~per_thread()
   {
-    for (size_t i = 0; i < size(); i++)
-      elems()[i].~padded<T>();
-  }
-
-  inline T &
-  operator[](unsigned i)
-  {
-    return elems()[i].get();
+    for (unsigned i = 0; i < NSegments; i++) {
+      slot * const p = segs_[i].load(std::memory_order_relaxed);
+      if (!p)
+        continue;
+      for (size_t j = 0; j < segment_size(i); j++)
+        p[j].~slot();
+      free(p);
+    }
   }
 
-  inline const T &
-  operator[](unsigned i) const
-  {
-    return elems()[i].get();
-  }
+  per_thread(const per_thread &) = delete;
+  per_thread &operator=(const per_thread &) = delete;
 
   inline T &
   my()
   {
-    return (*this)[core::id()];
+    slot &s = at(thread_slot::id());
+    const uint64_t epoch = thread_slot::epoch();
+    if (unlikely(s.owner_ != epoch)) {
+      s.value_ = T();
+      s.owner_ = epoch;
+    }
+    return s.value_;
   }
 
   inline const T &
   my() const
   {
-    return (*this)[core::id()];
+    return const_cast<per_thread *>(this)->my();
+  }
+
+  // calls f(T &) on the value of every slot ever used, e.g. to reduce
+  // per-thread partial results
+  template <typename Fn>
+  void
+  for_each(Fn f)
+  {
+    for (unsigned i = 0; i < NSegments; i++) {
+      slot * const p = segs_[i].load(std::memory_order_acquire);
+      if (!p)
+        continue;
+      for (size_t j = 0; j < segment_size(i); j++)
+        if (p[j].owner_)
+          f(p[j].value_);
+    }
   }
 
+  // number of slots allocated so far
   inline size_t
-  size() const
+  capacity() const
   {
-    return core::NMaxCores;
+    size_t ret = 0;
+    for (unsigned i = 0; i < NSegments; i++)
+      if (segs_[i].load(std::memory_order_acquire))
+        ret += segment_size(i);
+    return ret;
   }
 
-protected:
+private:
+  static const unsigned NSegments = 32;
+
+  struct slot {
+    slot() : owner_(0) {}
+    T value_;
+    uint64_t owner_; // epoch of the thread owning value_, 0 if unused
+    CACHE_PADOUT;
+  };
+
+  static inline size_t segment_size(unsigned i) { return size_t(1) << i; }
 
-  inline padded<T> *
-  elems()
+  // slot id lives in segment floor(log2(id + 1))
+  inline slot &
+  at(unsigned id)
   {
-    return (padded<T> *) &bytes_[0];
+    const uint64_t k = uint64_t(id) + 1;
+    const unsigned seg = 63 - __builtin_clzll(k);
+    slot *p = segs_[seg].load(std::memory_order_acquire);
+    if (unlikely(!p))
+      p = alloc_segment(seg);
+    return p[k - segment_size(seg)];
   }
 
-  inline const padded<T> *
-  elems() const
+  slot *
+  alloc_segment(unsigned seg)
   {
-    return (const padded<T> *) &bytes_[0];
+    ALWAYS_ASSERT(seg < NSegments);
+    void *raw;
+    if (posix_memalign(&raw, CACHELINE_SIZE, sizeof(slot) * segment_size(seg)))
+      throw std::bad_alloc();
+    slot * const p = static_cast<slot *>(raw);
+    for (size_t j = 0; j < segment_size(seg); j++)
+      new (&p[j]) slot();
+    slot *expected = nullptr;
+    if (!segs_[seg].compare_exchange_strong(
+          expected, p, std::memory_order_acq_rel)) {
+      // lost the race to another thread
+      for (size_t j = 0; j < segment_size(seg); j++)
+        p[j].~slot();
+      free(p);
+      return expected;
+    }
+    return p;
   }
 
-  char bytes_[sizeof(padded<T>) * core::NMaxCores];
+  std::atomic<slot *> segs_[NSegments];
 };
 
 }
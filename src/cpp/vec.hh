@@ -6,15 +6,33 @@
 #include <iterator>
 #include <cmath>
 #include <cstddef>
+#include <cstring>
+#include <limits>
+#include <cstdint>
+#include <new>
 
 #include <pretty_printers.hh>
+#include <codec.hh>
 #include <macros.hh>
+#include <mem.hh>
 #include <util.hh>
 
 template <typename T> class vec;
 template <typename T> class standard_vec;
 template <typename T> class sparse_vec;
-
+template <typename T> class packed_vec;
+
+enum class vec_tag : uint8_t { STD, SPARSE, PACKED };
+
+/**
+ * Iterates over the nonzero entries of a vec<T>. Both representations are
+ * contiguous arrays, so the iterator is just a byte pointer plus a stride
+ * and a value offset: advancing, dereferencing and comparing do not need to
+ * look at the representation tag. Only tell() has to distinguish them.
+ *
+ * Packed rows keep their values in a plain array too, but their indices are
+ * delta coded, so ++ additionally decodes the next index for them.
+ */
 template <typename T>
 class vec_const_iterator :
   public std::iterator<std::forward_iterator_tag, const T> {
@@ -29,21 +47,19 @@ public:
   inline const T &
   operator*() const
   {
-    return std_ ? *std_iter_ : sparse_iter_->second;
+    return *reinterpret_cast<const T *>(p_ + value_off_);
   }
 
   inline const T *
   operator->() const
   {
-    return std_ ? &(*std_iter_) : &sparse_iter_->second;
+    return reinterpret_cast<const T *>(p_ + value_off_);
   }
 
   inline bool
   operator==(const vec_const_iterator &that) const
   {
-    return std_ ?
-      (std_iter_ == that.std_iter_) :
-      (sparse_iter_ == that.sparse_iter_);
+    return p_ == that.p_;
   }
 
   inline bool
@@ -55,10 +71,9 @@ public:
   inline vec_const_iterator &
   operator++()
   {
-    if (std_)
-      ++std_iter_;
-    else
-      ++sparse_iter_;
+    p_ += stride_;
+    if (unlikely(tag_ == vec_tag::PACKED) && q_ != q_end_)
+      idx_ += codec::varint_decode(q_);
     return *this;
   }
 
@@ -73,52 +88,204 @@ public:
   inline size_t
   tell() const
   {
-    return std_ ?
-      (std_iter_ - std_iter_begin_) :
-      sparse_iter_->first;
+    switch (tag_) {
+    case vec_tag::STD:
+      return reinterpret_cast<const T *>(p_) - reinterpret_cast<const T *>(begin_);
+    case vec_tag::SPARSE:
+      return *reinterpret_cast<const size_t *>(p_);
+    case vec_tag::PACKED:
+      return idx_;
+    }
+    NOT_REACHABLE;
   }
 
 protected:
   vec_const_iterator(const vec<T> &v, bool begin);
 
 private:
-  bool std_;
-  typename std::vector<T>::const_iterator std_iter_begin_;
-  typename std::vector<T>::const_iterator std_iter_;
-  typename std::vector<std::pair<size_t, T>>::const_iterator sparse_iter_;
+  const char *p_;
+  const char *begin_;
+  const uint8_t *q_; // packed only: next encoded index delta
+  const uint8_t *q_end_;
+  size_t idx_; // packed only: decoded index of the current entry
+  uint32_t stride_;
+  uint16_t value_off_;
+  vec_tag tag_;
 };
 
+/**
+ * A vec<T> is either a dense (standard), a sparse, or a packed vector. Only
+ * one representation is ever live, so they share storage in a union; the tag
+ * says which one is constructed.
+ *
+ * Packed vectors are a read-only, compressed form of sparse vectors (see
+ * packed_vec) meant for large training sets that no longer fit in cache.
+ *
+ * Hot loops should prefer for_each_nonzero() over iterators, since it
+ * dispatches on the tag once per vector instead of once per element.
+ */
 template <typename T>
 class vec {
   friend class vec_const_iterator<T>;
 public:
   static_assert(std::is_floating_point<T>::value, "need FP type");
 
+  // row payloads may live in an arena (see mem::row_allocator)
+  typedef std::vector<T, mem::row_allocator<T>> std_repr_type;
+  typedef std::vector<std::pair<size_t, T>,
+                      mem::row_allocator<std::pair<size_t, T>>> sparse_repr_type;
+  typedef std::vector<uint8_t, mem::row_allocator<uint8_t>> packed_repr_type;
+
   struct std_tag_t {};
   struct sparse_tag_t {};
-  enum class tag : uint8_t { STD, SPARSE };
+  struct packed_tag_t {};
+  typedef vec_tag tag;
+
+  vec() : tag_(tag::STD) { new (&std_repr_) std_repr_type(); }
+
+  vec(const vec &that)
+    : tag_(that.tag_)
+  {
+    switch (tag_) {
+    case tag::STD:
+      new (&std_repr_) std_repr_type(that.std_repr_);
+      break;
+    case tag::SPARSE:
+      new (&sparse_repr_) sparse_repr_type(that.sparse_repr_);
+      break;
+    case tag::PACKED:
+      new (&packed_repr_) packed_repr_type(that.packed_repr_);
+      break;
+    }
+  }
+
+  vec(vec &&that) noexcept
+    : tag_(that.tag_)
+  {
+    switch (tag_) {
+    case tag::STD:
+      new (&std_repr_) std_repr_type(std::move(that.std_repr_));
+      break;
+    case tag::SPARSE:
+      new (&sparse_repr_) sparse_repr_type(std::move(that.sparse_repr_));
+      break;
+    case tag::PACKED:
+      new (&packed_repr_) packed_repr_type(std::move(that.packed_repr_));
+      break;
+    }
+  }
+
+  vec &
+  operator=(const vec &that)
+  {
+    if (this == &that)
+      return *this;
+    if (tag_ != that.tag_) {
+      // copy first: if that throws, this keeps its old representation
+      vec tmp(that);
+      return *this = std::move(tmp);
+    } else if (tag_ == tag::STD) {
+      std_repr_ = that.std_repr_;
+    } else if (tag_ == tag::SPARSE) {
+      sparse_repr_ = that.sparse_repr_;
+    } else {
+      packed_repr_ = that.packed_repr_;
+    }
+    return *this;
+  }
+
+  vec &
+  operator=(vec &&that)
+  {
+    if (this == &that)
+      return *this;
+    if (tag_ != that.tag_) {
+      // moving a representation doesn't allocate, so this can't throw
+      // between destroy() and the new representation
+      destroy();
+      new (this) vec(std::move(that));
+    } else if (tag_ == tag::STD) {
+      std_repr_ = std::move(that.std_repr_);
+    } else if (tag_ == tag::SPARSE) {
+      sparse_repr_ = std::move(that.sparse_repr_);
+    } else {
+      packed_repr_ = std::move(that.packed_repr_);
+    }
+    return *this;
+  }
 
-  vec() : tag_(tag::STD) {}
-  vec(const vec &) = default;
-  vec &operator=(const vec &) = default;
-  vec(vec &&) = default;
+  ~vec() { destroy(); }
 
   vec(std_tag_t)
-    : tag_(tag::STD) {}
+    : tag_(tag::STD) { new (&std_repr_) std_repr_type(); }
   vec(sparse_tag_t)
-    : tag_(tag::SPARSE) {}
+    : tag_(tag::SPARSE) { new (&sparse_repr_) sparse_repr_type(); }
+
+  // empty vecs whose payload will be allocated from arena a
+  vec(std_tag_t, mem::arena *a)
+    : tag_(tag::STD)
+  {
+    new (&std_repr_) std_repr_type(mem::row_allocator<T>(a));
+  }
+  vec(sparse_tag_t, mem::arena *a)
+    : tag_(tag::SPARSE)
+  {
+    new (&sparse_repr_) sparse_repr_type(
+        mem::row_allocator<std::pair<size_t, T>>(a));
+  }
+
+  // a copy of that with its payload allocated from arena a
+  vec(const vec &that, mem::arena *a)
+    : tag_(that.tag_)
+  {
+    switch (tag_) {
+    case tag::STD:
+      new (&std_repr_) std_repr_type(
+          that.std_repr_.begin(), that.std_repr_.end(),
+          mem::row_allocator<T>(a));
+      break;
+    case tag::SPARSE:
+      new (&sparse_repr_) sparse_repr_type(
+          that.sparse_repr_.begin(), that.sparse_repr_.end(),
+          mem::row_allocator<std::pair<size_t, T>>(a));
+      break;
+    case tag::PACKED:
+      new (&packed_repr_) packed_repr_type(
+          that.packed_repr_.begin(), that.packed_repr_.end(),
+          mem::row_allocator<uint8_t>(a));
+      break;
+    }
+  }
 
   template <typename U>
   vec(std_tag_t, const std::vector<U> &std_repr)
-    : tag_(tag::STD), std_repr_(std_repr), sparse_repr_() {}
-  vec(std_tag_t, std::vector<T> &&std_repr)
-    : tag_(tag::STD), std_repr_(std::move(std_repr)), sparse_repr_() {}
+    : tag_(tag::STD)
+  {
+    new (&std_repr_) std_repr_type(std_repr.begin(), std_repr.end());
+  }
+  vec(std_tag_t, std_repr_type &&std_repr)
+    : tag_(tag::STD)
+  {
+    new (&std_repr_) std_repr_type(std::move(std_repr));
+  }
 
   template <typename U>
   vec(sparse_tag_t, const std::vector<std::pair<size_t, U>> &sparse_repr)
-    : tag_(tag::SPARSE), std_repr_(), sparse_repr_(sparse_repr) {}
-  vec(sparse_tag_t, std::vector<std::pair<size_t, T>> &&sparse_repr)
-    : tag_(tag::SPARSE), std_repr_(), sparse_repr_(std::move(sparse_repr)) {}
+    : tag_(tag::SPARSE)
+  {
+    new (&sparse_repr_) sparse_repr_type(sparse_repr.begin(), sparse_repr.end());
+  }
+  vec(sparse_tag_t, sparse_repr_type &&sparse_repr)
+    : tag_(tag::SPARSE)
+  {
+    new (&sparse_repr_) sparse_repr_type(std::move(sparse_repr));
+  }
+
+  vec(packed_tag_t, packed_repr_type &&packed_repr)
+    : tag_(tag::PACKED)
+  {
+    new (&packed_repr_) packed_repr_type(std::move(packed_repr));
+  }
 
   // no checking guaranteed
   inline standard_vec<T> * as_standard_ptr();
@@ -130,6 +297,11 @@ public:
   inline const standard_vec<T> & as_standard_ref() const;
   inline sparse_vec<T> & as_sparse_ref();
   inline const sparse_vec<T> & as_sparse_ref() const;
+  inline packed_vec<T> & as_packed_ref();
+  inline const packed_vec<T> & as_packed_ref() const;
+
+  // re-encodes a sparse vector in packed form; no-op otherwise
+  inline void pack(mem::arena *a = nullptr);
 
   // ensures the vector is at least (i+1) dimensions first
   inline T &ensureref(size_t i);
@@ -140,6 +312,27 @@ public:
   inline size_t highest_nonzero_dim() const;
   inline size_t nnz() const;
 
+  // calls f(feature_idx, value) for every stored entry, in ascending
+  // feature_idx order
+  template <typename Fn>
+  inline void
+  for_each_nonzero(Fn f) const
+  {
+    if (tag_ == tag::STD) {
+      const T * const px = std_repr_.data();
+      const size_t n = std_repr_.size();
+      for (size_t i = 0; i < n; i++)
+        f(i, px[i]);
+    } else if (tag_ == tag::SPARSE) {
+      const std::pair<size_t, T> * const px = sparse_repr_.data();
+      const size_t n = sparse_repr_.size();
+      for (size_t i = 0; i < n; i++)
+        f(px[i].first, px[i].second);
+    } else {
+      packed_for_each_nonzero(f);
+    }
+  }
+
   typedef vec_const_iterator<T> const_iterator;
 
   inline const_iterator
@@ -154,25 +347,120 @@ public:
     return const_iterator(*this, false);
   }
 
+  // size of the representation's array (not counting spare capacity)
+  inline size_t
+  payload_bytes() const
+  {
+    switch (tag_) {
+    case tag::STD:
+      return std_repr_.size() * sizeof(T);
+    case tag::SPARSE:
+      return sparse_repr_.size() * sizeof(sparse_repr_[0]);
+    default:
+      return packed_repr_.size();
+    }
+  }
+
+  // size of the representation's allocation, spare capacity included
+  inline size_t
+  capacity_bytes() const
+  {
+    switch (tag_) {
+    case tag::STD:
+      return std_repr_.capacity() * sizeof(T);
+    case tag::SPARSE:
+      return sparse_repr_.capacity() * sizeof(sparse_repr_[0]);
+    default:
+      return packed_repr_.capacity();
+    }
+  }
+
+  // issues prefetches for (the first max_lines cache lines of) the payload
+  inline void
+  prefetch(size_t max_lines = 8) const
+  {
+    const char *p;
+    switch (tag_) {
+    case tag::STD:
+      p = reinterpret_cast<const char *>(std_repr_.data());
+      break;
+    case tag::SPARSE:
+      p = reinterpret_cast<const char *>(sparse_repr_.data());
+      break;
+    default:
+      p = reinterpret_cast<const char *>(packed_repr_.data());
+      break;
+    }
+    size_t bytes = std::min(payload_bytes(), max_lines * CACHELINE_SIZE);
+    if (!bytes)
+      return;
+    // the payload need not start on a line boundary
+    for (size_t off = 0; off < bytes; off += CACHELINE_SIZE)
+      __builtin_prefetch(p + off, 0, 3);
+    __builtin_prefetch(p + bytes - 1, 0, 3);
+  }
+
   inline tag get_tag() const { return tag_; }
   inline bool is_standard() const { return tag_ == tag::STD; }
   inline bool is_sparse() const { return tag_ == tag::SPARSE; }
+  inline bool is_packed() const { return tag_ == tag::PACKED; }
 
 protected:
+  template <typename Fn>
+  inline void packed_for_each_nonzero(Fn f) const;
+
+  inline void
+  destroy()
+  {
+    switch (tag_) {
+    case tag::STD:
+      std_repr_.~std_repr_type();
+      break;
+    case tag::SPARSE:
+      sparse_repr_.~sparse_repr_type();
+      break;
+    case tag::PACKED:
+      packed_repr_.~packed_repr_type();
+      break;
+    }
+  }
+
   tag tag_;
-  std::vector<T> std_repr_;
-  std::vector<std::pair<size_t, T>> sparse_repr_;
+  union {
+    std_repr_type std_repr_;
+    sparse_repr_type sparse_repr_;
+    packed_repr_type packed_repr_;
+  };
 };
 
 template <typename T>
 vec_const_iterator<T>::vec_const_iterator(const vec<T> &v, bool begin)
-  : std_(v.is_standard())
+  : q_(nullptr), q_end_(nullptr), idx_(0), tag_(v.get_tag())
 {
-  if (std_) {
-    std_iter_begin_ = v.std_repr_.begin();
-    std_iter_ = begin ? v.std_repr_.begin() : v.std_repr_.end();
+  typedef std::pair<size_t, T> entry_type;
+  if (tag_ == vec_tag::STD) {
+    const T * const px = v.std_repr_.data();
+    begin_ = reinterpret_cast<const char *>(px);
+    p_ = reinterpret_cast<const char *>(begin ? px : px + v.std_repr_.size());
+    stride_ = sizeof(T);
+    value_off_ = 0;
+  } else if (tag_ == vec_tag::SPARSE) {
+    const entry_type * const px = v.sparse_repr_.data();
+    begin_ = reinterpret_cast<const char *>(px);
+    p_ = reinterpret_cast<const char *>(begin ? px : px + v.sparse_repr_.size());
+    stride_ = sizeof(entry_type);
+    value_off_ = offsetof(entry_type, second);
   } else {
-    sparse_iter_ = begin ? v.sparse_repr_.begin() : v.sparse_repr_.end();
+    const packed_vec<T> &pv = v.as_packed_ref();
+    const T * const px = pv.values();
+    begin_ = reinterpret_cast<const char *>(px);
+    p_ = reinterpret_cast<const char *>(begin ? px : px + pv.nnz());
+    stride_ = sizeof(T);
+    value_off_ = 0;
+    q_ = pv.deltas();
+    q_end_ = reinterpret_cast<const uint8_t *>(px);
+    if (begin && q_ != q_end_)
+      idx_ = codec::varint_decode(q_);
   }
 }
 
@@ -187,22 +475,24 @@ public:
 
   standard_vec() : vec<T>(typename vec<T>::std_tag_t()) {}
   standard_vec(size_t n)
-    : vec<T>(typename vec<T>::std_tag_t(), std::vector<T>(n)) {}
+    : vec<T>(typename vec<T>::std_tag_t(),
+             typename vec<T>::std_repr_type(n)) {}
 
   template <typename U>
   standard_vec(std::initializer_list<U> elems)
     : vec<T>(typename vec<T>::std_tag_t(),
-             std::vector<T>(elems.begin(), elems.end())) {}
+             typename vec<T>::std_repr_type(elems.begin(), elems.end())) {}
 
   standard_vec(const standard_vec &) = default;
   standard_vec &operator=(const standard_vec &) = default;
   standard_vec(standard_vec &&) = default;
+  standard_vec &operator=(standard_vec &&) = default;
 
   template <typename U>
   standard_vec(const std::vector<U> &v)
     : vec<T>(typename vec<T>::std_tag_t(), v) {}
 
-  standard_vec(std::vector<T> &&v)
+  standard_vec(typename vec<T>::std_repr_type &&v)
     : vec<T>(typename vec<T>::std_tag_t(), std::move(v)) {}
 
           /** vec api **/
@@ -242,7 +532,7 @@ public:
   map(Fn f) const
   {
     assert(this->tag_ == vec<T>::tag::STD);
-    std::vector<T> ret;
+    typename vec<T>::std_repr_type ret;
     ret.reserve(this->std_repr_.size());
     for (auto p : this->std_repr_)
       ret.push_back(f(p));
@@ -365,14 +655,14 @@ public:
     return this->std_repr_[i];
   }
 
-  inline const std::vector<T> &
+  inline const typename vec<T>::std_repr_type &
   data() const
   {
     assert(this->tag_ == vec<T>::tag::STD);
     return this->std_repr_;
   }
 
-  inline std::vector<T> &
+  inline typename vec<T>::std_repr_type &
   data()
   {
     assert(this->tag_ == vec<T>::tag::STD);
@@ -542,6 +832,74 @@ dot(const sparse_vec<T1> &a, const standard_vec<T2> &b)
   return dot(b, a);
 }
 
+// the packed kernels decode indices inline rather than unpacking first
+
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const standard_vec<T1> &a, const packed_vec<T2> &b)
+{
+  typedef typename std::common_type<T1, T2>::type T;
+  T acc = T();
+  b.for_each_nonzero([&acc, &a](size_t idx, T2 value) {
+    acc += a[idx] * value;
+  });
+  return acc;
+}
+
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const packed_vec<T1> &a, const standard_vec<T2> &b)
+{
+  return dot(b, a);
+}
+
+// both sides are in ascending index order, so a's cursor only moves forward
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const sparse_vec<T1> &a, const packed_vec<T2> &b)
+{
+  typedef typename std::common_type<T1, T2>::type T;
+  T acc = T();
+  auto it = a.nonzero_elems().begin();
+  const auto end = a.nonzero_elems().end();
+  b.for_each_nonzero([&acc, &it, end](size_t idx, T2 value) {
+    while (it != end && it->first < idx)
+      ++it;
+    if (it != end && it->first == idx)
+      acc += it->second * value;
+  });
+  return acc;
+}
+
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const packed_vec<T1> &a, const sparse_vec<T2> &b)
+{
+  return dot(b, a);
+}
+
+// a's indices are decoded as b's catch up with them
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const packed_vec<T1> &a, const packed_vec<T2> &b)
+{
+  typedef typename std::common_type<T1, T2>::type T;
+  T acc = T();
+  const T1 * const ax = a.values();
+  const uint8_t *q = a.deltas();
+  const size_t an = a.nnz();
+  size_t i = 0;
+  size_t aidx = an ? codec::varint_decode(q) : 0;
+  b.for_each_nonzero([&](size_t idx, T2 value) {
+    while (i < an && aidx < idx)
+      if (++i < an)
+        aidx += codec::varint_decode(q);
+    if (i < an && aidx == idx)
+      acc += ax[i] * value;
+  });
+  return acc;
+}
+
 template <typename T1, typename T2>
 static inline typename std::common_type<T1, T2>::type
 dot(const standard_vec<T1> &a, const vec<T2> &b)
@@ -551,6 +909,8 @@ dot(const standard_vec<T1> &a, const vec<T2> &b)
     return dot(a, b.as_standard_ref());
   case vec<T2>::tag::SPARSE:
     return dot(a, b.as_sparse_ref());
+  case vec<T2>::tag::PACKED:
+    return dot(a, b.as_packed_ref());
   }
   NOT_REACHABLE;
 }
@@ -571,6 +931,8 @@ dot(const sparse_vec<T1> &a, const vec<T2> &b)
     return dot(a, b.as_standard_ref());
   case vec<T2>::tag::SPARSE:
     return dot(a, b.as_sparse_ref());
+  case vec<T2>::tag::PACKED:
+    return dot(a, b.as_packed_ref());
   }
   NOT_REACHABLE;
 }
@@ -582,6 +944,21 @@ dot(const vec<T1> &a, const sparse_vec<T2> &b)
   return dot(b, a);
 }
 
+template <typename T1, typename T2>
+static inline typename std::common_type<T1, T2>::type
+dot(const packed_vec<T1> &a, const vec<T2> &b)
+{
+  switch (b.get_tag()) {
+  case vec<T2>::tag::STD:
+    return dot(a, b.as_standard_ref());
+  case vec<T2>::tag::SPARSE:
+    return dot(a, b.as_sparse_ref());
+  case vec<T2>::tag::PACKED:
+    return dot(a, b.as_packed_ref());
+  }
+  NOT_REACHABLE;
+}
+
 template <typename T1, typename T2>
 static inline typename std::common_type<T1, T2>::type
 dot(const vec<T1> &a, const vec<T2> &b)
@@ -591,6 +968,8 @@ dot(const vec<T1> &a, const vec<T2> &b)
     return dot(a.as_standard_ref(), b);
   case vec<T1>::tag::SPARSE:
     return dot(a.as_sparse_ref(), b);
+  case vec<T1>::tag::PACKED:
+    return dot(a.as_packed_ref(), b);
   }
   NOT_REACHABLE;
 }
@@ -636,7 +1015,7 @@ template <typename T>
 class sparse_vec : public vec<T> {
 public:
   typedef std::pair<size_t, T> entry_type;
-  typedef std::vector<entry_type> repr_type;
+  typedef typename vec<T>::sparse_repr_type repr_type;
 
 private:
   struct cmp {
@@ -660,6 +1039,7 @@ public:
   sparse_vec(const sparse_vec &) = default;
   sparse_vec &operator=(const sparse_vec &) = default;
   sparse_vec(sparse_vec &&) = default;
+  sparse_vec &operator=(sparse_vec &&) = default;
 
           /** vec api **/
 
@@ -834,6 +1214,188 @@ operator-(const sparse_vec<T1> &a, const sparse_vec<T2> &b)
   return ret -= b;
 }
 
+/**
+ * Read-only compressed form of a sparse vector. The whole vector lives in a
+ * single byte buffer:
+ *
+ *   [nnz (uint32_t) | values_off (uint32_t) |
+ *    index deltas (varint)* (nnz repetitions) | zero padding |
+ *    values (T)* (nnz repetitions), starting at values_off]
+ *
+ * The first delta is the first index itself. Since sorted rows mostly have
+ * small gaps, indices usually cost one byte instead of sizeof(size_t) plus
+ * the pair padding, which matters once training becomes bandwidth bound.
+ * Indices are decoded on the fly by for_each_nonzero() and the iterators.
+ */
+template <typename T>
+class packed_vec : public vec<T> {
+public:
+  typedef typename vec<T>::packed_repr_type repr_type;
+
+  struct header {
+    uint32_t nnz_;
+    uint32_t values_off_;
+  } __attribute__((packed));
+
+  packed_vec()
+    : vec<T>(typename vec<T>::packed_tag_t(), encode(sparse_vec<T>())) {}
+
+  explicit packed_vec(const vec<T> &v)
+    : vec<T>(typename vec<T>::packed_tag_t(), encode(v)) {}
+
+  packed_vec(const packed_vec &) = default;
+  packed_vec &operator=(const packed_vec &) = default;
+  packed_vec(packed_vec &&) = default;
+  packed_vec &operator=(packed_vec &&) = default;
+
+  // v must store its entries in ascending index order
+  // the encoding is sized exactly up front, so it can go in an arena
+  static inline repr_type
+  encode(const vec<T> &v, mem::arena *a = nullptr)
+  {
+    const size_t n = v.nnz();
+    size_t delta_bytes = 0;
+    size_t last = 0;
+    v.for_each_nonzero([&delta_bytes, &last](size_t idx, T) {
+      assert(idx >= last);
+      delta_bytes += codec::varint_size(idx - last);
+      last = idx;
+    });
+    const size_t off =
+      (sizeof(header) + delta_bytes + sizeof(T) - 1) / sizeof(T) * sizeof(T);
+    ALWAYS_ASSERT(off + n * sizeof(T) <= std::numeric_limits<uint32_t>::max());
+    repr_type buf(off + n * sizeof(T), 0, mem::row_allocator<uint8_t>(a));
+    uint8_t *q = &buf[sizeof(header)];
+    last = 0;
+    v.for_each_nonzero([&q, &last](size_t idx, T) {
+      q = codec::varint_encode(q, idx - last);
+      last = idx;
+    });
+    T * const px = reinterpret_cast<T *>(&buf[off]);
+    size_t i = 0;
+    v.for_each_nonzero([px, &i](size_t, T value) { px[i++] = value; });
+    header h;
+    h.nnz_ = n;
+    h.values_off_ = off;
+    memcpy(&buf[0], &h, sizeof(h));
+    return buf;
+  }
+
+          /** vec api **/
+
+  inline T
+  norm() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    T sum = T();
+    const T * const px = values();
+    const size_t n = nnz();
+    for (size_t i = 0; i < n; i++)
+      sum += px[i] * px[i];
+    return sqrt(sum);
+  }
+
+  inline T
+  sum() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    T accum = T();
+    const T * const px = values();
+    const size_t n = nnz();
+    for (size_t i = 0; i < n; i++)
+      accum += px[i];
+    return accum;
+  }
+
+  inline size_t
+  highest_nonzero_dim() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    const size_t n = nnz();
+    if (!n)
+      return 0;
+    const uint8_t *q = deltas();
+    size_t idx = 0;
+    for (size_t i = 0; i < n; i++)
+      idx += codec::varint_decode(q);
+    return idx + 1;
+  }
+
+  inline size_t
+  nnz() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    return hdr().nnz_;
+  }
+
+          /** specific api **/
+
+  inline const T *
+  values() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    return reinterpret_cast<const T *>(
+        this->packed_repr_.data() + hdr().values_off_);
+  }
+
+  inline const uint8_t *
+  deltas() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    return this->packed_repr_.data() + sizeof(header);
+  }
+
+  // number of bytes used by the encoded vector
+  inline size_t
+  encoded_size() const
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    return this->packed_repr_.size();
+  }
+
+  inline sparse_vec<T>
+  unpack() const
+  {
+    sparse_vec<T> ret;
+    ret.reserve(nnz());
+    this->for_each_nonzero([&ret](size_t idx, T value) {
+      ret.data().emplace_back(idx, value);
+    });
+    return ret;
+  }
+
+  template <typename U>
+  inline packed_vec &
+  operator*=(U scale)
+  {
+    assert(this->tag_ == vec<T>::tag::PACKED);
+    T * const px = const_cast<T *>(values());
+    const size_t n = nnz();
+    for (size_t i = 0; i < n; i++)
+      px[i] *= scale;
+    return *this;
+  }
+
+private:
+  inline header
+  hdr() const
+  {
+    header h;
+    memcpy(&h, this->packed_repr_.data(), sizeof(h));
+    return h;
+  }
+};
+
+typedef packed_vec<double> packed_vec_t;
+
+template <typename T>
+static inline std::ostream &
+operator<<(std::ostream &o, const packed_vec<T> &v)
+{
+  o << v.unpack().data();
+  return o;
+}
+
                     /** mixed operations */
 
 template <typename T1, typename T2>
@@ -933,44 +1495,125 @@ vec<T>::as_sparse_ref() const
   return *as_sparse_ptr();
 }
 
+template <typename T>
+inline packed_vec<T> &
+vec<T>::as_packed_ref()
+{
+  assert(tag_ == vec<T>::tag::PACKED);
+  return *static_cast<packed_vec<T> *>(this);
+}
+
+template <typename T>
+inline const packed_vec<T> &
+vec<T>::as_packed_ref() const
+{
+  assert(tag_ == vec<T>::tag::PACKED);
+  return *static_cast<const packed_vec<T> *>(this);
+}
+
+template <typename T>
+inline void
+vec<T>::pack(mem::arena *a)
+{
+  if (tag_ != vec<T>::tag::SPARSE)
+    return;
+  packed_repr_type buf(packed_vec<T>::encode(*this, a));
+  destroy();
+  tag_ = vec<T>::tag::PACKED;
+  new (&packed_repr_) packed_repr_type(std::move(buf));
+}
+
+template <typename T>
+template <typename Fn>
+inline void
+vec<T>::packed_for_each_nonzero(Fn f) const
+{
+  const packed_vec<T> &pv = as_packed_ref();
+  const T * const px = pv.values();
+  const uint8_t *q = pv.deltas();
+  const size_t n = pv.nnz();
+  size_t idx = 0;
+  for (size_t i = 0; i < n; i++) {
+    idx += codec::varint_decode(q);
+    f(idx, px[i]);
+  }
+}
+
 template <typename T>
 inline T &
 vec<T>::ensureref(size_t i)
 {
-  return tag_ == vec<T>::tag::STD ?
-    as_standard_ref().ensureref(i) : as_sparse_ref().ensureref(i);
+  switch (tag_) {
+  case vec<T>::tag::STD:
+    return as_standard_ref().ensureref(i);
+  case vec<T>::tag::SPARSE:
+    return as_sparse_ref().ensureref(i);
+  case vec<T>::tag::PACKED:
+    // packed vectors are read-only
+    break;
+  }
+  NOT_REACHABLE;
 }
 
 template <typename T>
 inline T
 vec<T>::norm() const
 {
-  return tag_ == vec<T>::tag::STD ?
-    as_standard_ref().norm() : as_sparse_ref().norm();
+  switch (tag_) {
+  case vec<T>::tag::STD:
+    return as_standard_ref().norm();
+  case vec<T>::tag::SPARSE:
+    return as_sparse_ref().norm();
+  case vec<T>::tag::PACKED:
+    return as_packed_ref().norm();
+  }
+  NOT_REACHABLE;
 }
 
 template <typename T>
 inline void
 vec<T>::reserve(size_t n)
 {
-  tag_ == vec<T>::tag::STD ?
-    as_standard_ref().reserve(n) : as_sparse_ref().reserve(n);
+  switch (tag_) {
+  case vec<T>::tag::STD:
+    as_standard_ref().reserve(n);
+    return;
+  case vec<T>::tag::SPARSE:
+    as_sparse_ref().reserve(n);
+    return;
+  case vec<T>::tag::PACKED:
+    return;
+  }
 }
 
 template <typename T>
 inline size_t
 vec<T>::highest_nonzero_dim() const
 {
-  return tag_ == vec<T>::tag::STD ?
-    as_standard_ref().highest_nonzero_dim() : as_sparse_ref().highest_nonzero_dim();
+  switch (tag_) {
+  case vec<T>::tag::STD:
+    return as_standard_ref().highest_nonzero_dim();
+  case vec<T>::tag::SPARSE:
+    return as_sparse_ref().highest_nonzero_dim();
+  case vec<T>::tag::PACKED:
+    return as_packed_ref().highest_nonzero_dim();
+  }
+  NOT_REACHABLE;
 }
 
 template <typename T>
 inline size_t
 vec<T>::nnz() const
 {
-  return tag_ == vec<T>::tag::STD ?
-    as_standard_ref().nnz() : as_sparse_ref().nnz();
+  switch (tag_) {
+  case vec<T>::tag::STD:
+    return as_standard_ref().nnz();
+  case vec<T>::tag::SPARSE:
+    return as_sparse_ref().nnz();
+  case vec<T>::tag::PACKED:
+    return as_packed_ref().nnz();
+  }
+  NOT_REACHABLE;
 }
 
 template <typename T1, typename T2>
@@ -982,6 +1625,8 @@ operator*=(vec<T1> &a, T2 b)
     return a.as_standard_ref() *= b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() *= b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref() *= b;
   }
   NOT_REACHABLE;
 }
@@ -995,6 +1640,8 @@ operator+(const standard_vec<T1> &a, const vec<T2> &b)
     return a + b.as_standard_ref();
   case vec<T2>::tag::SPARSE:
     return a + b.as_sparse_ref();
+  case vec<T2>::tag::PACKED:
+    return a + b.as_packed_ref().unpack();
   }
   NOT_REACHABLE;
 }
@@ -1015,6 +1662,8 @@ operator+(const sparse_vec<T1> &a, const vec<T2> &b)
     return a + b.as_standard_ref();
   case vec<T2>::tag::SPARSE:
     return a + b.as_sparse_ref();
+  case vec<T2>::tag::PACKED:
+    return a + b.as_packed_ref().unpack();
   }
   NOT_REACHABLE;
 }
@@ -1035,6 +1684,8 @@ operator+(const vec<T1> &a, const vec<T2> &b)
     return a.as_standard_ref() + b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() + b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref().unpack() + b;
   }
   NOT_REACHABLE;
 }
@@ -1048,6 +1699,8 @@ operator+=(standard_vec<T1> &a, const vec<T2> &b)
     return a += b.as_standard_ref();
   case vec<T2>::tag::SPARSE:
     return a += b.as_sparse_ref();
+  case vec<T2>::tag::PACKED:
+    return a += b.as_packed_ref().unpack();
   }
   NOT_REACHABLE;
 }
@@ -1061,6 +1714,8 @@ operator-(const standard_vec<T1> &a, const vec<T2> &b)
     return a - b.as_standard_ref();
   case vec<T2>::tag::SPARSE:
     return a - b.as_sparse_ref();
+  case vec<T2>::tag::PACKED:
+    return a - b.as_packed_ref().unpack();
   }
   NOT_REACHABLE;
 }
@@ -1074,6 +1729,8 @@ operator-(const vec<T1> &a, const standard_vec<T2> &b)
     return a.as_standard_ref() - b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() - b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref().unpack() - b;
   }
   NOT_REACHABLE;
 }
@@ -1087,6 +1744,8 @@ operator-(const sparse_vec<T1> &a, const vec<T2> &b)
     return a - b.as_standard_ref();
   case vec<T2>::tag::SPARSE:
     return a - b.as_sparse_ref();
+  case vec<T2>::tag::PACKED:
+    return a - b.as_packed_ref().unpack();
   }
   NOT_REACHABLE;
 }
@@ -1100,6 +1759,8 @@ operator-(const vec<T1> &a, const sparse_vec<T2> &b)
     return a.as_standard_ref() - b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() - b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref().unpack() - b;
   }
   NOT_REACHABLE;
 }
@@ -1113,6 +1774,8 @@ operator-(const vec<T1> &a, const vec<T2> &b)
     return a.as_standard_ref() - b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() - b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref().unpack() - b;
   }
   NOT_REACHABLE;
 }
@@ -1126,6 +1789,8 @@ operator*(const vec<T1> &a, T2 b)
     return a.as_standard_ref() * b;
   case vec<T1>::tag::SPARSE:
     return a.as_sparse_ref() * b;
+  case vec<T1>::tag::PACKED:
+    return a.as_packed_ref().unpack() * b;
   }
   NOT_REACHABLE;
 }
@@ -1178,6 +1843,8 @@ operator<<(std::ostream &o, const vec<T> &v)
     return o << v.as_standard_ref();
   case vec<T>::tag::SPARSE:
     return o << v.as_sparse_ref();
+  case vec<T>::tag::PACKED:
+    return o << v.as_packed_ref();
   }
   NOT_REACHABLE;
 }